@@ -0,0 +1,215 @@
+#include "./rqueue.h"
+
+/* Queues with sparse segments or chunks, compacted in FIFO order */
+static rqueue_t *scheduled_first = NULL;
+static rqueue_t *scheduled_last = NULL;
+
+/* Queue in compactStep: what it frees or relocates is taken care of by then */
+static rqueue_t *compacting = NULL;
+
+/* Appends the queue to the schedule, to be compacted from "seg" of "queue".
+ * A queue already scheduled for its delivered queue only (see
+ * compactScheduleOffload) gets its undelivered queue done afterwards. */
+static void scheduleFrom(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg){
+	if(rqueue->compact_queue){
+		if(queue == &rqueue->undelivered && rqueue->compact_queue == &rqueue->delivered && rqueue != compacting){
+			rqueue->compact_undelivered = 1;
+		}
+		return;
+	}
+
+	rqueue->compact_queue = queue;
+	rqueue->compact_seg = seg;
+	rqueue->compact_next = NULL;
+	rqueue->compact_prev = scheduled_last;
+	if(scheduled_last){
+		scheduled_last->compact_next = rqueue;
+	} else {
+		scheduled_first = rqueue;
+	}
+	scheduled_last = rqueue;
+}
+
+void compactSchedule(rqueue_t *rqueue){
+	scheduleFrom(rqueue, &rqueue->undelivered, rqueue->undelivered.first);
+}
+
+void compactScheduleOffload(rqueue_t *rqueue, msg_segment_t *seg){
+	scheduleFrom(rqueue, &rqueue->delivered, seg);
+}
+
+void compactUnschedule(rqueue_t *rqueue){
+	if(rqueue->compact_queue == NULL){
+		return;
+	}
+
+	if(rqueue->compact_prev){
+		rqueue->compact_prev->compact_next = rqueue->compact_next;
+	} else {
+		scheduled_first = rqueue->compact_next;
+	}
+
+	if(rqueue->compact_next){
+		rqueue->compact_next->compact_prev = rqueue->compact_prev;
+	} else {
+		scheduled_last = rqueue->compact_prev;
+	}
+
+	rqueue->compact_prev = rqueue->compact_next = NULL;
+	rqueue->compact_queue = NULL;
+	rqueue->compact_seg = NULL;
+	rqueue->compact_undelivered = 0;
+}
+
+/* Copies the message at "spos" of "src" to the slot at "dpos" of "dst" */
+static void segmentCopySlot(msg_segment_t *dst, uint32_t dpos, const msg_segment_t *src, uint32_t spos){
+	dst->ms[dpos] = src->ms[spos];
+	dst->seq[dpos] = src->seq[spos];
+	dst->lastDelivery[dpos] = src->lastDelivery[spos];
+	dst->deliveries[dpos] = src->deliveries[spos];
+	dst->batch[dpos] = src->batch[spos];
+	dst->extend[dpos] = src->extend[spos];
+	dst->lease[dpos] = src->lease[spos];
+	dst->payload[dpos] = src->payload[spos];
+}
+
+/* Moves the live messages of "seg" to the start of the segment */
+static void segmentPack(msg_segment_t *seg, rq_compact_stats_t *stats){
+	uint32_t dst = 0;
+
+	for(uint32_t i = seg->head; i < seg->tail; i++){
+		if(!segmentIsLive(seg, i)){
+			continue;
+		}
+		if(i != dst){
+			segmentCopySlot(seg, dst, seg, i);
+			stats->messages_moved += 1;
+		}
+		dst++;
+	}
+
+	seg->head = 0;
+	seg->tail = dst;
+	seg->freed = 0;
+}
+
+/* Moves all the live messages of the segment following "seg" into "seg", and
+ * frees the emptied one. Both must fit in a single segment. */
+static void segmentMergeNext(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg, rq_compact_stats_t *stats){
+	msg_segment_t *next = seg->next;
+	int indexed = (queue == &rqueue->delivered);
+	msgid_t id;
+
+	segmentPack(seg, stats);
+
+	for(uint32_t i = next->head; i < next->tail; i++){
+		if(!segmentIsLive(next, i)){
+			continue;
+		}
+		segmentCopySlot(seg, seg->tail++, next, i);
+		seg->live += 1;
+		if(indexed){
+			id.ms = next->ms[i];
+			id.seq = next->seq[i];
+			rq_index_add(rqueue, &id, seg);
+		}
+		stats->messages_moved += 1;
+	}
+
+	seg->next = next->next;
+	if(next->next){
+		next->next->prev = seg;
+	} else {
+		queue->last = seg;
+	}
+
+	RedisModule_Free(next);
+	rqueue->memory_used -= sizeof(*next);
+	stats->segments_freed += 1;
+}
+
+/* Compacts from where the last pass left off, see compactStep */
+static int compactPass(rqueue_t *rqueue, long long deadline, rq_compact_stats_t *stats){
+	msg_segment_t *seg;
+
+	while(rqueue->compact_queue){
+		while((seg = rqueue->compact_seg) != NULL){
+			if(deadline && ustime() >= deadline){
+				return 0;
+			}
+
+			// Never across the spilled messages, which sit in between. Long runs
+			// of emptied segments may take many merges: the next pass goes on
+			// merging into this one.
+			while(
+				seg->next && seg->live + seg->next->live <= SEGMENT_SIZE &&
+				!(rqueue->compact_queue->spill && seg->next == rqueue->compact_queue->spill->next)
+			){
+				segmentMergeNext(rqueue, rqueue->compact_queue, seg, stats);
+				if(deadline && ustime() >= deadline){
+					return 0;
+				}
+			}
+
+			// Most payloads are never read again once delivered
+			for(uint32_t i = seg->head; i < seg->tail; i++){
+				if(!segmentIsLive(seg, i)){
+					continue;
+				}
+				if(rqueue->compact_queue == &rqueue->delivered && payloadOffload(rqueue, &seg->payload[i])){
+					stats->payloads_moved += 1;
+				} else {
+					stats->payloads_moved += payloadRelocate(rqueue, &seg->payload[i]);
+				}
+			}
+
+			rqueue->compact_seg = seg->next;
+		}
+
+		// Undelivered queue done: go on with the delivered one (and the other
+		// way around, if requested meanwhile)
+		if(rqueue->compact_queue == &rqueue->undelivered){
+			rqueue->compact_queue = &rqueue->delivered;
+			rqueue->compact_seg = rqueue->delivered.first;
+		} else if(rqueue->compact_undelivered){
+			rqueue->compact_undelivered = 0;
+			rqueue->compact_queue = &rqueue->undelivered;
+			rqueue->compact_seg = rqueue->undelivered.first;
+		} else {
+			break;
+		}
+	}
+
+	return 1;
+}
+
+int compactStep(rqueue_t *rqueue, long long deadline, rq_compact_stats_t *stats){
+	int done;
+
+	compacting = rqueue;
+	done = compactPass(rqueue, deadline, stats);
+	compacting = NULL;
+
+	return done;
+}
+
+static void compactTimerHandler(RedisModuleCtx *ctx, void *data){
+	REDISMODULE_NOT_USED(data);
+
+	long long deadline = ustime() + COMPACT_TICK_BUDGET;
+	rq_compact_stats_t stats = { 0, 0, 0 };
+	rqueue_t *rqueue;
+
+	while((rqueue = scheduled_first) != NULL){
+		if(!compactStep(rqueue, deadline, &stats)){
+			break;
+		}
+		compactUnschedule(rqueue);
+	}
+
+	compactStartTimer(ctx);
+}
+
+void compactStartTimer(RedisModuleCtx *ctx){
+	RedisModule_CreateTimer(ctx, COMPACT_PERIOD, compactTimerHandler, NULL);
+}
@@ -0,0 +1,42 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+
+#define COMPACT_PERIOD 100 /* Milliseconds between compaction ticks */
+#define COMPACT_TICK_BUDGET 1000 /* Max microseconds of work per tick */
+
+struct rqueue_t;
+struct msg_segment_t;
+
+/* Work done by a compaction pass */
+typedef struct rq_compact_stats_t {
+    long long segments_freed;
+    long long messages_moved;
+    long long payloads_moved;
+} rq_compact_stats_t;
+
+/* Starts the periodic timer that incrementally compacts the scheduled queues */
+void compactStartTimer(RedisModuleCtx *ctx);
+
+/* Schedules the queue for compaction, if it's not scheduled yet */
+void compactSchedule(struct rqueue_t *rqueue);
+
+/* Schedules the delivered messages from "seg" on to be offloaded, if the
+ * queue is not scheduled yet */
+void compactScheduleOffload(struct rqueue_t *rqueue, struct msg_segment_t *seg);
+
+/* Removes the queue from the compaction schedule */
+void compactUnschedule(struct rqueue_t *rqueue);
+
+/**
+ * Merges adjacent sparse segments, moves inline payloads out of sparse
+ * chunks and offloads delivered payloads, starting where the previous pass
+ * stopped.
+ * @param deadline ustime() at which to stop, or 0 for no time limit
+ * @return int 1 if the whole queue was compacted, 0 if the deadline was hit
+ */
+int compactStep(struct rqueue_t *rqueue, long long deadline, rq_compact_stats_t *stats);
+
+#endif
@@ -1,4 +1,21 @@
 
-#define MQ_ERROR_POP_USAGE "usage: RQ.POP <count:uint> [ BLOCK <milliseconds:int> ] <queue1:string> [ <queue2:string> [ ... ] ]"
+#define MQ_ERROR_POP_USAGE "usage: RQ.POP <count:uint> [ BLOCK <milliseconds:int> ] [ LEASE <milliseconds:uint>|AUTO ] [ NOACK ] [ BATCH ] [ FORMAT GROUPED|PACKED ] <queue1:string> [ <queue2:string> [ ... ] ]"
+#define MQ_ERROR_ACKPOP_USAGE "usage: RQ.ACKPOP <key> [ <id1> [ ... ] ] POP [ COUNT <count:uint> ] [ BLOCK <milliseconds:int> ] [ LEASE <milliseconds:uint>|AUTO ] [ NOACK ] [ BATCH ] [ FORMAT GROUPED|PACKED ] <queue1:string> [ <queue2:string> [ ... ] ]"
+#define MQ_ERROR_PUSHEX_USAGE "usage: RQ.PUSHEX <key> [ RANGE ] [ DELAY <milliseconds:uint> | AT <unix-milliseconds:uint> ] PAYLOADS <elem1> [ <elem2> [ ... ] ]"
+#define MQ_ERROR_PUSHPACKED_USAGE "usage: RQ.PUSHPACKED <key> [ RANGE ] <packed:string>"
+#define MQ_ERROR_INVALID_PACKED "ERR invalid packed payloads"
+#define MQ_ERROR_MPUSH_USAGE "usage: RQ.MPUSH <key1> <count1:uint> <elem1> [ ... ] [ <key2> <count2:uint> <elem1> [ ... ] [ ... ] ]"
+#define MQ_ERROR_MACK_USAGE "usage: RQ.MACK <key1> <count1:uint> <id1> [ ... ] [ <key2> <count2:uint> <id1> [ ... ] [ ... ] ]"
+#define MQ_ERROR_ACK_BATCH_USAGE "usage: RQ.ACK <key> BATCH <token> [ EXCEPT <id1> [ <id2> [ ... ] ] ]"
+#define MQ_ERROR_TOUCH_USAGE "usage: RQ.TOUCH <key> <id1> [ <id2> [ ... ] ] [ EXTEND <milliseconds:uint> ]"
+#define MQ_ERROR_NACK_USAGE "usage: RQ.NACK <key> <id1> [ <id2> [ ... ] ] [ DELAY <milliseconds:uint> | BACKOFF ]"
+#define MQ_ERROR_EXEC_USAGE "usage: RQ.EXEC <numkeys:uint> <key1> [ <key2> [ ... ] ] <ops:string>"
+#define MQ_ERROR_INVALID_OPS "ERR invalid RQ.EXEC operations"
+#define MQ_ERROR_INVALID_ID "ERR invalid message ID"
+#define MQ_ERROR_INVALID_BATCH "ERR invalid batch token"
 #define MQ_ERROR_INSPECT_USAGE "usage: RQ.INSPECT <key> [ PENDING ] <start:int> <count:uint>"
 #define MQ_ERROR_RECOVER_USAGE "usage: RQ.RECOVER <key> <count:uint> <elapsed:uint>"
+#define MQ_ERROR_CONFIG_USAGE "usage: RQ.CONFIG <key> [ <setting> <value> [ ... ] ]"
+#define MQ_ERROR_CONFIG_SETTING "ERR unknown setting, or invalid value"
+#define MQ_ERROR_CONFIG_DEADLETTER "ERR DEADLETTER must be the key of another queue in the same slot, or an empty one"
+#define MQ_ERROR_CORRUPT_PAYLOAD "ERR corrupt compressed payload"
@@ -0,0 +1,126 @@
+#include <string.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+#include "./intern.h"
+
+static interned_t **buckets = NULL;
+static size_t nbuckets = 0; // Always a power of 2
+static size_t entries = 0;
+static size_t memory = 0;
+
+/* MurmurHash64A, by Austin Appleby (public domain) */
+static uint64_t internHash(const char *buf, size_t len){
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const unsigned char *tail = (const unsigned char *) buf + (len & ~(size_t) 7);
+	uint64_t h = 0x5bd1e995 ^ (len * m);
+	uint64_t k;
+
+	for(const char *p = buf; p < (const char *) tail; p += 8){
+		memcpy(&k, p, sizeof(k));
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	switch(len & 7){
+		case 7: h ^= (uint64_t) tail[6] << 48; /* fall through */
+		case 6: h ^= (uint64_t) tail[5] << 40; /* fall through */
+		case 5: h ^= (uint64_t) tail[4] << 32; /* fall through */
+		case 4: h ^= (uint64_t) tail[3] << 24; /* fall through */
+		case 3: h ^= (uint64_t) tail[2] << 16; /* fall through */
+		case 2: h ^= (uint64_t) tail[1] << 8;  /* fall through */
+		case 1: h ^= (uint64_t) tail[0];
+			h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+/* Doubles the number of buckets (or creates the first ones) */
+static void internGrow(void){
+	size_t size = nbuckets ? nbuckets * 2 : INTERN_INITIAL_BUCKETS;
+	interned_t **table = RedisModule_Calloc(size, sizeof(*table));
+	interned_t *entry, *next;
+
+	for(size_t i = 0; i < nbuckets; i++){
+		for(entry = buckets[i]; entry; entry = next){
+			next = entry->next;
+			entry->next = table[entry->hash & (size - 1)];
+			table[entry->hash & (size - 1)] = entry;
+		}
+	}
+
+	if(buckets){
+		RedisModule_Free(buckets);
+	}
+	memory += (size - nbuckets) * sizeof(*table);
+	buckets = table;
+	nbuckets = size;
+}
+
+interned_t *internAcquire(const char *buf, size_t len, int *hit){
+	uint64_t hash = internHash(buf, len);
+	interned_t *entry;
+
+	if(entries >= nbuckets){
+		internGrow();
+	}
+
+	for(entry = buckets[hash & (nbuckets - 1)]; entry; entry = entry->next){
+		if(entry->hash == hash && entry->len == len && memcmp(entry->data, buf, len) == 0){
+			entry->refs += 1;
+			*hit = 1;
+			return entry;
+		}
+	}
+
+	entry = RedisModule_Alloc(sizeof(*entry) + len);
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->len = len;
+	memcpy(entry->data, buf, len);
+	entry->next = buckets[hash & (nbuckets - 1)];
+	buckets[hash & (nbuckets - 1)] = entry;
+	entries += 1;
+	memory += INTERN_ENTRY_OVERHEAD + len;
+
+	*hit = 0;
+	return entry;
+}
+
+void internRelease(interned_t *entry){
+	interned_t **pp;
+
+	if(--entry->refs > 0){
+		return;
+	}
+
+	for(pp = &buckets[entry->hash & (nbuckets - 1)]; *pp != entry; pp = &(*pp)->next);
+	*pp = entry->next;
+	entries -= 1;
+	memory -= INTERN_ENTRY_OVERHEAD + entry->len;
+	RedisModule_Free(entry);
+
+	// Give back the buckets once nothing is interned anymore
+	if(entries == 0){
+		RedisModule_Free(buckets);
+		memory -= nbuckets * sizeof(*buckets);
+		buckets = NULL;
+		nbuckets = 0;
+	}
+}
+
+size_t internCount(void){
+	return entries;
+}
+
+size_t internMemory(void){
+	return memory;
+}
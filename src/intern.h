@@ -0,0 +1,34 @@
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INTERN_INITIAL_BUCKETS 1024
+#define INTERN_ENTRY_OVERHEAD 40 /* Header of an entry, plus allocator overhead */
+
+/**
+ * Module-wide table of interned payloads: identical payloads pushed to any
+ * queue with interning enabled are stored once, and shared by reference
+ * counting.
+ */
+typedef struct interned_t {
+    struct interned_t *next; // Next entry in the same bucket
+    uint64_t hash;
+    uint32_t refs;
+    uint32_t len;
+    char data[];
+} interned_t;
+
+/* Returns the entry holding a copy of "buf", creating it if needed, with one
+ * more reference. Sets "hit" to 1 if the entry already existed. */
+interned_t *internAcquire(const char *buf, size_t len, int *hit);
+
+/* Drops one reference to the entry, freeing it with the last one */
+void internRelease(interned_t *entry);
+
+/* Entries in the table, and bytes they use */
+size_t internCount(void);
+size_t internMemory(void);
+
+#endif
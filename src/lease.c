@@ -0,0 +1,358 @@
+#include <string.h>
+#include "./rqueue.h"
+
+#define LEASE_WHEEL_SIZE (1 << LEASE_WHEEL_BITS)
+#define LEASE_WHEEL_MASK (LEASE_WHEEL_SIZE - 1)
+#define LEASE_WHEEL_SPAN (1LL << (LEASE_WHEEL_BITS * LEASE_WHEEL_LEVELS)) /* Milliseconds covered by the wheel */
+
+/* Hierarchical timing wheel: a slot of the level N holds the leases expiring
+ * within its (1 << LEASE_WHEEL_BITS)^N milliseconds. Slots of the upper levels
+ * are spread over the lower ones as time gets to them, so every lease is only
+ * moved once per level, and a tick just looks at the slots it gets to. */
+static lease_t *wheel[LEASE_WHEEL_LEVELS][LEASE_WHEEL_SIZE];
+static long long wheel_time = 0; // Next millisecond to process
+static uint64_t wheel_count = 0; // Leases scheduled
+
+static void wheelInsert(lease_t *lease){
+	long long expires = lease->expires;
+	long long delta = expires - wheel_time;
+	lease_t **slot;
+	int level = 0;
+
+	// Already expired: fire on the next tick
+	if(delta < 0){
+		expires = wheel_time;
+		delta = 0;
+	}
+
+	// Too far ahead: parked at the farthest slot, and inserted again from there
+	if(delta >= LEASE_WHEEL_SPAN){
+		expires = wheel_time + LEASE_WHEEL_SPAN - 1;
+		delta = LEASE_WHEEL_SPAN - 1;
+	}
+
+	while(delta >= (1LL << (LEASE_WHEEL_BITS * (level + 1)))){
+		level++;
+	}
+
+	slot = &wheel[level][(expires >> (LEASE_WHEEL_BITS * level)) & LEASE_WHEEL_MASK];
+	lease->slot = slot;
+	lease->prev = NULL;
+	lease->next = *slot;
+	if(*slot){
+		(*slot)->prev = lease;
+	}
+	*slot = lease;
+}
+
+/* Takes the leases out of a slot, as a list linked by "next" */
+static lease_t *wheelTake(lease_t **slot){
+	lease_t *list = *slot;
+
+	*slot = NULL;
+
+	return list;
+}
+
+static void wheelRemove(lease_t *lease){
+	if(lease->prev){
+		lease->prev->next = lease->next;
+	} else {
+		*lease->slot = lease->next;
+	}
+	if(lease->next){
+		lease->next->prev = lease->prev;
+	}
+	wheel_count -= 1;
+}
+
+/* Leases and delayed messages are listed apart in their queue */
+static lease_t **leaseQueueList(lease_t *lease){
+	return lease->payloads ? &lease->rqueue->delayed : &lease->rqueue->leases;
+}
+
+static void leaseUnlinkQueue(lease_t *lease){
+	rqueue_t *rqueue = lease->rqueue;
+
+	if(lease->qprev){
+		lease->qprev->qnext = lease->qnext;
+	} else {
+		*leaseQueueList(lease) = lease->qnext;
+	}
+	if(lease->qnext){
+		lease->qnext->qprev = lease->qprev;
+	}
+
+	if(lease->payloads){
+		rqueue->stats.delayed -= lease->count;
+	} else {
+		rqueue->stats.leases -= 1;
+	}
+}
+
+static void leaseFree(lease_t *lease){
+	lease->rqueue->memory_used -= sizeof(*lease) + lease->size * 2 * sizeof(uint64_t);
+	if(lease->payloads){
+		lease->rqueue->memory_used -= lease->size * (sizeof(payload_t) + sizeof(uint32_t));
+		RedisModule_Free(lease->payloads);
+	}
+	RedisModule_Free(lease);
+}
+
+lease_t *leaseCreate(rqueue_t *rqueue, uint32_t size, long long expires){
+	lease_t *lease;
+
+	if(size == 0){
+		size = 1;
+	}
+
+	lease = RedisModule_Alloc(sizeof(*lease) + size * 2 * sizeof(uint64_t));
+	lease->rqueue = rqueue;
+	lease->expires = expires;
+	lease->count = 0;
+	lease->size = size;
+	lease->payloads = NULL;
+	rqueue->memory_used += sizeof(*lease) + size * 2 * sizeof(uint64_t);
+
+	return lease;
+}
+
+lease_t *delayCreate(rqueue_t *rqueue, uint32_t size, long long due){
+	lease_t *delayed = leaseCreate(rqueue, size, due);
+
+	delayed->payloads = RedisModule_Alloc(delayed->size * (sizeof(payload_t) + sizeof(uint32_t)));
+	delayed->deliveries = (uint32_t *) (delayed->payloads + delayed->size);
+	rqueue->memory_used += delayed->size * (sizeof(payload_t) + sizeof(uint32_t));
+
+	return delayed;
+}
+
+lease_t *delayPush(lease_t *delayed, uint64_t ms, uint64_t seq, const payload_t *payload, uint32_t deliveries){
+	payload_t *payloads;
+	uint32_t size = delayed->size;
+
+	if(delayed->count == size){
+		delayed->rqueue->memory_used += size * (sizeof(payload_t) + sizeof(uint32_t));
+		payloads = RedisModule_Alloc(2 * size * (sizeof(payload_t) + sizeof(uint32_t)));
+		memcpy(payloads, delayed->payloads, size * sizeof(payload_t));
+		memcpy(payloads + 2 * size, delayed->deliveries, size * sizeof(uint32_t));
+		RedisModule_Free(delayed->payloads);
+		delayed = leasePush(delayed, ms, seq);
+		delayed->payloads = payloads;
+		delayed->deliveries = (uint32_t *) (payloads + delayed->size);
+	} else {
+		delayed->ids[2 * delayed->count] = ms;
+		delayed->ids[2 * delayed->count + 1] = seq;
+		delayed->count += 1;
+	}
+
+	delayed->payloads[delayed->count - 1] = *payload;
+	delayed->deliveries[delayed->count - 1] = deliveries;
+
+	return delayed;
+}
+
+lease_t *leasePush(lease_t *lease, uint64_t ms, uint64_t seq){
+	if(lease->count == lease->size){
+		lease->rqueue->memory_used += lease->size * 2 * sizeof(uint64_t);
+		lease->size *= 2;
+		lease = RedisModule_Realloc(lease, sizeof(*lease) + lease->size * 2 * sizeof(uint64_t));
+	}
+
+	lease->ids[2 * lease->count] = ms;
+	lease->ids[2 * lease->count + 1] = seq;
+	lease->count += 1;
+
+	return lease;
+}
+
+void leaseSchedule(lease_t *lease){
+	rqueue_t *rqueue = lease->rqueue;
+
+	if(lease->count == 0){
+		leaseFree(lease);
+		return;
+	}
+
+	// Nothing to catch up with: start from now
+	if(wheel_count == 0){
+		wheel_time = mstime();
+	}
+
+	wheelInsert(lease);
+	wheel_count += 1;
+
+	lease_t **list = leaseQueueList(lease);
+	lease->qprev = NULL;
+	lease->qnext = *list;
+	if(*list){
+		(*list)->qprev = lease;
+	}
+	*list = lease;
+
+	if(lease->payloads){
+		rqueue->stats.delayed += lease->count;
+	} else {
+		rqueue->stats.leases += 1;
+	}
+}
+
+void leaseFreeAll(rqueue_t *rqueue){
+	lease_t *lease;
+
+	while((lease = rqueue->leases) != NULL){
+		wheelRemove(lease);
+		leaseUnlinkQueue(lease);
+		leaseFree(lease);
+	}
+
+	while((lease = rqueue->delayed) != NULL){
+		wheelRemove(lease);
+		leaseUnlinkQueue(lease);
+		for(uint32_t i = 0; i < lease->count; i++){
+			payloadRelease(rqueue, &lease->payloads[i]);
+		}
+		leaseFree(lease);
+	}
+}
+
+/* Requeues the messages of an expired lease, and schedules the ones refreshed
+ * since again, at their new deadline */
+static void leaseFire(RedisModuleCtx *ctx, lease_t *lease, long long now){
+	rqueue_t *rqueue = lease->rqueue;
+	lease_t *later = NULL;
+	msg_segment_t *seg;
+	long long deadline;
+	uint64_t requeued = 0;
+	msgid_t id;
+	int pos;
+
+	// Keys (of its own, and of its dead-letter queue) are in its database
+	int found = rq_select(ctx, rqueue);
+
+	// Dead letters first, in order, to the tail of their queue
+	for(uint32_t i = 0, ready = rq_deadletter_ready(ctx, rqueue); ready && i < lease->count; i++){
+		id.ms = lease->ids[2 * i];
+		id.seq = lease->ids[2 * i + 1];
+		if(
+			(seg = rq_index_find(rqueue, &id)) != NULL && (pos = segmentFind(seg, &id)) >= 0 &&
+			seg->lease[pos] && segmentDeadline(seg, pos) <= now
+		){
+			rq_deadletter(ctx, rqueue, seg, pos);
+		}
+	}
+
+	// Backwards, so they end up in order at the head of the queue
+	for(uint32_t i = lease->count; i-- > 0; ){
+		id.ms = lease->ids[2 * i];
+		id.seq = lease->ids[2 * i + 1];
+
+		// Acknowledged, or delivered again without a lease
+		if((seg = rq_index_find(rqueue, &id)) == NULL || (pos = segmentFind(seg, &id)) < 0 || seg->lease[pos] == 0){
+			continue;
+		}
+
+		if((deadline = segmentDeadline(seg, pos)) > now){
+			if(later && later->expires != deadline){
+				leaseSchedule(later);
+				later = NULL;
+			}
+			if(later == NULL){
+				later = leaseCreate(rqueue, i + 1, deadline);
+			}
+			later = leasePush(later, id.ms, id.seq);
+			continue;
+		}
+
+		if(rq_deadletter(ctx, rqueue, seg, pos)){
+			continue;
+		}
+
+		rq_requeue(rqueue, seg, pos);
+		requeued += 1;
+	}
+
+	if(later){
+		leaseSchedule(later);
+	}
+
+	if(requeued){
+		rqueue->stats.lease_expired += requeued;
+	}
+	if(requeued && found){
+		RedisModule_SignalKeyAsReady(ctx, rqueue->name);
+	}
+}
+
+/* Appends the delayed messages that are due to the undelivered queue */
+static void delayFire(RedisModuleCtx *ctx, lease_t *delayed){
+	rqueue_t *rqueue = delayed->rqueue;
+	msg_t msg;
+
+	msg.lastDelivery = 0;
+	msg.batch = 0;
+	msg.extend = 0;
+	msg.lease = 0;
+	for(uint32_t i = 0; i < delayed->count; i++){
+		msg.id.ms = delayed->ids[2 * i];
+		msg.id.seq = delayed->ids[2 * i + 1];
+		msg.payload = delayed->payloads[i];
+		msg.deliveries = delayed->deliveries[i];
+		queueAppend(rqueue, &rqueue->undelivered, &msg);
+	}
+
+	spillCheck(rqueue);
+
+	if(rq_select(ctx, rqueue)){
+		RedisModule_SignalKeyAsReady(ctx, rqueue->name);
+	}
+}
+
+/* Processes every millisecond up to "now": spreads the upper level slots it
+ * gets to over the lower levels, and fires the leases of the first level */
+static void wheelAdvance(RedisModuleCtx *ctx, long long now){
+	lease_t *lease, *next;
+
+	while(wheel_count > 0 && wheel_time <= now){
+		for(int level = 1; level < LEASE_WHEEL_LEVELS; level++){
+			if((wheel_time >> (LEASE_WHEEL_BITS * (level - 1))) & LEASE_WHEEL_MASK){
+				break;
+			}
+			for(lease = wheelTake(&wheel[level][(wheel_time >> (LEASE_WHEEL_BITS * level)) & LEASE_WHEEL_MASK]); lease; lease = next){
+				next = lease->next;
+				wheelInsert(lease);
+			}
+		}
+
+		lease = wheelTake(&wheel[0][wheel_time & LEASE_WHEEL_MASK]);
+		wheel_time += 1;
+		for(; lease; lease = next){
+			next = lease->next;
+			wheel_count -= 1;
+			leaseUnlinkQueue(lease);
+			// Parked too far ahead, still on its way
+			if(lease->expires > now){
+				leaseSchedule(lease);
+				continue;
+			}
+			if(lease->payloads){
+				delayFire(ctx, lease);
+			} else {
+				leaseFire(ctx, lease, now);
+			}
+			leaseFree(lease);
+		}
+	}
+}
+
+static void leaseTimerHandler(RedisModuleCtx *ctx, void *data){
+	REDISMODULE_NOT_USED(data);
+
+	wheelAdvance(ctx, mstime());
+
+	leaseStartTimer(ctx);
+}
+
+void leaseStartTimer(RedisModuleCtx *ctx){
+	RedisModule_CreateTimer(ctx, LEASE_PERIOD, leaseTimerHandler, NULL);
+}
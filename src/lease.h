@@ -0,0 +1,67 @@
+#ifndef __LEASE_H__
+#define __LEASE_H__
+
+#include <stdint.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+#include "./payload.h"
+
+#define LEASE_PERIOD 10 /* Milliseconds between lease timer ticks */
+#define LEASE_WHEEL_BITS 6 /* Slots per wheel level: 1 << LEASE_WHEEL_BITS */
+#define LEASE_WHEEL_LEVELS 4 /* 1 ms slots at the first level, up to ~4.6 hours ahead at the last one */
+#define LEASE_AUTO_INITIAL 30000 /* AUTO lease of a queue with less than LEASE_AUTO_SAMPLES acks to learn from */
+#define LEASE_AUTO_SAMPLES 32
+#define LEASE_AUTO_REFRESH 64 /* Acks between updates of the AUTO lease of a queue */
+
+struct rqueue_t;
+
+/**
+ * The visibility timeout of delivered messages of a queue that expire at the
+ * same time, scheduled in the timing wheel. It only holds their ID's: when it
+ * fires, the ones still pending past their deadline are requeued, and the ones
+ * whose lease was refreshed since are scheduled again. Acknowledged messages
+ * are just skipped, so acknowledging never has to look for their lease.
+ *
+ * The messages of a delayed push (RQ.PUSHEX DELAY / AT, or RQ.NACK) wait in the
+ * wheel the same way, with their payloads: when it fires, they're appended to
+ * the undelivered queue.
+ */
+typedef struct lease_t {
+    struct lease_t *prev;  // Links in its wheel slot
+    struct lease_t *next;
+    struct lease_t **slot; // Wheel slot it's in
+    struct lease_t *qprev; // Links in the leases of its queue
+    struct lease_t *qnext;
+    struct rqueue_t *rqueue;
+    long long expires;     // mstime() at which it fires
+    uint32_t count;        // Messages in "ids"
+    uint32_t size;         // Capacity of "ids"
+    payload_t *payloads;   // Payloads of delayed messages (NULL for a visibility timeout)
+    uint32_t *deliveries;  // Deliveries of delayed messages so far (after "payloads")
+    uint64_t ids[];        // ms and seq parts of the ID of every message
+} lease_t;
+
+/* Starts the periodic timer that fires the expired leases */
+void leaseStartTimer(RedisModuleCtx *ctx);
+
+/* Creates an empty lease expiring at "expires", with room for "size" ID's */
+lease_t *leaseCreate(struct rqueue_t *rqueue, uint32_t size, long long expires);
+
+/* Adds a message ID to a lease not scheduled yet, growing it if needed.
+ * Returns the lease, which may have moved. */
+lease_t *leasePush(lease_t *lease, uint64_t ms, uint64_t seq);
+
+/* Schedules the lease in the timing wheel (or frees it, if it's empty) */
+void leaseSchedule(lease_t *lease);
+
+/* Creates an empty set of "size" delayed messages, to be pushed at "due" */
+lease_t *delayCreate(struct rqueue_t *rqueue, uint32_t size, long long due);
+
+/* Adds a message to a set of delayed messages not scheduled yet, which takes
+ * over its payload, growing it if needed. Returns the set, which may have moved. */
+lease_t *delayPush(lease_t *delayed, uint64_t ms, uint64_t seq, const payload_t *payload, uint32_t deliveries);
+
+/* Unschedules and frees every lease of the queue, and its delayed messages */
+void leaseFreeAll(struct rqueue_t *rqueue);
+
+#endif
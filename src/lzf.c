@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <string.h>
+#include "./lzf.h"
+
+#define LZF_HLOG 13 /* log2 of the hash table size */
+#define LZF_MAX_LIT 32 /* Max literal run */
+#define LZF_MAX_OFF 8192 /* Max back reference offset */
+#define LZF_MAX_REF 264 /* Max back reference length */
+
+static inline uint32_t lzfHash(const uint8_t *p){
+	uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - LZF_HLOG);
+}
+
+size_t lzfCompress(const void *in, size_t in_len, void *out, size_t out_len){
+	const uint8_t *base = in, *ip = in, *in_end = base + in_len, *ref;
+	uint8_t *op = out, *out_end = op + out_len, *ctrl;
+	uint32_t htab[1 << LZF_HLOG]; // Position + 1 of the last 3-byte sequence per hash
+	size_t off, len, maxlen;
+	unsigned lit = 0;
+
+	if(in_len == 0 || out_len == 0){
+		return 0;
+	}
+
+	memset(htab, 0, sizeof(htab));
+	ctrl = op++; // Control byte of the current literal run
+
+	while(ip + 2 < in_end){
+		uint32_t h = lzfHash(ip);
+
+		ref = htab[h] ? base + htab[h] - 1 : NULL;
+		htab[h] = ip - base + 1;
+
+		if(
+			ref &&
+			(off = ip - ref - 1) < LZF_MAX_OFF &&
+			ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]
+		){
+			maxlen = in_end - ip;
+			if(maxlen > LZF_MAX_REF){
+				maxlen = LZF_MAX_REF;
+			}
+			for(len = 3; len < maxlen && ref[len] == ip[len]; len++);
+
+			// Close the literal run (or drop its unused control byte)
+			if(lit){
+				*ctrl = lit - 1;
+			} else {
+				op--;
+			}
+
+			if(op + 3 + 1 > out_end){
+				return 0;
+			}
+
+			len -= 2;
+			if(len < 7){
+				*op++ = (len << 5) | (off >> 8);
+			} else {
+				*op++ = (7 << 5) | (off >> 8);
+				*op++ = len - 7;
+			}
+			*op++ = off & 0xff;
+
+			ip += len + 2;
+			ctrl = op++;
+			lit = 0;
+			continue;
+		}
+
+		if(op >= out_end){
+			return 0;
+		}
+		*op++ = *ip++;
+		if(++lit == LZF_MAX_LIT){
+			*ctrl = lit - 1;
+			ctrl = op++;
+			lit = 0;
+		}
+	}
+
+	// Trailing bytes are always literals
+	while(ip < in_end){
+		if(op >= out_end){
+			return 0;
+		}
+		*op++ = *ip++;
+		if(++lit == LZF_MAX_LIT){
+			*ctrl = lit - 1;
+			ctrl = op++;
+			lit = 0;
+		}
+	}
+
+	if(lit){
+		*ctrl = lit - 1;
+	} else {
+		op--;
+	}
+
+	if(op > out_end){
+		return 0;
+	}
+
+	return op - (uint8_t *) out;
+}
+
+size_t lzfDecompress(const void *in, size_t in_len, void *out, size_t out_len){
+	const uint8_t *ip = in, *in_end = ip + in_len;
+	uint8_t *op = out, *out_end = op + out_len, *ref;
+	size_t len;
+
+	while(ip < in_end){
+		unsigned ctrl = *ip++;
+
+		if(ctrl < LZF_MAX_LIT){
+			len = ctrl + 1;
+			if(ip + len > in_end || op + len > out_end){
+				return 0;
+			}
+			memcpy(op, ip, len);
+			op += len;
+			ip += len;
+			continue;
+		}
+
+		len = ctrl >> 5;
+		if(len == 7){
+			if(ip >= in_end){
+				return 0;
+			}
+			len += *ip++;
+		}
+		if(ip >= in_end){
+			return 0;
+		}
+		ref = op - ((ctrl & 0x1f) << 8) - *ip++ - 1;
+		len += 2;
+		if(ref < (uint8_t *) out || op + len > out_end){
+			return 0;
+		}
+
+		// Source and destination may overlap: copy byte by byte
+		while(len--){
+			*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t *) out;
+}
@@ -0,0 +1,20 @@
+#ifndef __LZF_H__
+#define __LZF_H__
+
+#include <stddef.h>
+
+/**
+ * LZF compression: a fast, byte-oriented LZ77 codec. The output is made of
+ * literal runs (a control byte < 32 followed by up to 32 bytes) and back
+ * references (3 bit length, 13 bit offset, with an optional extra length byte).
+ */
+
+/* Compresses "in" into "out". Returns the compressed size, or 0 if it doesn't
+ * fit in "out_len" bytes. */
+size_t lzfCompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+/* Decompresses "in" into "out". Returns the decompressed size, or 0 if the
+ * input is corrupt or the output doesn't fit in "out_len" bytes. */
+size_t lzfDecompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+#endif
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <sys/time.h>
+#include <unistd.h>
 #define REDISMODULE_EXPERIMENTAL_API
 #include "../redismodule.h"
 #include "../rmutil/util.h"
@@ -6,10 +8,9 @@
 #include "../rmutil/test_util.h"
 #include "./module.h"
 #include "./rqueue.h"
+#include "./intern.h"
 #include "./error.h"
 
-static RedisModuleType *RELIABLEQ_TYPE;
-
 /**
  * Return info on a given queue
  */
@@ -30,7 +31,7 @@ int infoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 
 	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
 
-	RedisModule_ReplyWithArray(ctx,4);
+	RedisModule_ReplyWithArray(ctx,68);
 
 	RedisModule_ReplyWithCString(ctx, "undelivered");
 	RedisModule_ReplyWithLongLong(ctx, rqueue->undelivered.len);
@@ -38,150 +39,535 @@ int infoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 	RedisModule_ReplyWithCString(ctx, "delivered");
 	RedisModule_ReplyWithLongLong(ctx, rqueue->delivered.len);
 
+	RedisModule_ReplyWithCString(ctx, "compressed_payloads");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.compressed);
+
+	RedisModule_ReplyWithCString(ctx, "compressed_bytes_in");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.compressed_in);
+
+	RedisModule_ReplyWithCString(ctx, "compressed_bytes_out");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.compressed_out);
+
+	RedisModule_ReplyWithCString(ctx, "compression_ratio");
+	RedisModule_ReplyWithDouble(
+		ctx,
+		rqueue->stats.compressed_out ?
+		(double) rqueue->stats.compressed_in / rqueue->stats.compressed_out :
+		0
+	);
+
+	RedisModule_ReplyWithCString(ctx, "compress_us");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.compress_us);
+
+	RedisModule_ReplyWithCString(ctx, "decompress_us");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.decompress_us);
+
+	RedisModule_ReplyWithCString(ctx, "intern_hits");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.intern_hits);
+
+	RedisModule_ReplyWithCString(ctx, "intern_misses");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.intern_misses);
+
+	RedisModule_ReplyWithCString(ctx, "intern_hit_rate");
+	RedisModule_ReplyWithDouble(
+		ctx,
+		rqueue->stats.intern_hits ?
+		(double) rqueue->stats.intern_hits / (rqueue->stats.intern_hits + rqueue->stats.intern_misses) :
+		0
+	);
+
+	RedisModule_ReplyWithCString(ctx, "intern_bytes_saved");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.intern_saved);
+
+	// Module-wide: the interned payloads table is shared by all queues
+	RedisModule_ReplyWithCString(ctx, "interned_payloads");
+	RedisModule_ReplyWithLongLong(ctx, internCount());
+
+	RedisModule_ReplyWithCString(ctx, "interned_memory");
+	RedisModule_ReplyWithLongLong(ctx, internMemory());
+
+	RedisModule_ReplyWithCString(ctx, "spilled_messages");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->undelivered.spill ? rqueue->undelivered.spill->messages : 0);
+
+	RedisModule_ReplyWithCString(ctx, "spilled_bytes");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->undelivered.spill ? rqueue->undelivered.spill->bytes : 0);
+
+	RedisModule_ReplyWithCString(ctx, "spill_writes");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.spill_writes);
+
+	RedisModule_ReplyWithCString(ctx, "spill_bytes_written");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.spill_bytes_written);
+
+	RedisModule_ReplyWithCString(ctx, "spill_reads");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.spill_reads);
+
+	RedisModule_ReplyWithCString(ctx, "spill_read_avg_us");
+	RedisModule_ReplyWithDouble(
+		ctx,
+		rqueue->stats.spill_reads ?
+		(double) rqueue->stats.spill_read_us / rqueue->stats.spill_reads :
+		0
+	);
+
+	RedisModule_ReplyWithCString(ctx, "spill_read_max_us");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.spill_read_max_us);
+
+	RedisModule_ReplyWithCString(ctx, "offloaded_payloads");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.offloaded);
+
+	RedisModule_ReplyWithCString(ctx, "offloaded_bytes");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.offload_live);
+
+	RedisModule_ReplyWithCString(ctx, "offload_mapped_bytes");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.offload_mapped);
+
+	RedisModule_ReplyWithCString(ctx, "delayed");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.delayed);
+
+	RedisModule_ReplyWithCString(ctx, "nacked");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.nacked);
+
+	RedisModule_ReplyWithCString(ctx, "deadlettered");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.deadlettered);
+
+	RedisModule_ReplyWithCString(ctx, "deadletter_errors");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.deadletter_errors);
+
+	RedisModule_ReplyWithCString(ctx, "leases");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.leases);
+
+	RedisModule_ReplyWithCString(ctx, "lease_expired");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->stats.lease_expired);
+
+	RedisModule_ReplyWithCString(ctx, "ack_latency_samples");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->latency ? rqueue->latency->samples : 0);
+
+	RedisModule_ReplyWithCString(ctx, "ack_latency_p50_ms");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->latency ? sketchQuantile(rqueue->latency, 0.5) : 0);
+
+	RedisModule_ReplyWithCString(ctx, "ack_latency_p99_ms");
+	RedisModule_ReplyWithLongLong(ctx, rqueue->latency ? sketchQuantile(rqueue->latency, 0.99) : 0);
+
+	// What LEASE AUTO stands for right now
+	RedisModule_ReplyWithCString(ctx, "lease_auto_ms");
+	RedisModule_ReplyWithLongLong(ctx, rq_lease(rqueue, POP_LEASE_AUTO));
+
 	return REDISMODULE_OK;
 }
 
-/* Reply callback for blocked RQ.POP */
-int bpop_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/* Returns the queue a blocked client was woken up for, or NULL if it has
+ * nothing to pop (anymore) */
+static rqueue_t *readyQueue(RedisModuleCtx *ctx)
 {
-	RedisModule_AutoMemory(ctx);
-
-	rq_pop_t popargs;
-	long long count;
 	RedisModuleString *key = RedisModule_GetBlockedClientReadyKey(ctx);
 	RedisModuleKey *keyobj = RedisModule_OpenKey(ctx, key, REDISMODULE_READ|REDISMODULE_WRITE);
-	
-	if(RedisModule_KeyType(keyobj) == REDISMODULE_KEYTYPE_EMPTY){
+	rqueue_t *rqueue;
+
+	if(
+		RedisModule_KeyType(keyobj) == REDISMODULE_KEYTYPE_EMPTY ||
+		RedisModule_ModuleTypeGetType(keyobj) != RELIABLEQ_TYPE
+	){
 		RedisModule_CloseKey(keyobj);
-		return REDISMODULE_ERR;
+		return NULL;
 	}
 
-	if(RedisModule_ModuleTypeGetType(keyobj) != RELIABLEQ_TYPE){
+	rqueue = RedisModule_ModuleTypeGetValue(keyobj);
+	if(rqueue->undelivered.len == 0){
 		RedisModule_CloseKey(keyobj);
-		return REDISMODULE_ERR;
+		return NULL;
 	}
 
-	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(keyobj);
+	return rqueue;
+}
 
-	if(rqueue->undelivered.len == 0){
-		RedisModule_CloseKey(keyobj);
+/* Pops up to "pop->count" messages from the given queues, in order, and
+ * replies with them, in "pop->format". With "pop->batch", the reply is a
+ * 2-element array instead: the messages, and the name and lease token of
+ * every queue popped from. Returns the number of messages popped. */
+static long long popQueuesAndReply(RedisModuleCtx *ctx, rqueue_t **queues, int n, const rq_pop_t *pop)
+{
+	rq_batch_t batches[n + 1];
+	rqueue_t *popped[n + 1];
+	long long total = 0, poped, count = pop->count;
+	int tokens = 0;
+
+	if(pop->batch){
+		RedisModule_ReplyWithArray(ctx, 2);
+	}
+
+	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+	for(int i = 0; i < n && count > 0; i++){
+		if((poped = popAndReply(ctx, queues[i], &count, &batches[tokens], pop)) > 0){
+			popped[tokens++] = queues[i];
+			total += poped;
+		}
+	}
+	// Grouped formats reply with an element per queue
+	RedisModule_ReplySetArrayLength(ctx, pop->format == POP_FORMAT_FLAT ? total : tokens);
+
+	if(pop->batch){
+		RedisModule_ReplyWithArray(ctx, tokens * 2);
+		for(int i = 0; i < tokens; i++){
+			RedisModule_ReplyWithString(ctx, popped[i]->name);
+			RedisModule_ReplyWithString(
+				ctx,
+				RedisModule_CreateStringPrintf(
+					ctx, BATCH_TOKEN_FORMAT, batches[i].id,
+					batches[i].first.ms, batches[i].first.seq,
+					batches[i].last.ms, batches[i].last.seq
+				)
+			);
+		}
+	}
+
+	return total;
+}
+
+/* Reply callback for blocked RQ.POP */
+int bpop_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	rq_pop_t popargs;
+	rqueue_t *rqueue = readyQueue(ctx);
+
+	if(rqueue == NULL){
 		return REDISMODULE_ERR;
 	}
 
 	rq_parse_pop_args(ctx, argv, argc, &popargs);
-	count = popargs.count;
-
-	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-	long long poped = popAndReply(ctx, rqueue, &count);
-	RedisModule_ReplySetArrayLength(ctx, poped);
+	popQueuesAndReply(ctx, &rqueue, 1, &popargs);
 	
 	return REDISMODULE_OK;
 }
 
-/**
- * rq.push <key> <msg1> [ <msg2> [...]]
- * Pushes 1 or more items into key
- */
-int pushCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/* Opens the queue at "keyname" for pushing, creating it if needed. Returns
+ * NULL if the key holds something else. */
+static rqueue_t *pushQueue(RedisModuleCtx *ctx, RedisModuleString *keyname)
 {
-	RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-
 	rqueue_t *rqueue;
-	msg_t *newmsg;
-	msg_block_t *block = NULL;
-	int count = argc - 2; // count of new messages being pushed
-	size_t strlen; // dummy value for storing the length of RedisModuleString objects
-
-	if (argc < 3) return RedisModule_WrongArity(ctx);
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ|REDISMODULE_WRITE);
+	int type = RedisModule_KeyType(key);
 
-   RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
-   int type = RedisModule_KeyType(key);
-   
 	if(type == REDISMODULE_KEYTYPE_EMPTY){
 		// Key doesn't exist. Create...
-		rqueue = rqueueCreate(argv[1]);
+		rqueue = rqueueCreate(keyname, RedisModule_GetSelectedDb(ctx));
 		RedisModule_ModuleTypeSetValue(key, RELIABLEQ_TYPE, rqueue);
 	} else if(RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE){
 		// key exists. Get and update
 		rqueue = RedisModule_ModuleTypeGetValue(key);
 	} else {
 		// Key exists, but it's not an RQueueObject!!!
-		return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+		return NULL;
+	}
+
+	return rqueue;
+}
+
+/* Appends a new message with the payload already stored in "newmsg" to the
+ * undelivered queue. Only the "first" message pushed by a command gets a new
+ * ID: the following ones get the next consecutive ones. */
+static void pushMessage(rqueue_t *rqueue, msg_t *newmsg, int first, lease_t **delayed)
+{
+	if(first){
+		setNextMsgID(&rqueue->last_id, &newmsg->id);
+	} else {
+		incrMsgID(&rqueue->last_id, &newmsg->id);
+	}
+	rqueue->last_id = newmsg->id;
+	newmsg->lastDelivery = 0;
+	newmsg->deliveries = 0;
+	newmsg->batch = 0;
+	newmsg->extend = 0;
+	newmsg->lease = 0;
+	if(delayed){
+		*delayed = delayPush(*delayed, newmsg->id.ms, newmsg->id.seq, &newmsg->payload, 0);
+	} else {
+		queueAppend(rqueue, &rqueue->undelivered, newmsg);
 	}
+}
+
+/* Pushes the "count" payloads into the queue at "keyname", replying with the
+ * array of their new ID's (or with the first one, the last one and the count,
+ * with "range"), and wakes up the clients blocked on it. The payloads are taken
+ * from the "packed" chunk instead, if not NULL. With "due" (0 for now), the
+ * messages wait in the timing wheel until that time, and get pushed then. */
+static void pushAndReply(RedisModuleCtx *ctx, rqueue_t *rqueue, RedisModuleString *keyname, RedisModuleString **payloads, payload_chunk_t *packed, int count, int range, mstime_t due)
+{
+	lease_t *delayed = NULL;
+	msg_t newmsg;
+	msgid_t first;
+	uint32_t off = 0;
 
-	// allocate the memory
-	if(count > 1){
-		block = RedisModule_Alloc(sizeof(*block));
-		block->ptr = RedisModule_Calloc(count, sizeof(*newmsg));
-		block->count = count;
-		block->freed = 0;
-		//block->mem_usage = (sizeof(*newmsg) * count);
-		newmsg = block->ptr;
-		rqueue->memory_used += sizeof(*block) + (sizeof(*newmsg) * count);
+	if(range){
+		RedisModule_ReplyWithArray(ctx, 3);
 	} else {
-		newmsg = RedisModule_Alloc(sizeof(*newmsg));
-		rqueue->memory_used += sizeof(*newmsg);
+		RedisModule_ReplyWithArray(ctx, count);
 	}
 
-	RedisModule_ReplyWithArray(ctx, count);
+	if(due){
+		delayed = delayCreate(rqueue, count, due);
+	}
 
-	// Init the new nodes
-	for(int i = 0, j = 1; i < count; i++, j++){
-		//TODO: refactor this
+	// Append the new messages in place, at the tail of the queue. They all
+	// get consecutive IDs, so the range of a push describes every one of them.
+	for(int i = 0; i < count; i++){
+		if(packed){
+			payloadPackedNext(rqueue, packed, &off, &newmsg.payload);
+		} else {
+			payloadStore(rqueue, &newmsg.payload, payloads[i]);
+		}
+		pushMessage(rqueue, &newmsg, i == 0, delayed ? &delayed : NULL);
 		if(i == 0){
-			setNextMsgID(&rqueue->last_id, &newmsg[i].id);
+			first = newmsg.id;
+		}
+
+		if(!range){
+			replyWithMsgId(ctx, newmsg.id.ms, newmsg.id.seq);
+		}
+	}
+
+	if(range){
+		replyWithMsgId(ctx, first.ms, first.seq);
+		replyWithMsgId(ctx, newmsg.id.ms, newmsg.id.seq);
+		RedisModule_ReplyWithLongLong(ctx, count);
+	}
+
+	// Nothing to pop yet
+	if(delayed){
+		leaseSchedule(delayed);
+		return;
+	}
+
+	// Move the cold part of a long backlog to disk
+	spillCheck(rqueue);
+
+	// Unblock clients
+	RedisModule_SignalKeyAsReady(ctx, keyname);
+}
+
+/**
+ * rq.push <key> <msg1> [ <msg2> [...]]
+ * Pushes 1 or more items into key. Every argument after the key is an item:
+ * options go with RQ.PUSHEX.
+ */
+int pushCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+	rqueue_t *rqueue;
+
+	if (argc < 3) return RedisModule_WrongArity(ctx);
+
+	if((rqueue = pushQueue(ctx, argv[1])) == NULL){
+		return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	pushAndReply(ctx, rqueue, argv[1], &argv[2], NULL, argc - 2, 0, 0);
+
+	return REDISMODULE_OK;
+}
+
+/**
+ * rq.pushex <key> [ RANGE ] [ DELAY <ms> | AT <unix-ms> ] PAYLOADS <msg1> [ <msg2> [...]]
+ * Pushes 1 or more items into key, as RQ.PUSH does, with the options given up
+ * to PAYLOADS: anything after it is pushed as is. With RANGE, replies with the
+ * first ID, the last ID and the count of messages pushed, instead of every ID.
+ * With DELAY or AT, they're pushed by the lease timer once due (see lease.c),
+ * with the ID's given now.
+ */
+int pushexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	rqueue_t *rqueue;
+	mstime_t due = 0, now;
+	long long when;
+	int delayed = 0;
+	int range = 0;
+	int i;
+
+	if (argc < 4) return RedisModule_WrongArity(ctx);
+
+	for(i = 2; i < argc && !RMUtil_StringEqualsCaseC(argv[i], "PAYLOADS"); i++){
+		if(RMUtil_StringEqualsCaseC(argv[i], "RANGE")){
+			range = 1;
+		} else if(
+			(RMUtil_StringEqualsCaseC(argv[i], "DELAY") || RMUtil_StringEqualsCaseC(argv[i], "AT")) &&
+			!delayed && i + 1 < argc &&
+			RedisModule_StringToLongLong(argv[i + 1], &when) == REDISMODULE_OK && when >= 0
+		){
+			now = mstime();
+			due = RMUtil_StringEqualsCaseC(argv[i], "AT") ? when : now + when;
+			// Already due: pushed right away
+			if(due <= now){
+				due = 0;
+			}
+			delayed = 1;
+			i++;
 		} else {
-			setNextMsgID(&newmsg[i - 1].id, &newmsg[i].id);
-		}
-		newmsg[i].lastDelivery = 0;
-		newmsg[i].deliveries = 0;
-		newmsg[i].next = (
-			j < count ?
-			&newmsg[j] :
-			NULL
-		);
-		newmsg[i].value = RedisModule_HoldString(NULL, argv[2 + i]);
-		newmsg[i].block = block;
-		
-		//memory usage stats
-		RedisModule_StringPtrLen(newmsg[i].value, &strlen);
-		rqueue->memory_used += strlen;
+			return RedisModule_ReplyWithError(ctx, MQ_ERROR_PUSHEX_USAGE);
+		}
+	}
 
-		RedisModule_ReplyWithString(
-			ctx,
-			RedisModule_CreateStringPrintf(ctx, MSG_ID_FORMAT, newmsg[i].id.ms, newmsg[i].id.seq)
-		);
+	// At least one message after PAYLOADS
+	if(argc - i < 2){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_PUSHEX_USAGE);
 	}
 
-	//Update first node
-	if(rqueue->undelivered.first == NULL){
-		rqueue->undelivered.first = &newmsg[0];
-	} else {
-		((msg_t*) rqueue->undelivered.last)->next = &newmsg[0];
+	if((rqueue = pushQueue(ctx, argv[1])) == NULL){
+		return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
 	}
 
-	// Update last node
-	rqueue->undelivered.last = &newmsg[count - 1];
+	pushAndReply(ctx, rqueue, argv[1], &argv[i + 1], NULL, argc - i - 1, range, due);
+
+	return REDISMODULE_OK;
+}
+
+/**
+ * rq.pushpacked <key> [ RANGE ] <packed>
+ * Pushes the payloads packed in a single argument into key, as RQ.PUSH does
+ * with its arguments. Payloads are packed one after the other, each one as a
+ * 32 bit little-endian length followed by its bytes, and stored as slices of
+ * a single copy of <packed>, freed once all of them are acknowledged.
+ */
+int pushpackedCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
 
-	// Update count
-	rqueue->undelivered.len += count;
+	rqueue_t *rqueue;
+	payload_chunk_t *packed;
+	const char *buf;
+	long long count;
+	size_t len;
+	int range = (argc == 4);
 
-	// Update last_id
-	rqueue->last_id = newmsg[count - 1].id;
+	if (argc != 3 && argc != 4) return RedisModule_WrongArity(ctx);
 
-	// Unblock clients
-	RedisModule_SignalKeyAsReady(ctx, argv[1]);
-	//RedisModule_CloseKey(argv[1]);
+	if(range && !RMUtil_StringEqualsCaseC(argv[2], "RANGE")){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_PUSHPACKED_USAGE);
+	}
+
+	buf = RedisModule_StringPtrLen(argv[2 + range], &len);
+	if((count = payloadPackedCount(buf, len)) <= 0 || count > INT_MAX){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_PACKED);
+	}
+
+	if((rqueue = pushQueue(ctx, argv[1])) == NULL){
+		return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	packed = payloadPackedOpen(rqueue, buf, len);
+	pushAndReply(ctx, rqueue, argv[1], NULL, packed, count, range, 0);
+	payloadPackedClose(rqueue, packed);
+
+	return REDISMODULE_OK;
+}
+
+/* Checks the "<key> <count> <item1> ... <itemN>" groups of RQ.MPUSH and
+ * RQ.MACK, from argv[1] on. Returns the number of groups, or 0 if malformed. */
+static int parseGroups(RedisModuleString **argv, int argc)
+{
+	long long count;
+	int groups = 0;
+
+	for(int i = 1; i < argc; i += 2 + count){
+		if(
+			i + 1 >= argc ||
+			RedisModule_StringToLongLong(argv[i + 1], &count) != REDISMODULE_OK ||
+			count < 1 ||
+			count > argc - i - 2
+		){
+			return 0;
+		}
+		groups += 1;
+	}
+
+	return groups;
+}
+
+/* Returns the position of the key of the group after the one at "i" */
+static int nextGroup(RedisModuleString **argv, int i)
+{
+	long long count;
+
+	RedisModule_StringToLongLong(argv[i + 1], &count);
+	return i + 2 + count;
+}
+
+/* Declares the keys of a RQ.MPUSH or RQ.MACK command, or checks that they're
+ * all queues (or empty). Returns 0 after replying with an error. */
+static int checkGroupKeys(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModuleKey *key;
+
+	for(int i = 1; i < argc; i = nextGroup(argv, i)){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			RedisModule_KeyAtPos(ctx, i);
+			continue;
+		}
+
+		key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+		if(
+			RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+			RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE
+		){
+			RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+			return 0;
+		}
+		RedisModule_CloseKey(key);
+	}
+
+	return 1;
+}
+
+/**
+ * RQ.MPUSH <key1> <count1> <msg1> [ ... ] [ <key2> <count2> <msg1> [ ... ] [ ... ] ]
+ *
+ * Pushes the <count> messages after every key into it, as RQ.PUSH does.
+ * Nothing is pushed if any key holds something else than a queue.
+ *
+ * Returns: ARRAY with the ARRAY of new message ID's of every key
+ */
+int mpushCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	int groups = parseGroups(argv, argc);
+
+	if(groups == 0){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			return REDISMODULE_OK;
+		}
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_MPUSH_USAGE);
+	}
+
+	if(!checkGroupKeys(ctx, argv, argc) || RedisModule_IsKeysPositionRequest(ctx)){
+		return REDISMODULE_OK;
+	}
+
+	RedisModule_ReplyWithArray(ctx, groups);
+	for(int i = 1; i < argc; i = nextGroup(argv, i)){
+		pushAndReply(ctx, pushQueue(ctx, argv[i]), argv[i], &argv[i + 2], NULL, nextGroup(argv, i) - i - 2, 0, 0);
+	}
 
 	return REDISMODULE_OK;
 }
 
+/* Replies with the queue a dead letter comes from, and the ID it had there */
+static void replyWithOrigin(RedisModuleCtx *ctx, const rq_origin_t *origin)
+{
+	RedisModule_ReplyWithStringBuffer(ctx, origin->queue, origin->len);
+	replyWithMsgId(ctx, origin->id.ms, origin->id.seq);
+}
+
 /**
  * RQ.INSPECT <key> [ PENDING ] <start> [ <count> ]
  * 
  * Inspects <count> elements at the "undelivered" queue, starting at <start>.
  * If PENDING is provided after the <key> to inspect, then the elements at the
- * "delivered" queue will be inspected instead.
+ * "delivered" queue will be inspected instead. Messages moved here from another
+ * queue as dead letters come with that queue and the ID they had there.
  **/
 int inspectCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
@@ -201,7 +587,7 @@ int inspectCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
 	}
 
-	long long start = 0, count, pos = 0, outputed = 0;
+	long long start = 0, count, outputed = 0;
 	int pending = RMUtil_StringEqualsCaseC(argv[2], "PENDING");
 
 	if(RMUtil_ParseArgs(argv, argc, (pending ? 3 : 2), "ll", &start, &count) != REDISMODULE_OK){
@@ -218,24 +604,24 @@ int inspectCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		&rqueue->delivered :
 		&rqueue->undelivered
 	);
-	msg_t *cur = NULL;
+	msg_segment_t *cur = NULL;
+	const rq_origin_t *origin;
+	uint32_t at = 0;
+	queue_iter_t it;
+	msgid_t id;
 
 	if(start < 0){
 		start += queue->len;
 	}
 
 	// Set the starting node
-	if(start < 0 || start > (queue->len - 1)){
+	if(start < 0 || start > ((long long) queue->len - 1)){
 		return RedisModule_ReplyWithArray(ctx, 0);
 	}
 
-	// Walk the list starting with the fisrt node
-	cur = queue->first;
-	while (pos < start && cur->next != NULL)
-	{
-		cur = cur->next;
-		pos += 1;
-	}
+	queueIterStart(queue, &it);
+	queueIterSkip(&it, start);
+	cur = queueIterNext(&it, &at);
 
 	// Now, walk the list from the current node, onwards
 	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
@@ -244,34 +630,41 @@ int inspectCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		mstime_t now = mstime();
 		while (cur && outputed < count)
 		{
-			RedisModule_ReplyWithArray(ctx,5);
-			RedisModule_ReplyWithString(
-				ctx,
-				RedisModule_CreateStringPrintf(ctx, MSG_ID_FORMAT, cur->id.ms, cur->id.seq)
-			);
-			RedisModule_ReplyWithString(ctx, cur->value);
-			RedisModule_ReplyWithLongLong(ctx, cur->lastDelivery);
-			RedisModule_ReplyWithLongLong(ctx, now - cur->lastDelivery);
-			RedisModule_ReplyWithLongLong(ctx, cur->deliveries);
+			id.ms = cur->ms[at];
+			id.seq = cur->seq[at];
+			origin = rq_origin_find(rqueue, &id);
+			RedisModule_ReplyWithArray(ctx, origin ? 7 : 5);
+			replyWithMsgId(ctx, cur->ms[at], cur->seq[at]);
+			payloadReply(ctx, rqueue, &cur->payload[at]);
+			RedisModule_ReplyWithLongLong(ctx, cur->lastDelivery[at]);
+			RedisModule_ReplyWithLongLong(ctx, now - cur->lastDelivery[at]);
+			RedisModule_ReplyWithLongLong(ctx, cur->deliveries[at]);
+			if(origin){
+				replyWithOrigin(ctx, origin);
+			}
 			outputed += 1;
-			cur = cur->next;
+			cur = queueIterNext(&it, &at);
 		}
 	} else {
 		while(cur && outputed < count)
 		{
-			RedisModule_ReplyWithArray(ctx,2);
-			RedisModule_ReplyWithString(
-				ctx,
-				RedisModule_CreateStringPrintf(ctx, MSG_ID_FORMAT, cur->id.ms, cur->id.seq)
-			);
-			//RedisModule_ReplyWithLongLong(ctx, cur->lastDelivery);
-			//RedisModule_ReplyWithLongLong(ctx, cur->deliveries);
-			RedisModule_ReplyWithString(ctx, cur->value);
+			id.ms = cur->ms[at];
+			id.seq = cur->seq[at];
+			origin = rq_origin_find(rqueue, &id);
+			RedisModule_ReplyWithArray(ctx, origin ? 4 : 2);
+			replyWithMsgId(ctx, cur->ms[at], cur->seq[at]);
+			//RedisModule_ReplyWithLongLong(ctx, cur->lastDelivery[at]);
+			//RedisModule_ReplyWithLongLong(ctx, cur->deliveries[at]);
+			payloadReply(ctx, rqueue, &cur->payload[at]);
+			if(origin){
+				replyWithOrigin(ctx, origin);
+			}
 			outputed += 1;
-			cur = cur->next;
+			cur = queueIterNext(&it, &at);
 		}
 	}
 	
+	queueIterStop(&it);
 	RedisModule_ReplySetArrayLength(ctx, outputed);
 	
 	return REDISMODULE_OK;
@@ -281,7 +674,8 @@ int inspectCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 /**
  * RQ.BLOCKS <key>
  * 
- * Gets debug information about allocated block of contiguous messages
+ * Gets debug information about the allocated segments of contiguous messages:
+ * address, used slots and slots no longer in use
  **/
 int blocksCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
@@ -302,48 +696,24 @@ int blocksCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 	}
 
 	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
-	msg_block_t *prevblock = NULL;
-	msg_t *curmsg = NULL;
+	queue_t *queues[2] = { &rqueue->undelivered, &rqueue->delivered };
+	msg_segment_t *seg = NULL;
 	int total = 0;
 	
 	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
 
-	//Iterate over the undelivered list
-	curmsg = rqueue->undelivered.first;
-	while (curmsg)
-	{
-		if(curmsg->block && curmsg->block != prevblock){
-			RedisModule_ReplyWithArray(ctx, 3);
-			RedisModule_ReplyWithString(
-				ctx,
-				RedisModule_CreateStringPrintf(ctx, "%p", curmsg->block->ptr)
-			);
-			RedisModule_ReplyWithLongLong(ctx, curmsg->block->count);
-			RedisModule_ReplyWithLongLong(ctx, curmsg->block->freed);
-			total++;
-			prevblock = curmsg->block;
-		}
-		
-		curmsg = curmsg->next;
-	}
-
-	//Iterate over the delivered list
-	curmsg = rqueue->delivered.first;
-	while (curmsg)
-	{
-		if(curmsg->block && curmsg->block != prevblock){
+	//Iterate over the undelivered list, then over the delivered list
+	for(int q = 0; q < 2; q++){
+		for(seg = queues[q]->first; seg; seg = seg->next){
 			RedisModule_ReplyWithArray(ctx, 3);
 			RedisModule_ReplyWithString(
 				ctx,
-				RedisModule_CreateStringPrintf(ctx, "%p", curmsg->block->ptr)
+				RedisModule_CreateStringPrintf(ctx, "%p", seg)
 			);
-			RedisModule_ReplyWithLongLong(ctx, curmsg->block->count);
-			RedisModule_ReplyWithLongLong(ctx, curmsg->block->freed);
+			RedisModule_ReplyWithLongLong(ctx, seg->tail);
+			RedisModule_ReplyWithLongLong(ctx, seg->tail - seg->live);
 			total++;
-			prevblock = curmsg->block;
 		}
-		
-		curmsg = curmsg->next;
 	}
 	
 	RedisModule_ReplySetArrayLength(ctx, total);
@@ -352,33 +722,49 @@ int blocksCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 }
 #endif
 /**
- * Usage: RQ.POP <count> [ BLOCK <ms> ] <key>
+ * Usage: RQ.POP <count> [ BLOCK <ms> ] [ LEASE <ms>|AUTO ] [ NOACK ] [ BATCH ] [ FORMAT GROUPED|PACKED ] <key>
  * 
  * Pops <count> elements from the reliable queue at <key>.
  * The poped elements are placed into the internal "delivered" list, for
- * later acknoledgment.
+ * later acknoledgment, unless NOACK is given. With LEASE (or the queue's
+ * LEASE setting), the ones not acknowledged in time are requeued by the
+ * lease timer (see lease.c). With BATCH, the lease token of the messages popped
+ * from every queue is returned as well, to acknowledge them all at once.
+ * FORMAT replies with the messages grouped by queue (see popAndReply).
  */
 int popCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
 	RedisModule_AutoMemory(ctx);
 
-	if (argc < 2) return RedisModule_WrongArity(ctx);
-
 	rq_pop_t popargs;
 
-	if(rq_parse_pop_args(ctx, argv, argc, &popargs)){
+	if(argc < 2 || rq_parse_pop_args(ctx, argv, argc, &popargs)){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			return REDISMODULE_OK;
+		}
+		if(argc < 2){
+			return RedisModule_WrongArity(ctx);
+		}
 		return RedisModule_ReplyWithError(ctx, MQ_ERROR_POP_USAGE);
 	}
 
-	long long count = popargs.count;
-	long long total_poped = 0;
+	// The queues come after the options
+	if(RedisModule_IsKeysPositionRequest(ctx)){
+		for(uint k = 0; k < popargs.key_count; k++){
+			RedisModule_KeyAtPos(ctx, popargs.keys - argv + k);
+		}
+		return REDISMODULE_OK;
+	}
+
+	rqueue_t *queues[popargs.key_count];
+	int ready = 0;
 	rqueue_t *rqueue = NULL;
 	//uint valid_keys = 0;
 
 	//First, check all keys
 	for(
 		int k = 0;
-		k < popargs.key_count && count > 0;
+		k < popargs.key_count && popargs.count > 0;
 		k++
 	){
 		RedisModuleString *qname = popargs.keys[k];
@@ -392,7 +778,7 @@ int popCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		}
 		
 		if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
-			if(total_poped == 0){
+			if(ready == 0){
 				return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
 			}
 
@@ -407,15 +793,11 @@ int popCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 			continue;
 		}
 
-		if(total_poped == 0){
-			RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-		}
-
-		total_poped += popAndReply(ctx, rqueue, &count);
+		queues[ready++] = rqueue;
 	}
 
-	if(total_poped > 0){
-		RedisModule_ReplySetArrayLength(ctx, total_poped);
+	if(ready > 0){
+		popQueuesAndReply(ctx, queues, ready, &popargs);
 		return REDISMODULE_OK;
 	}
 
@@ -438,25 +820,188 @@ int popCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 	return REDISMODULE_OK;
 }
 
-/**
- * ACK <queue> <msgid1> [ <msgid2> [ ... ] ]
- * 
- * Acknowledges the successful processing of 1 or more messages, removing them
- * from the internal "delivered" queue.
- * 
- * Returns: ARRAY of messages ID's found and removed
- */
-int ackCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+/* Parses a message ID given as "<ms>-<seq>". Returns 0 if it's not valid. */
+static int parseMsgId(RedisModuleString *str, msgid_t *id)
 {
-	RedisModule_AutoMemory(ctx);
+	const char *idptr;
+	size_t idlen;
+	char idbuf[128];
 
-	if (argc < 3) return RedisModule_WrongArity(ctx);
+	idptr = RedisModule_StringPtrLen(str, &idlen);
+	if(idlen > sizeof(idbuf) - 1){
+		idlen = sizeof(idbuf) - 1;
+	}
+	memcpy(idbuf, idptr, idlen);
+	idbuf[idlen] = (char) 0;
 
-	// Retrieve the key content
-	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
-    int type = RedisModule_KeyType(key);
-   
+	return sscanf(idbuf, MSG_ID_FORMAT, &id->ms, &id->seq) == 2;
+}
+
+/* Acknowledges the delivered messages of the queue at "keyname" with an ID
+ * from "start" (the lowest possible one, if NULL) to "end", replying with the
+ * number of messages removed */
+static int ackRangeAndReply(RedisModuleCtx *ctx, RedisModuleString *keyname, RedisModuleString *start, RedisModuleString *end)
+{
+	msgid_t from = { 0, 0 }, to;
+
+	if((start && !parseMsgId(start, &from)) || !parseMsgId(end, &to)){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_ID);
+	}
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ|REDISMODULE_WRITE);
+
+	if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+		return RedisModule_ReplyWithLongLong(ctx, 0);
+	}
+
+	if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	return RedisModule_ReplyWithLongLong(
+		ctx,
+		rq_ack_range(RedisModule_ModuleTypeGetValue(key), &from, &to)
+	);
+}
+
+/* Acknowledges the "count" message ID's in "ids", replying with the array of
+ * the ones found and removed. With "compact", replies with their count and
+ * the array of the ones not found instead. "rqueue" may be NULL. */
+static void ackAndReply(RedisModuleCtx *ctx, rqueue_t *rqueue, RedisModuleString **ids, int count, int compact)
+{
+	msgid_t id;
+	long removed = 0;
+
+	if(compact){
+		int *missing = RedisModule_Alloc(sizeof(*missing) * (count + 1));
+		int nmissing = 0;
+
+		for(int i = 0; i < count; i++){
+			if(rqueue && parseMsgId(ids[i], &id) && rq_ack(rqueue, &id)){
+				removed++;
+			} else {
+				missing[nmissing++] = i;
+			}
+		}
+
+		RedisModule_ReplyWithArray(ctx, 2);
+		RedisModule_ReplyWithLongLong(ctx, removed);
+		RedisModule_ReplyWithArray(ctx, nmissing);
+		for(int i = 0; i < nmissing; i++){
+			RedisModule_ReplyWithString(ctx, ids[missing[i]]);
+		}
+		RedisModule_Free(missing);
+		return;
+	}
+
+	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+	for(int i = 0; i < count; i++){
+		if(parseMsgId(ids[i], &id) && rq_ack(rqueue, &id)){
+			removed++;
+			RedisModule_ReplyWithString(ctx, ids[i]);
+		}
+	}
+
+	RedisModule_ReplySetArrayLength(ctx, removed);
+}
+
+/* Acknowledges the messages of the batch given as a lease token in "argv[3]",
+ * except the ones after EXCEPT, replying with the number of messages removed */
+static int ackBatchAndReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	rq_batch_t batch;
+	char extra;
+
+	if(argc == 5 || (argc > 5 && !RMUtil_StringEqualsCaseC(argv[4], "EXCEPT"))){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_ACK_BATCH_USAGE);
+	}
+
+	if(
+		sscanf(
+			RedisModule_StringPtrLen(argv[3], NULL), BATCH_TOKEN_FORMAT "%c", &batch.id,
+			&batch.first.ms, &batch.first.seq, &batch.last.ms, &batch.last.seq, &extra
+		) != 5 ||
+		batch.id == 0
+	){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_BATCH);
+	}
+
+	int except_count = argc > 5 ? argc - 5 : 0;
+	msgid_t *except = RedisModule_Alloc(sizeof(*except) * (except_count + 1));
+
+	for(int i = 0; i < except_count; i++){
+		if(!parseMsgId(argv[5 + i], &except[i])){
+			RedisModule_Free(except);
+			return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_ID);
+		}
+	}
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+	long long removed = 0;
+
+	if(RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY){
+		if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+			RedisModule_Free(except);
+			return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+		}
+		removed = rq_ack_batch(RedisModule_ModuleTypeGetValue(key), &batch, except, except_count);
+	}
+
+	RedisModule_Free(except);
+
+	if(removed < 0){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_BATCH);
+	}
+
+	return RedisModule_ReplyWithLongLong(ctx, removed);
+}
+
+/**
+ * ACK <queue> [ COUNT ] <msgid1> [ <msgid2> [ ... ] ]
+ * ACK <queue> UPTO <msgid>
+ * ACK <queue> BATCH <token> [ EXCEPT <msgid1> [ ... ] ]
+ * 
+ * Acknowledges the successful processing of 1 or more messages, removing them
+ * from the internal "delivered" queue. With UPTO, every delivered message
+ * with an ID up to the given one is acknowledged. With BATCH, every message
+ * popped along with the lease token (see RQ.POP) and not redelivered since,
+ * but the ones after EXCEPT.
+ * 
+ * Returns: ARRAY of messages ID's found and removed, or the number of messages
+ * removed, with UPTO or BATCH. With COUNT, a 2-element ARRAY with the number of
+ * messages removed and the ARRAY of message ID's not found.
+ */
+int ackCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if (argc < 3) return RedisModule_WrongArity(ctx);
+
+	if(argc == 4 && RMUtil_StringEqualsCaseC(argv[2], "UPTO")){
+		return ackRangeAndReply(ctx, argv[1], NULL, argv[3]);
+	}
+
+	if(argc >= 4 && RMUtil_StringEqualsCaseC(argv[2], "BATCH")){
+		return ackBatchAndReply(ctx, argv, argc);
+	}
+
+	int compact = RMUtil_StringEqualsCaseC(argv[2], "COUNT");
+
+	if(compact && argc < 4){
+		return RedisModule_WrongArity(ctx);
+	}
+
+	// Retrieve the key content
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+   
 	if(type == REDISMODULE_KEYTYPE_EMPTY){
+		// None of the ID's can be found
+		if(compact){
+			ackAndReply(ctx, NULL, &argv[3], argc - 3, compact);
+			return REDISMODULE_OK;
+		}
 		return RedisModule_ReplyWithNull(ctx);
 	}
 	
@@ -464,91 +1009,582 @@ int ackCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
 	}
 
+	ackAndReply(ctx, RedisModule_ModuleTypeGetValue(key), &argv[2 + compact], argc - 2 - compact, compact);
+
+	return REDISMODULE_OK;
+}
+
+/**
+ * RQ.MACK <key1> <count1> <msgid1> [ ... ] [ <key2> <count2> <msgid1> [ ... ] [ ... ] ]
+ *
+ * Acknowledges the <count> message ID's after every key, as RQ.ACK does.
+ *
+ * Returns: ARRAY with the ARRAY of message ID's found and removed from every
+ * key (or null, if the key doesn't exist)
+ */
+int mackCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	int groups = parseGroups(argv, argc);
+
+	if(groups == 0){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			return REDISMODULE_OK;
+		}
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_MACK_USAGE);
+	}
+
+	if(!checkGroupKeys(ctx, argv, argc) || RedisModule_IsKeysPositionRequest(ctx)){
+		return REDISMODULE_OK;
+	}
+
+	RedisModuleKey *key;
+
+	RedisModule_ReplyWithArray(ctx, groups);
+	for(int i = 1; i < argc; i = nextGroup(argv, i)){
+		key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ|REDISMODULE_WRITE);
+		if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+			RedisModule_ReplyWithNull(ctx);
+			continue;
+		}
+		ackAndReply(ctx, RedisModule_ModuleTypeGetValue(key), &argv[i + 2], nextGroup(argv, i) - i - 2, 0);
+	}
+
+	return REDISMODULE_OK;
+}
+
+/**
+ * RQ.TOUCH <key> <msgid1> [ <msgid2> [ ... ] ] [ EXTEND <ms> ]
+ *
+ * Refreshes the lease of delivered messages still being processed, so
+ * RQ.RECOVER counts the time elapsed since now instead of since they were
+ * popped. With EXTEND, they're given <ms> more milliseconds on top of that.
+ * Messages keep their batch and number of deliveries.
+ *
+ * Returns: the number of messages found and touched
+ */
+int touchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if(argc < 3) return RedisModule_WrongArity(ctx);
+
+	long long extend = 0;
+	int count = argc - 2;
+
+	if(argc >= 5 && RMUtil_StringEqualsCaseC(argv[argc - 2], "EXTEND")){
+		if(
+			RedisModule_StringToLongLong(argv[argc - 1], &extend) != REDISMODULE_OK ||
+			extend < 0 || extend > UINT32_MAX
+		){
+			return RedisModule_ReplyWithError(ctx, MQ_ERROR_TOUCH_USAGE);
+		}
+		count -= 2;
+	}
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+
+	if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+		return RedisModule_ReplyWithLongLong(ctx, 0);
+	}
+
+	if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
 	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
+	mstime_t now = mstime();
+	long long touched = 0;
+	msgid_t id;
 
-	if(rqueue->delivered.first == NULL){
-		return RedisModule_ReplyWithArray(ctx,0);
+	for(int i = 0; i < count; i++){
+		if(parseMsgId(argv[2 + i], &id)){
+			touched += rq_touch(rqueue, &id, now, extend);
+		}
 	}
 
-	msg_t *cur, *next, *prev;
-	msg_block_t *block;
+	return RedisModule_ReplyWithLongLong(ctx, touched);
+}
+
+/**
+ * RQ.NACK <key> <msgid1> [ <msgid2> [ ... ] ] [ DELAY <ms> | BACKOFF ]
+ *
+ * Puts delivered messages a worker failed to process back into the queue,
+ * keeping their ID, payload and number of deliveries: at its head right away,
+ * or at its tail after <ms> milliseconds, or after the exponential backoff of
+ * the queue for their number of deliveries (see rq_nack).
+ *
+ * Returns: the number of messages found and put back, and the number of them
+ * moved to the dead-letter queue instead
+ */
+int nackCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if(argc < 3) return RedisModule_WrongArity(ctx);
+
+	long long delay = 0;
+	int count = argc - 2;
+
+	if(argc >= 4 && RMUtil_StringEqualsCaseC(argv[argc - 1], "BACKOFF")){
+		delay = NACK_BACKOFF;
+		count -= 1;
+	} else if(argc >= 5 && RMUtil_StringEqualsCaseC(argv[argc - 2], "DELAY")){
+		if(RedisModule_StringToLongLong(argv[argc - 1], &delay) != REDISMODULE_OK || delay < 0){
+			return RedisModule_ReplyWithError(ctx, MQ_ERROR_NACK_USAGE);
+		}
+		count -= 2;
+	}
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+
+	if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+		RedisModule_ReplyWithArray(ctx, 2);
+		RedisModule_ReplyWithLongLong(ctx, 0);
+		return RedisModule_ReplyWithLongLong(ctx, 0);
+	}
+
+	if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
+	int backwards = rq_nack_immediate(rqueue, delay);
+	mstime_t now = mstime();
+	lease_t *delayed = NULL;
+	long long nacked = 0, deadlettered = 0;
+	msg_segment_t *seg;
 	msgid_t id;
-	char *idptr;
-	size_t idlen;
-	char idbuf[128];
-	long removed = 0;
-	size_t strlen;
-	
-	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+	int pos;
+
+	// Dead letters first then, in order, to the tail of their queue
+	if(backwards && rq_deadletter_ready(ctx, rqueue)){
+		for(int i = 0; i < count; i++){
+			if(
+				parseMsgId(argv[2 + i], &id) && (seg = rq_index_find(rqueue, &id)) != NULL &&
+				(pos = segmentFind(seg, &id)) >= 0 && rq_deadletter(ctx, rqueue, seg, pos)
+			){
+				deadlettered += 1;
+			}
+		}
+	}
 
-	for(int i = 2; i < argc; i++){
+	// Backwards when put back right away, so they end up in order at the head
+	for(int i = 0; i < count; i++){
+		if(!parseMsgId(argv[backwards ? 1 + count - i : 2 + i], &id)){
+			continue;
+		}
+		switch(rq_nack(ctx, rqueue, &id, now, delay, &delayed)){
+			case 1:
+				nacked += 1;
+				break;
+			case NACK_DEADLETTERED:
+				deadlettered += 1;
+				break;
+		}
+	}
 
-		//parse the ID
-		idptr = RedisModule_StringPtrLen(argv[i], &idlen);
-		memcpy(idbuf, idptr, idlen);
-		idbuf[idlen < 128 ? idlen : 127] = (char) 0;
-		sscanf(idbuf, MSG_ID_FORMAT, &id.ms, &id.seq);
-
-		cur = rqueue->delivered.first;
-		prev = NULL;
-		while(cur){
-			next = cur->next;
-			if(cur->id.ms == id.ms && cur->id.seq == id.seq){
-
-				//Link previous node to next node
-				if(prev != NULL){
-					prev->next = cur->next;
-				}
+	if(delayed){
+		leaseSchedule(delayed);
+	}
+	if(nacked){
+		RedisModule_SignalKeyAsReady(ctx, argv[1]);
+	}
+
+	RedisModule_ReplyWithArray(ctx, 2);
+	RedisModule_ReplyWithLongLong(ctx, nacked);
+	return RedisModule_ReplyWithLongLong(ctx, deadlettered);
+}
+
+/* RQ.EXEC operations: an opcode byte, the index of their key as a 16 bit
+ * little-endian integer, and then their arguments */
+#define EXEC_OP_PUSH 1  /* Payload: 32 bit little-endian length, and bytes */
+#define EXEC_OP_ACK 2   /* Message ID: 64 bit big-endian ms and seq */
+#define EXEC_OP_TOUCH 3 /* Message ID, and EXTEND milliseconds as a 32 bit little-endian integer */
+#define EXEC_OP_NACK 4  /* Message ID, and DELAY milliseconds as a 32 bit little-endian integer (EXEC_NACK_BACKOFF for BACKOFF) */
+#define EXEC_OP_HEADER 3
+#define EXEC_NACK_BACKOFF UINT32_MAX
+
+/* Checks the operations of a RQ.EXEC command against its "numkeys" keys,
+ * counting the pushes. Sets "push" for every key pushed into. Returns 0 if
+ * malformed. */
+static int execParse(const unsigned char *ops, size_t len, int numkeys, char *push, long long *pushes)
+{
+	size_t at = 0, arglen;
+	uint32_t len32;
+	int k;
+
+	*pushes = 0;
+	while(at < len){
+		if(len - at < EXEC_OP_HEADER){
+			return 0;
+		}
+		if((k = ops[at + 1] | (ops[at + 2] << 8)) >= numkeys){
+			return 0;
+		}
 
-				if(cur == rqueue->delivered.first){
-					rqueue->delivered.first = cur->next;
+		switch(ops[at]){
+			case EXEC_OP_PUSH:
+				if(len - at - EXEC_OP_HEADER < sizeof(len32)){
+					return 0;
 				}
+				len32 = ops[at + 3] | (ops[at + 4] << 8) | (ops[at + 5] << 16) | ((uint32_t) ops[at + 6] << 24);
+				arglen = sizeof(len32) + len32;
+				push[k] = 1;
+				*pushes += 1;
+				break;
+			case EXEC_OP_ACK:
+				arglen = MSG_ID_KEY_LEN;
+				break;
+			case EXEC_OP_TOUCH:
+			case EXEC_OP_NACK:
+				arglen = MSG_ID_KEY_LEN + sizeof(len32);
+				break;
+			default:
+				return 0;
+		}
+
+		if(len - at - EXEC_OP_HEADER < arglen){
+			return 0;
+		}
+		at += EXEC_OP_HEADER + arglen;
+	}
+
+	return 1;
+}
+
+/**
+ * RQ.EXEC <numkeys> <key1> [ <key2> [ ... ] ] <ops>
+ *
+ * Runs a list of operations against the given keys, packed in <ops> (see
+ * EXEC_OP_*), as a single command: for pipelined workers, this saves the
+ * dispatching and reply of a command per operation. The whole list is checked
+ * before running any operation.
+ * - PUSH: pushes the payload into the key, as RQ.PUSH does
+ * - ACK: acknowledges the message ID in the key, as RQ.ACK does
+ * - TOUCH: refreshes the lease of the message, as RQ.TOUCH EXTEND does
+ * - NACK: puts the message back into the queue, as RQ.NACK DELAY (or BACKOFF)
+ *   does with a single ID
+ *
+ * Returns: a 5-element ARRAY, with the ID's of the messages pushed (16 bytes
+ * each, packed as the ID's of RQ.POP FORMAT PACKED), and the number of
+ * messages acknowledged, touched, put back and moved to the dead-letter queue
+ */
+int execCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	long long numkeys, pushes;
+	const unsigned char *ops;
+	size_t len;
+
+	if(
+		argc < 4 ||
+		RedisModule_StringToLongLong(argv[1], &numkeys) != REDISMODULE_OK ||
+		numkeys < 1 || numkeys != argc - 3 || numkeys > UINT16_MAX
+	){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			return REDISMODULE_OK;
+		}
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_EXEC_USAGE);
+	}
+
+	if(RedisModule_IsKeysPositionRequest(ctx)){
+		for(int k = 0; k < numkeys; k++){
+			RedisModule_KeyAtPos(ctx, 2 + k);
+		}
+		return REDISMODULE_OK;
+	}
+
+	char push[numkeys];
+	char pushed[numkeys];
+	char ready[numkeys];
+	rqueue_t *queues[numkeys];
+	lease_t *delayed[numkeys];
+	RedisModuleKey *key;
+
+	memset(push, 0, numkeys);
+	memset(pushed, 0, numkeys);
+	memset(ready, 0, numkeys);
+	memset(delayed, 0, sizeof(delayed));
+	ops = (const unsigned char *) RedisModule_StringPtrLen(argv[argc - 1], &len);
+	if(!execParse(ops, len, numkeys, push, &pushes)){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_INVALID_OPS);
+	}
 
-				if(cur == rqueue->delivered.last){
-					rqueue->delivered.last = prev;
+	// Every key is opened once, before running anything
+	for(int k = 0; k < numkeys; k++){
+		key = RedisModule_OpenKey(ctx, argv[2 + k], REDISMODULE_READ|REDISMODULE_WRITE);
+		queues[k] = NULL;
+		if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+			continue;
+		}
+		if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+			return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+		}
+		queues[k] = RedisModule_ModuleTypeGetValue(key);
+	}
+	for(int k = 0; k < numkeys; k++){
+		if(push[k] && queues[k] == NULL){
+			queues[k] = pushQueue(ctx, argv[2 + k]);
+		}
+	}
+
+	unsigned char *ids = RedisModule_Alloc(pushes * MSG_ID_KEY_LEN + 1);
+	long long acked = 0, touched = 0, nacked = 0, deadlettered = 0, npushed = 0;
+	mstime_t now = mstime();
+	size_t at = 0;
+	uint32_t len32;
+	msg_t newmsg;
+	msgid_t id;
+	int op, k;
+
+	while(at < len){
+		op = ops[at];
+		k = ops[at + 1] | (ops[at + 2] << 8);
+		at += EXEC_OP_HEADER;
+
+		switch(op){
+			case EXEC_OP_PUSH:
+				len32 = ops[at] | (ops[at + 1] << 8) | (ops[at + 2] << 16) | ((uint32_t) ops[at + 3] << 24);
+				payloadStoreBuffer(queues[k], &newmsg.payload, (const char *) ops + at + sizeof(len32), len32);
+				pushMessage(queues[k], &newmsg, !pushed[k], NULL);
+				pushed[k] = ready[k] = 1;
+				msgIdToKey(&newmsg.id, ids + MSG_ID_KEY_LEN * npushed++);
+				at += sizeof(len32) + len32;
+				break;
+			case EXEC_OP_ACK:
+				msgIdFromKey(ops + at, &id);
+				if(queues[k]){
+					acked += rq_ack(queues[k], &id);
 				}
-				
-				//Free string
-				RedisModule_StringPtrLen(cur->value, &strlen);
-				RedisModule_FreeString(NULL, cur->value);
-				cur->value = NULL;
-				rqueue->memory_used -= strlen;
-
-				if(cur->block){
-					block = cur->block;
-					block->freed += 1;
-					//block->mem_usage -= strlen;
-					if(block->freed >= block->count){
-						size_t mem_to_free = (sizeof(*cur) * block->count) + sizeof(*block);
-
-						//Free entire block
-						RedisModule_Free(block->ptr);
-						block->ptr = cur = NULL;
-
-						//Free block struct
-						RedisModule_Free(block);
-						block = NULL;
-
-						// update rqobj memory usage before freeing
-						rqueue->memory_used -= mem_to_free;
-					}
-				} else {
-					RedisModule_Free(cur);
-					cur = NULL;
-					rqueue->memory_used -= sizeof(*cur);
+				at += MSG_ID_KEY_LEN;
+				break;
+			case EXEC_OP_TOUCH:
+			case EXEC_OP_NACK:
+				msgIdFromKey(ops + at, &id);
+				at += MSG_ID_KEY_LEN;
+				len32 = ops[at] | (ops[at + 1] << 8) | (ops[at + 2] << 16) | ((uint32_t) ops[at + 3] << 24);
+				at += sizeof(len32);
+				if(queues[k] == NULL){
+					break;
+				}
+				if(op == EXEC_OP_TOUCH){
+					touched += rq_touch(queues[k], &id, now, len32);
+					break;
+				}
+				switch(rq_nack(ctx, queues[k], &id, now, len32 == EXEC_NACK_BACKOFF ? NACK_BACKOFF : len32, &delayed[k])){
+					case 1:
+						nacked += 1;
+						ready[k] = 1;
+						break;
+					case NACK_DEADLETTERED:
+						deadlettered += 1;
+						break;
 				}
-				removed++;
-				rqueue->delivered.len -= 1;
-				RedisModule_ReplyWithString(ctx, argv[i]);
 				break;
-			} else {
-				prev = cur;
+		}
+	}
+
+	// As RQ.PUSH and RQ.NACK do, once per key
+	for(k = 0; k < numkeys; k++){
+		if(pushed[k]){
+			spillCheck(queues[k]);
+		}
+		if(delayed[k]){
+			leaseSchedule(delayed[k]);
+		}
+		if(ready[k]){
+			RedisModule_SignalKeyAsReady(ctx, argv[2 + k]);
+		}
+	}
+
+	RedisModule_ReplyWithArray(ctx, 5);
+	RedisModule_ReplyWithStringBuffer(ctx, (const char *) ids, npushed * MSG_ID_KEY_LEN);
+	RedisModule_ReplyWithLongLong(ctx, acked);
+	RedisModule_ReplyWithLongLong(ctx, touched);
+	RedisModule_ReplyWithLongLong(ctx, nacked);
+	RedisModule_ReplyWithLongLong(ctx, deadlettered);
+	RedisModule_Free(ids);
+
+	return REDISMODULE_OK;
+}
+
+/**
+ * ACKRANGE <queue> <start-id> <end-id>
+ *
+ * Acknowledges every delivered message with an ID between <start-id> and
+ * <end-id>, both included.
+ *
+ * Returns: the number of messages removed
+ */
+int ackrangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if (argc != 4) return RedisModule_WrongArity(ctx);
+
+	return ackRangeAndReply(ctx, argv[1], argv[2], argv[3]);
+}
+
+/* Returns the position of the POP argument of RQ.ACKPOP, or -1 if missing */
+static int ackpopFindPop(RedisModuleString **argv, int argc)
+{
+	for(int i = 2; i < argc; i++){
+		if(RMUtil_StringEqualsCaseC(argv[i], "POP")){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Replies with the IDs acknowledged by RQ.ACKPOP, given as their positions
+ * in "argv" after their count, in "acked" */
+static void ackpopReplyAcked(RedisModuleCtx *ctx, RedisModuleString **argv, const int *acked)
+{
+	RedisModule_ReplyWithArray(ctx, acked[0]);
+	for(int i = 1; i <= acked[0]; i++){
+		RedisModule_ReplyWithString(ctx, argv[acked[i]]);
+	}
+}
+
+/* Reply callback for blocked RQ.ACKPOP */
+int ackpop_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	rq_pop_t popargs;
+	int at = ackpopFindPop(argv, argc);
+	rqueue_t *rqueue = readyQueue(ctx);
+
+	if(rqueue == NULL){
+		return REDISMODULE_ERR;
+	}
+
+	rq_parse_pop_args(ctx, &argv[at], argc - at, &popargs);
+
+	RedisModule_ReplyWithArray(ctx, 2);
+	ackpopReplyAcked(ctx, argv, RedisModule_GetBlockedClientPrivateData(ctx));
+	popQueuesAndReply(ctx, &rqueue, 1, &popargs);
+
+	return REDISMODULE_OK;
+}
+
+/* Timeout callback for blocked RQ.ACKPOP: the acks were done anyway */
+int ackpop_timeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_ReplyWithArray(ctx, 2);
+	ackpopReplyAcked(ctx, argv, RedisModule_GetBlockedClientPrivateData(ctx));
+	return RedisModule_ReplyWithNull(ctx);
+}
+
+void ackpop_freeData(RedisModuleCtx *ctx, void *privdata)
+{
+	REDISMODULE_NOT_USED(ctx);
+	RedisModule_Free(privdata);
+}
+
+/**
+ * RQ.ACKPOP <key> [ <id1> [ ... ] ] POP [ COUNT <count> ] [ BLOCK <ms> ] <queue1> [ <queue2> [ ... ] ]
+ *
+ * Acknowledges the given messages of <key>, as RQ.ACK does, and then pops
+ * messages from the given queues, as RQ.POP does, in a single round trip.
+ *
+ * Returns: a 2-element ARRAY, with the ARRAY of message ID's found and
+ * removed, and the messages popped (as RQ.POP would reply)
+ */
+int ackpopCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	rq_pop_t popargs;
+	int at = ackpopFindPop(argv, argc);
+
+	if(at < 0 || rq_parse_pop_args(ctx, &argv[at], argc - at, &popargs) || popargs.key_count == 0){
+		if(RedisModule_IsKeysPositionRequest(ctx)){
+			return REDISMODULE_OK;
+		}
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_ACKPOP_USAGE);
+	}
+
+	// The queues to pop from come after the IDs
+	if(RedisModule_IsKeysPositionRequest(ctx)){
+		RedisModule_KeyAtPos(ctx, 1);
+		for(uint k = 0; k < popargs.key_count; k++){
+			RedisModule_KeyAtPos(ctx, popargs.keys - argv + k);
+		}
+		return REDISMODULE_OK;
+	}
+
+	// Check every key before acknowledging anything
+	RedisModuleKey *keys[popargs.key_count];
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+	int available = 0;
+
+	if(
+		RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+		RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE
+	){
+		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	for(uint k = 0; k < popargs.key_count; k++){
+		keys[k] = RedisModule_OpenKey(ctx, popargs.keys[k], REDISMODULE_READ|REDISMODULE_WRITE);
+		if(RedisModule_KeyType(keys[k]) == REDISMODULE_KEYTYPE_EMPTY){
+			keys[k] = NULL;
+			continue;
+		}
+		if(RedisModule_ModuleTypeGetType(keys[k]) != RELIABLEQ_TYPE){
+			return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+		}
+		available |= ((rqueue_t *) RedisModule_ModuleTypeGetValue(keys[k]))->undelivered.len > 0;
+	}
+
+	// Acknowledge, remembering the position of every ID removed
+	int *acked = RedisModule_Alloc(sizeof(*acked) * at);
+	msgid_t id;
+
+	acked[0] = 0;
+	if(RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY){
+		rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
+		for(int i = 2; i < at; i++){
+			if(parseMsgId(argv[i], &id) && rq_ack(rqueue, &id)){
+				acked[++acked[0]] = i;
 			}
-			cur = next;
-		};
+		}
 	}
 
-	RedisModule_ReplySetArrayLength(ctx, removed);
+	if(available || popargs.block == 0){
+		rqueue_t *queues[popargs.key_count];
+		int n = 0;
+
+		for(uint k = 0; k < popargs.key_count; k++){
+			if(keys[k]){
+				queues[n++] = RedisModule_ModuleTypeGetValue(keys[k]);
+			}
+		}
+
+		RedisModule_ReplyWithArray(ctx, 2);
+		ackpopReplyAcked(ctx, argv, acked);
+		RedisModule_Free(acked);
+		popQueuesAndReply(ctx, queues, n, &popargs);
+
+		return REDISMODULE_OK;
+	}
+
+	// Nothing to pop yet: block, replying with the acked IDs once woken up
+	RedisModule_BlockClientOnKeys(
+		ctx,
+		ackpop_reply,
+		ackpop_timeout,
+		ackpop_freeData,
+		(popargs.block < 0 ? 0 : popargs.block),
+		popargs.keys,
+		popargs.key_count,
+		acked
+	);
 
 	return REDISMODULE_OK;
 }
@@ -592,48 +1628,310 @@ int recoverCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 		return RedisModule_ReplyWithError(ctx, MQ_ERROR_RECOVER_USAGE);
 	}
 
-	msg_t *cur = rqueue->delivered.first, *next; //, *prev;
+	msg_segment_t *seg = rqueue->delivered.first;
+	msg_t cur;
+	uint64_t expired, waiting;
+	uint32_t pos, live;
 	mstime_t now = mstime();
+	size_t left = rqueue->delivered.len; // don't recover the same message twice
+	msgid_t first = { 0, 0 }; // First one recovered: those after it are too
+	lease_t *leased = NULL;
+	int reclaimed, done = 0;
 
 	RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
 
-	while (
-		cur &&
-		(now - cur->lastDelivery) >= elapsed &&
-		recovered < count
-	)
+	while (!done && left > 0 && recovered < count && seg != NULL)
 	{
-		next = cur->next;
+		// Delivered messages are kept in the order they're recovered in (see
+		// segmentRecoverFrom): take the expired ones up to the first live
+		// message that has not expired yet. Those touched with EXTEND expire
+		// once their extension has elapsed too.
+		expired = scanExpired((const int64_t *) seg->lastDelivery, seg->tail, now - elapsed);
+		expired &= segmentLiveMask(seg);
+		for(uint64_t touched = expired; touched; touched &= touched - 1){
+			pos = __builtin_ctzll(touched);
+			if(seg->extend[pos] && segmentRecoverFrom(seg, pos) > now - elapsed){
+				expired &= ~(touched & -touched);
+			}
+		}
+		waiting = segmentLiveMask(seg) & ~expired;
+		if(waiting){
+			expired &= (waiting & -waiting) - 1;
+		}
+		if(expired == 0){
+			break;
+		}
 
-		//Reply
-		RedisModule_ReplyWithArray(ctx, 2);
-		RedisModule_ReplyWithString(
-			ctx,
-			RedisModule_CreateStringPrintf(ctx, MSG_ID_FORMAT, cur->id.ms, cur->id.seq)
-		);
-		RedisModule_ReplyWithString(ctx, cur->value);
+		// Emptying the first segment frees it, along with any emptied ones after it
+		reclaimed = (seg == rqueue->delivered.first);
+		live = seg->live;
 
-		//Update delivery info
-		cur->lastDelivery = now;
-		cur->deliveries += 1;
-		recovered += 1;
+		while (expired && left > 0 && recovered < count)
+		{
+			pos = __builtin_ctzll(expired);
+			expired &= expired - 1;
+			segmentGet(seg, pos, &cur);
+			left -= 1;
+
+			// Recovered messages go back right after the expired ones
+			if(recovered && cur.id.ms == first.ms && cur.id.seq == first.seq){
+				done = 1;
+				break;
+			}
 
-		//Move current node to the end of the delivered queue
-		if(cur->next){
-			rqueue->delivered.first = cur->next;
-			((msg_t *)rqueue->delivered.last)->next = cur;
-			rqueue->delivered.last = cur;
-			cur->next = NULL;
+			// Delivered too many times already
+			if(rq_deadletter(ctx, rqueue, seg, pos)){
+				live -= 1;
+				continue;
+			}
+
+			//Update delivery info
+			cur.lastDelivery = now;
+			cur.deliveries += 1;
+			cur.batch = 0; // No longer part of the batch it was popped in
+			cur.extend = 0;
+			cur.lease = rq_lease(rqueue, POP_LEASE_QUEUE);
+			if(recovered++ == 0){
+				first = cur.id;
+			}
+
+			// Redelivered with the visibility timeout of the queue, if any
+			if(cur.lease){
+				if(leased == NULL){
+					leased = leaseCreate(rqueue, (size_t) count < left + 1 ? count : left + 1, now + cur.lease);
+				}
+				leased = leasePush(leased, cur.id.ms, cur.id.seq);
+			}
+
+			//Move current node back into the delivered queue, as delivered now
+			rq_deliver(rqueue, &cur);
+			queueRemove(rqueue, &rqueue->delivered, seg, pos);
+			live -= 1;
+
+			//Reply
+			RedisModule_ReplyWithArray(ctx, 2);
+			replyWithMsgId(ctx, cur.id.ms, cur.id.seq);
+			payloadReply(ctx, rqueue, &cur.payload);
 		}
 
-		cur = next;
+		// Messages past the segment are newer than the ones still waiting in it
+		if(waiting){
+			break;
+		}
+		seg = reclaimed && live == 0 ? rqueue->delivered.first : seg->next;
 	}
 	
+	if(leased){
+		leaseSchedule(leased);
+	}
+
 	RedisModule_ReplySetArrayLength(ctx, recovered);
 
 	return REDISMODULE_OK;
 }
 
+/* Whether a DEADLETTER value names a key ("" is none) */
+static int deadletterKey(RedisModuleString *value)
+{
+	size_t len;
+
+	RedisModule_StringPtrLen(value, &len);
+
+	return len > 0;
+}
+
+/* Whether the queue at "keyname" can have its dead letters moved to the key
+ * "name": one that's empty, or holds another queue */
+static int deadletterValid(RedisModuleCtx *ctx, RedisModuleString *keyname, const char *name)
+{
+	RedisModuleString *dead = RedisModule_CreateString(ctx, name, strlen(name));
+	RedisModuleKey *key;
+	int valid;
+
+	if(RedisModule_StringCompare(dead, keyname) == 0 || !rq_same_slot(ctx, keyname, name)){
+		return 0;
+	}
+
+	key = RedisModule_OpenKey(ctx, dead, REDISMODULE_READ);
+	valid = RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY || RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE;
+	RedisModule_CloseKey(key);
+
+	return valid;
+}
+
+/**
+ * RQ.CONFIG <key> [ <setting> <value> [ ... ] ]
+ * 
+ * Without settings, returns the settings of the queue at <key>, as field-value
+ * pairs. Otherwise, changes the given settings (creating an empty queue if
+ * <key> doesn't exist yet). Settings only apply to messages pushed afterwards:
+ * - COMPRESS <bytes>: compress payloads of at least <bytes> bytes (0: disabled)
+ * - INTERN <0|1>: store identical payloads once, shared by every interning queue
+ *
+ * A DEADLETTER key is a key of the command too, so it's checked against ACLs
+ * and has to be in the same slot in a cluster. It can't hold anything but a
+ * queue, other than the queue itself. It's the only command to declare it:
+ * the commands moving messages into it find it in the settings, which aren't
+ * arguments of theirs, so only the slot is checked again then.
+ * 
+ * Returns: OK, or the settings
+ */
+int configCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if(RedisModule_IsKeysPositionRequest(ctx)){
+		RedisModule_KeyAtPos(ctx, 1);
+		for(int i = 2; i + 1 < argc; i += 2){
+			if(RMUtil_StringEqualsCaseC(argv[i], "DEADLETTER") && deadletterKey(argv[i + 1])){
+				RedisModule_KeyAtPos(ctx, i + 1);
+			}
+		}
+		return REDISMODULE_OK;
+	}
+
+	if (argc < 2 || argc % 2 != 0) return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+	int type = RedisModule_KeyType(key);
+	rqueue_t *rqueue = NULL;
+	rq_settings_t settings;
+	char value[SETTINGS_VALUE_MAX];
+
+	if(type != REDISMODULE_KEYTYPE_EMPTY){
+		if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+			return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+		}
+		rqueue = RedisModule_ModuleTypeGetValue(key);
+	}
+
+	// Get
+	if(argc == 2){
+		if(rqueue == NULL){
+			return RedisModule_ReplyWithError(ctx, ERRORMSG_EMPTYKEY);
+		}
+
+		RedisModule_ReplyWithArray(ctx, settingsCount() * 2);
+		for(int i = 0; i < settingsCount(); i++){
+			settingsFormat(&rqueue->settings, i, value, sizeof(value));
+			RedisModule_ReplyWithCString(ctx, settingsName(i));
+			RedisModule_ReplyWithCString(ctx, value);
+		}
+		return REDISMODULE_OK;
+	}
+
+	// Set: validate everything before changing anything
+	if(rqueue){
+		settings = rqueue->settings;
+	} else {
+		settingsInit(&settings);
+	}
+
+	for(int i = 2; i < argc; i += 2){
+		if(settingsSet(
+			&settings,
+			RedisModule_StringPtrLen(argv[i], NULL),
+			RedisModule_StringPtrLen(argv[i + 1], NULL)
+		) != REDISMODULE_OK){
+			return RedisModule_ReplyWithError(ctx, MQ_ERROR_CONFIG_SETTING);
+		}
+	}
+
+	if(
+		strcmp(settings.deadletter, rqueue ? rqueue->settings.deadletter : "") &&
+		!deadletterValid(ctx, argv[1], settings.deadletter)
+	){
+		return RedisModule_ReplyWithError(ctx, MQ_ERROR_CONFIG_DEADLETTER);
+	}
+
+	if(rqueue == NULL){
+		rqueue = rqueueCreate(argv[1], RedisModule_GetSelectedDb(ctx));
+		RedisModule_ModuleTypeSetValue(key, RELIABLEQ_TYPE, rqueue);
+	}
+	rqueue->settings = settings;
+	rqueue->lease_auto = 0; // Computed again with the new percentile and factor
+
+	return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/**
+ * RQ.COMPACT <key>
+ * 
+ * Compacts the storage of the queue at <key> right away: sparse segments get
+ * merged, and small payloads get moved out of mostly-empty chunks. The same
+ * work is done incrementally in the background.
+ * 
+ * Returns: Array of field-value pairs with the work done
+ */
+int compactCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+	RedisModule_AutoMemory(ctx);
+
+	if (argc != 2) return RedisModule_WrongArity(ctx);
+
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+	int type = RedisModule_KeyType(key);
+
+	if(type == REDISMODULE_KEYTYPE_EMPTY){
+		return RedisModule_ReplyWithError(ctx, ERRORMSG_EMPTYKEY);
+	}
+
+	if(RedisModule_ModuleTypeGetType(key) != RELIABLEQ_TYPE){
+		return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+	}
+
+	rqueue_t *rqueue = RedisModule_ModuleTypeGetValue(key);
+	rq_compact_stats_t stats = { 0, 0, 0 };
+
+	// Restart from the beginning, even if a background pass was in progress
+	compactUnschedule(rqueue);
+	compactSchedule(rqueue);
+	compactStep(rqueue, 0, &stats);
+	compactUnschedule(rqueue);
+
+	RedisModule_ReplyWithArray(ctx, 6);
+
+	RedisModule_ReplyWithCString(ctx, "segments_freed");
+	RedisModule_ReplyWithLongLong(ctx, stats.segments_freed);
+
+	RedisModule_ReplyWithCString(ctx, "messages_moved");
+	RedisModule_ReplyWithLongLong(ctx, stats.messages_moved);
+
+	RedisModule_ReplyWithCString(ctx, "payloads_moved");
+	RedisModule_ReplyWithLongLong(ctx, stats.payloads_moved);
+
+	return REDISMODULE_OK;
+}
+
+/* Keeps the key name and database of queues (see rqueue_t) as they are loaded
+ * from the RDB, restored, renamed or moved: events of the key where they end
+ * up, in the database selected in "ctx" */
+static int keyspaceEvent(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *keyname){
+	REDISMODULE_NOT_USED(type);
+	RedisModuleString *name;
+	RedisModuleKey *key;
+	rqueue_t *rqueue;
+
+	if(strcmp(event, "loaded") && strcmp(event, "restore") && strcmp(event, "rename_to") && strcmp(event, "move_to")){
+		return REDISMODULE_OK;
+	}
+
+	// A copy, since "loaded" gives a key name that can't be retained
+	name = RedisModule_CreateStringFromString(NULL, keyname);
+	key = RedisModule_OpenKey(ctx, name, REDISMODULE_READ);
+	if(RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE){
+		rqueue = RedisModule_ModuleTypeGetValue(key);
+		rqueue->db = RedisModule_GetSelectedDb(ctx);
+		RedisModule_FreeString(NULL, rqueue->name);
+		rqueue->name = name;
+	} else {
+		RedisModule_FreeString(NULL, name);
+	}
+	RedisModule_CloseKey(key);
+
+	return REDISMODULE_OK;
+}
+
 void QueueAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
 	//TODO
 	return;
@@ -721,13 +2019,53 @@ int TestModule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   return REDISMODULE_OK;
 }
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 
 	// Register the module itself
 	if (RedisModule_Init(ctx, "mq", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR) {
 		return REDISMODULE_ERR;
 	}
 
+	// Module arguments: [ INLINE_THRESHOLD <bytes> ]
+	long long threshold;
+	if(RMUtil_ArgIndex("INLINE_THRESHOLD", argv, argc) >= 0){
+		if(
+			RMUtil_ParseArgsAfter("INLINE_THRESHOLD", argv, argc, "l", &threshold) != REDISMODULE_OK ||
+			threshold < 0 || threshold > PAYLOAD_INLINE_MAX
+		){
+			RedisModule_Log(ctx, "warning", "INLINE_THRESHOLD must be between 0 and %d", PAYLOAD_INLINE_MAX);
+			return REDISMODULE_ERR;
+		}
+		rq_config.inline_threshold = threshold;
+	}
+
+	// [ SPILL_DIR <path> ] [ SPILL_MEMORY_RATIO <ratio> ]
+	const char *dir;
+	if(RMUtil_ArgIndex("SPILL_DIR", argv, argc) >= 0){
+		if(
+			RMUtil_ParseArgsAfter("SPILL_DIR", argv, argc, "c", &dir) != REDISMODULE_OK ||
+			access(dir, W_OK) != 0
+		){
+			RedisModule_Log(ctx, "warning", "SPILL_DIR must be a writable directory");
+			return REDISMODULE_ERR;
+		}
+		rq_config.spill_dir = RedisModule_Strdup(dir);
+	}
+
+	double ratio;
+	if(RMUtil_ArgIndex("SPILL_MEMORY_RATIO", argv, argc) >= 0){
+		if(
+			RMUtil_ParseArgsAfter("SPILL_MEMORY_RATIO", argv, argc, "d", &ratio) != REDISMODULE_OK ||
+			ratio < 0 || ratio > 1
+		){
+			RedisModule_Log(ctx, "warning", "SPILL_MEMORY_RATIO must be between 0 and 1");
+			return REDISMODULE_ERR;
+		}
+		rq_config.spill_memory_ratio = ratio;
+	}
+
+	RedisModule_Log(ctx, "notice", "Using %s kernels for message scans", scanInit());
+
 	// Register the ReliableQueue Type
 	RedisModuleTypeMethods tm = {
 		.version = REDISMODULE_TYPE_METHOD_VERSION,
@@ -750,15 +2088,48 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
 	if (RedisModule_CreateCommand(ctx,"rq.push", pushCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
       return REDISMODULE_ERR;
 
-	if (RedisModule_CreateCommand(ctx,"rq.pop", popCommand,"write",2,2,1) == REDISMODULE_ERR)
+	if (RedisModule_CreateCommand(ctx,"rq.pushex", pushexCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.pushpacked", pushpackedCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.mpush", mpushCommand,"write deny-oom getkeys-api",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.pop", popCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
 		return REDISMODULE_ERR;
 
 	if (RedisModule_CreateCommand(ctx,"rq.ack", ackCommand,"write",1,1,1) == REDISMODULE_ERR)
 		return REDISMODULE_ERR;
 
+	if (RedisModule_CreateCommand(ctx,"rq.mack", mackCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.nack", nackCommand,"write",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.touch", touchCommand,"write",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.ackrange", ackrangeCommand,"write",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.ackpop", ackpopCommand,"write getkeys-api",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.exec", execCommand,"write deny-oom getkeys-api",0,0,0) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
 	if (RedisModule_CreateCommand(ctx,"rq.recover", recoverCommand,"write",1,1,1) == REDISMODULE_ERR)
 		return REDISMODULE_ERR;
 
+	if (RedisModule_CreateCommand(ctx,"rq.compact", compactCommand,"write",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx,"rq.config", configCommand,"write deny-oom getkeys-api",1,1,1) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
 	// register xq.info - the default registration syntax
 	if (RedisModule_CreateCommand(ctx, "rq.info", infoCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR) {
 		return REDISMODULE_ERR;
@@ -777,6 +2148,15 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
 
 	// register the unit test
 	RMUtil_RegisterWriteCmd(ctx, "rq.test", TestModule);
+
+	// Where queues are, for the timers
+	if(RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_GENERIC|REDISMODULE_NOTIFY_LOADED, keyspaceEvent) == REDISMODULE_ERR){
+		return REDISMODULE_ERR;
+	}
+
+	// Background compaction of sparse queues
+	compactStartTimer(ctx);
+	leaseStartTimer(ctx);
 	
 
 	return REDISMODULE_OK;
@@ -0,0 +1,102 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "./rqueue.h"
+
+static void regionRelease(rqueue_t *rqueue, offload_region_t *region){
+	region->refs -= 1;
+	if(region->refs == 0){
+		munmap(region->data, region->size);
+		rqueue->stats.offload_mapped -= region->size;
+		rqueue->memory_used -= sizeof(*region);
+		RedisModule_Free(region);
+	}
+}
+
+void offloadClose(rqueue_t *rqueue){
+	offload_region_t *region = rqueue->offload;
+
+	if(region == NULL){
+		return;
+	}
+
+	// Nothing else gets written: let the kernel reclaim the pages once written back
+	madvise(region->data, region->size, MADV_DONTNEED);
+	rqueue->offload = NULL;
+	regionRelease(rqueue, region);
+}
+
+/* Maps a new region, with its disk space already allocated so writing to it
+ * can't fail later on */
+static offload_region_t *regionCreate(rqueue_t *rqueue){
+	offload_region_t *region;
+	void *data;
+	int fd, err;
+
+	if((fd = spillCreateFile("offload", 0)) == -1){
+		return NULL;
+	}
+
+	if((err = posix_fallocate(fd, 0, OFFLOAD_REGION_SIZE)) != 0){
+		errno = err;
+		spillError("allocate");
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, OFFLOAD_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		spillError("mmap");
+		return NULL;
+	}
+
+	region = RedisModule_Alloc(sizeof(*region));
+	region->refs = 1;
+	region->used = 0;
+	region->live = 0;
+	region->size = OFFLOAD_REGION_SIZE;
+	region->data = data;
+	rqueue->memory_used += sizeof(*region);
+	rqueue->stats.offload_mapped += region->size;
+
+	return region;
+}
+
+offload_region_t *offloadStore(rqueue_t *rqueue, const void *head, size_t headlen, const char *buf, size_t len, uint32_t *off){
+	offload_region_t *region = rqueue->offload;
+
+	len += headlen;
+	if(len > OFFLOAD_REGION_SIZE){
+		return NULL;
+	}
+
+	// Open a new region if the current one has no room left
+	if(region == NULL || region->size - region->used < len){
+		offloadClose(rqueue);
+		if((region = regionCreate(rqueue)) == NULL){
+			return NULL;
+		}
+		rqueue->offload = region;
+	}
+
+	memcpy(region->data + region->used, head, headlen);
+	memcpy(region->data + region->used + headlen, buf, len - headlen);
+	*off = region->used;
+	region->used += len;
+	region->live += len;
+	region->refs += 1;
+
+	rqueue->stats.offloaded += 1;
+	rqueue->stats.offload_live += len;
+
+	return region;
+}
+
+void offloadRelease(rqueue_t *rqueue, offload_region_t *region, size_t len){
+	region->live -= len;
+	rqueue->stats.offload_live -= len;
+	regionRelease(rqueue, region);
+}
@@ -0,0 +1,37 @@
+#ifndef __OFFLOAD_H__
+#define __OFFLOAD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OFFLOAD_REGION_SIZE (16 * 1024 * 1024) /* Size of every region of the payload log */
+
+struct rqueue_t;
+
+/**
+ * A region of the payload log: a file in SPILL_DIR mapped in memory, holding
+ * the payloads of delivered messages one after the other. Its pages are left
+ * to the kernel to write back and evict once the region is full, so they're
+ * only paged in again if the payloads are read. Like payload chunks, regions
+ * are freed when the last payload stored in them is released.
+ */
+typedef struct offload_region_t {
+    uint32_t refs; // Payloads still stored in the region (+1 while open for appends)
+    uint32_t used; // Bytes of "data" in use
+    uint32_t size; // Capacity of "data"
+    uint32_t live; // Bytes of "data" held by payloads not yet released
+    char *data;    // The mapped file
+} offload_region_t;
+
+/* Copies "head" and then "buf" into the payload log of the queue, returning
+ * the region that holds them and setting "off" to their offset there. Returns
+ * NULL if they don't fit a region, or the log can't grow. */
+offload_region_t *offloadStore(struct rqueue_t *rqueue, const void *head, size_t headlen, const char *buf, size_t len, uint32_t *off);
+
+/* Releases "len" bytes held by a payload stored in the region */
+void offloadRelease(struct rqueue_t *rqueue, offload_region_t *region, size_t len);
+
+/* Releases the region currently open for appends in the given queue */
+void offloadClose(struct rqueue_t *rqueue);
+
+#endif
@@ -0,0 +1,468 @@
+#include <string.h>
+#include "./rqueue.h"
+#include "./lzf.h"
+#include "./intern.h"
+#include "./offload.h"
+#include "./error.h"
+
+/* A closed chunk is sparse when less than a quarter of it is still live */
+static int chunkIsSparse(rqueue_t *rqueue, payload_chunk_t *chunk){
+	return chunk != rqueue->chunk && chunk->live < chunk->size / 4;
+}
+
+static void chunkRelease(rqueue_t *rqueue, payload_chunk_t *chunk){
+	chunk->refs -= 1;
+	if(chunk->refs == 0){
+		rqueue->memory_used -= sizeof(*chunk) + chunk->size;
+		RedisModule_Free(chunk);
+	} else if(chunkIsSparse(rqueue, chunk)){
+		compactSchedule(rqueue);
+	}
+}
+
+void payloadCloseChunk(rqueue_t *rqueue){
+	if(rqueue->chunk){
+		chunkRelease(rqueue, rqueue->chunk);
+		rqueue->chunk = NULL;
+	}
+}
+
+/* Stores a compressed copy of "buf" if the queue compresses payloads of this
+ * size, and it's worth it. Returns 1 if the payload was stored. */
+static int payloadCompress(rqueue_t *rqueue, payload_t *p, const char *buf, size_t len){
+	size_t threshold = rqueue->settings.compress_threshold;
+	size_t max = len - len / PAYLOAD_COMPRESS_MIN_SAVING;
+	size_t clen;
+	long long start;
+	char *out;
+
+	if(threshold == 0 || len < threshold || len > UINT32_MAX){
+		return 0;
+	}
+
+	start = ustime();
+	out = RedisModule_Alloc(max);
+	clen = lzfCompress(buf, len, out, max);
+	rqueue->stats.compress_us += ustime() - start;
+
+	if(clen == 0){
+		RedisModule_Free(out);
+		return 0;
+	}
+
+	p->ref = RedisModule_Realloc(out, clen);
+	p->off = clen;
+	p->len = len;
+	p->enc = PAYLOAD_ENC_LZF;
+	rqueue->memory_used += clen;
+	rqueue->stats.compressed += 1;
+	rqueue->stats.compressed_in += len;
+	rqueue->stats.compressed_out += clen;
+
+	return 1;
+}
+
+/* Stores a reference to the shared copy of "buf" if the queue interns its
+ * payloads. Returns 1 if the payload was stored. */
+static int payloadIntern(rqueue_t *rqueue, payload_t *p, const char *buf, size_t len){
+	int hit;
+
+	if(!rqueue->settings.intern || len > UINT32_MAX){
+		return 0;
+	}
+
+	p->ref = internAcquire(buf, len, &hit);
+	p->off = 0;
+	p->len = len;
+	p->enc = PAYLOAD_ENC_INTERN;
+
+	if(hit){
+		rqueue->stats.intern_hits += 1;
+		rqueue->stats.intern_saved += len;
+	} else {
+		rqueue->stats.intern_misses += 1;
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the payload is stored compressed, in memory or in the payload log */
+static int payloadIsCompressed(const payload_t *p){
+	return p->enc == PAYLOAD_ENC_LZF || p->enc == PAYLOAD_ENC_OFFLOAD_LZF;
+}
+
+/* Returns a decompressed copy of a compressed payload, to be freed by the
+ * caller, and sets "len". Returns NULL if it's corrupt. */
+static char *payloadDecompress(rqueue_t *rqueue, const payload_t *p, size_t *len){
+	const char *data = p->ref;
+	size_t datalen = p->off;
+	uint32_t len32 = p->len;
+	long long start;
+	char *buf;
+
+	// Offloaded along with their uncompressed length
+	if(p->enc == PAYLOAD_ENC_OFFLOAD_LZF){
+		data = ((offload_region_t *) p->ref)->data + p->off;
+		memcpy(&len32, data, sizeof(len32));
+		data += sizeof(len32);
+		datalen = p->len;
+	}
+
+	buf = RedisModule_Alloc(len32 ? len32 : 1);
+	start = ustime();
+	*len = lzfDecompress(data, datalen, buf, len32);
+	rqueue->stats.decompress_us += ustime() - start;
+	if(*len != len32){
+		RedisModule_Free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Copies the payload into the queue's open chunk */
+static void payloadStoreInline(rqueue_t *rqueue, payload_t *p, const char *buf, size_t len){
+	payload_chunk_t *chunk = rqueue->chunk;
+	uint32_t len32 = len;
+
+	// Open a new chunk if the current one has no room left
+	if(chunk == NULL || chunk->size - chunk->used < sizeof(len32) + len){
+		payloadCloseChunk(rqueue);
+		chunk = RedisModule_Alloc(sizeof(*chunk) + PAYLOAD_CHUNK_SIZE);
+		chunk->refs = 1;
+		chunk->used = 0;
+		chunk->live = 0;
+		chunk->size = PAYLOAD_CHUNK_SIZE;
+		rqueue->chunk = chunk;
+		rqueue->memory_used += sizeof(*chunk) + chunk->size;
+	}
+
+	memcpy(chunk->data + chunk->used, &len32, sizeof(len32));
+	memcpy(chunk->data + chunk->used + sizeof(len32), buf, len);
+	chunk->refs += 1;
+
+	p->ref = chunk;
+	p->off = chunk->used;
+	p->len = len;
+	p->enc = PAYLOAD_ENC_INLINE;
+	chunk->used += sizeof(len32) + len;
+	chunk->live += sizeof(len32) + len;
+}
+
+void payloadStoreBuffer(rqueue_t *rqueue, payload_t *p, const char *buf, size_t len){
+	if(payloadIntern(rqueue, p, buf, len) || payloadCompress(rqueue, p, buf, len)){
+		return;
+	}
+
+	if(len < rq_config.inline_threshold){
+		payloadStoreInline(rqueue, p, buf, len);
+		return;
+	}
+
+	p->ref = RedisModule_CreateString(NULL, buf, len);
+	p->off = 0;
+	p->len = len;
+	p->enc = PAYLOAD_ENC_STRING;
+	rqueue->memory_used += len + PAYLOAD_STRING_OVERHEAD;
+}
+
+void payloadStore(rqueue_t *rqueue, payload_t *p, RedisModuleString *str){
+	size_t len;
+	const char *buf = RedisModule_StringPtrLen(str, &len);
+
+	if(payloadIntern(rqueue, p, buf, len) || payloadCompress(rqueue, p, buf, len)){
+		return;
+	}
+
+	if(len < rq_config.inline_threshold){
+		payloadStoreInline(rqueue, p, buf, len);
+		return;
+	}
+
+	p->ref = RedisModule_HoldString(NULL, str);
+	p->off = 0;
+	p->len = len;
+	p->enc = PAYLOAD_ENC_STRING;
+	rqueue->memory_used += len + PAYLOAD_STRING_OVERHEAD;
+}
+
+static uint32_t readLE32(const char *buf){
+	const unsigned char *b = (const unsigned char *) buf;
+
+	return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+long long payloadPackedCount(const char *buf, size_t len){
+	long long count = 0;
+	size_t at = 0;
+
+	// Offsets inside a chunk are 32 bit
+	if(len > UINT32_MAX){
+		return -1;
+	}
+
+	while(at < len){
+		if(len - at < sizeof(uint32_t) || len - at - sizeof(uint32_t) < readLE32(buf + at)){
+			return -1;
+		}
+		at += sizeof(uint32_t) + readLE32(buf + at);
+		count += 1;
+	}
+
+	return count;
+}
+
+payload_chunk_t *payloadPackedOpen(rqueue_t *rqueue, const char *buf, size_t len){
+	payload_chunk_t *chunk = RedisModule_Alloc(sizeof(*chunk) + len);
+	uint32_t len32;
+
+	// Packed payloads are laid out as in any chunk, but for the byte order
+	memcpy(chunk->data, buf, len);
+	for(size_t at = 0; at < len; at += sizeof(len32) + len32){
+		len32 = readLE32(buf + at);
+		memcpy(chunk->data + at, &len32, sizeof(len32));
+	}
+
+	chunk->refs = 1;
+	chunk->used = len;
+	chunk->live = 0;
+	chunk->size = len;
+	rqueue->memory_used += sizeof(*chunk) + chunk->size;
+
+	return chunk;
+}
+
+void payloadPackedNext(rqueue_t *rqueue, payload_chunk_t *chunk, uint32_t *off, payload_t *p){
+	uint32_t len32;
+
+	memcpy(&len32, chunk->data + *off, sizeof(len32));
+
+	if(rqueue->settings.intern || rqueue->settings.compress_threshold){
+		payloadStoreBuffer(rqueue, p, chunk->data + *off + sizeof(len32), len32);
+	} else {
+		p->ref = chunk;
+		p->off = *off;
+		p->len = len32;
+		p->enc = PAYLOAD_ENC_INLINE;
+		chunk->refs += 1;
+		chunk->live += sizeof(len32) + len32;
+	}
+
+	*off += sizeof(len32) + len32;
+}
+
+void payloadPackedClose(rqueue_t *rqueue, payload_chunk_t *chunk){
+	chunkRelease(rqueue, chunk);
+}
+
+const char *payloadPtr(const payload_t *p, size_t *len){
+	uint32_t len32;
+
+	switch(p->enc){
+		case PAYLOAD_ENC_STRING:
+			return RedisModule_StringPtrLen(p->ref, len);
+		case PAYLOAD_ENC_INLINE:
+			memcpy(&len32, ((payload_chunk_t *) p->ref)->data + p->off, sizeof(len32));
+			*len = len32;
+			return ((payload_chunk_t *) p->ref)->data + p->off + sizeof(len32);
+		case PAYLOAD_ENC_INTERN:
+			*len = p->len;
+			return ((interned_t *) p->ref)->data;
+		case PAYLOAD_ENC_OFFLOAD:
+			*len = p->len;
+			return ((offload_region_t *) p->ref)->data + p->off;
+	}
+
+	*len = 0;
+	return NULL;
+}
+
+const char *payloadBytes(rqueue_t *rqueue, const payload_t *p, size_t *len, char **tofree){
+	*tofree = NULL;
+	if(!payloadIsCompressed(p)){
+		return payloadPtr(p, len);
+	}
+
+	return *tofree = payloadDecompress(rqueue, p, len);
+}
+
+size_t payloadSize(const payload_t *p){
+	uint32_t len32;
+
+	if(p->enc == PAYLOAD_ENC_OFFLOAD_LZF){
+		memcpy(&len32, ((offload_region_t *) p->ref)->data + p->off, sizeof(len32));
+		return len32;
+	}
+
+	return p->len;
+}
+
+int payloadReply(RedisModuleCtx *ctx, rqueue_t *rqueue, const payload_t *p){
+	size_t len;
+	const char *buf;
+	char *plain;
+	int ret;
+
+	switch(p->enc){
+		case PAYLOAD_ENC_STRING:
+			return RedisModule_ReplyWithString(ctx, p->ref);
+		case PAYLOAD_ENC_LZF:
+		case PAYLOAD_ENC_OFFLOAD_LZF:
+			if((plain = payloadDecompress(rqueue, p, &len)) == NULL){
+				return RedisModule_ReplyWithError(ctx, MQ_ERROR_CORRUPT_PAYLOAD);
+			}
+			ret = RedisModule_ReplyWithStringBuffer(ctx, plain, len);
+			RedisModule_Free(plain);
+			return ret;
+	}
+
+	buf = payloadPtr(p, &len);
+	return RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+}
+
+void payloadSave(RedisModuleIO *rdb, rqueue_t *rqueue, const payload_t *p){
+	size_t len;
+	const char *buf;
+	char *plain;
+
+	switch(p->enc){
+		case PAYLOAD_ENC_STRING:
+			RedisModule_SaveString(rdb, p->ref);
+			return;
+		case PAYLOAD_ENC_LZF:
+		case PAYLOAD_ENC_OFFLOAD_LZF:
+			// Saved uncompressed: loading compresses again, if still enabled
+			if((plain = payloadDecompress(rqueue, p, &len)) == NULL){
+				RedisModule_LogIOError(rdb, "warning", "Corrupt compressed payload saved as empty");
+				RedisModule_SaveStringBuffer(rdb, "", 0);
+				return;
+			}
+			RedisModule_SaveStringBuffer(rdb, plain, len);
+			RedisModule_Free(plain);
+			return;
+	}
+
+	buf = payloadPtr(p, &len);
+	RedisModule_SaveStringBuffer(rdb, buf, len);
+}
+
+void payloadLoad(RedisModuleIO *rdb, rqueue_t *rqueue, payload_t *p){
+	size_t len;
+	char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+
+	payloadStoreBuffer(rqueue, p, buf, len);
+	RedisModule_Free(buf);
+}
+
+void payloadRelease(rqueue_t *rqueue, payload_t *p){
+	switch(p->enc){
+		case PAYLOAD_ENC_STRING:
+			RedisModule_FreeString(NULL, p->ref);
+			rqueue->memory_used -= p->len + PAYLOAD_STRING_OVERHEAD;
+			break;
+		case PAYLOAD_ENC_INLINE:
+			((payload_chunk_t *) p->ref)->live -= sizeof(uint32_t) + p->len;
+			chunkRelease(rqueue, p->ref);
+			break;
+		case PAYLOAD_ENC_LZF:
+			RedisModule_Free(p->ref);
+			rqueue->memory_used -= p->off;
+			break;
+		case PAYLOAD_ENC_INTERN:
+			internRelease(p->ref);
+			break;
+		case PAYLOAD_ENC_OFFLOAD:
+			offloadRelease(rqueue, p->ref, p->len);
+			break;
+		case PAYLOAD_ENC_OFFLOAD_LZF:
+			offloadRelease(rqueue, p->ref, sizeof(uint32_t) + p->len);
+			break;
+	}
+
+	p->ref = NULL;
+	p->enc = PAYLOAD_ENC_NONE;
+}
+
+void payloadMove(rqueue_t *from, rqueue_t *to, payload_t *p){
+	payload_t moved;
+	const char *buf;
+	char *plain;
+	size_t len;
+
+	switch(p->enc){
+		case PAYLOAD_ENC_STRING:
+			from->memory_used -= p->len + PAYLOAD_STRING_OVERHEAD;
+			to->memory_used += p->len + PAYLOAD_STRING_OVERHEAD;
+			return;
+		case PAYLOAD_ENC_LZF:
+			from->memory_used -= p->off;
+			to->memory_used += p->off;
+			return;
+		case PAYLOAD_ENC_INTERN:
+			return;
+	}
+
+	// Chunks and the payload log are accounted to their queue
+	buf = payloadBytes(from, p, &len, &plain);
+	payloadStoreBuffer(to, &moved, buf, len);
+	if(plain){
+		RedisModule_Free(plain);
+	}
+	payloadRelease(from, p);
+	*p = moved;
+}
+
+int payloadOffload(rqueue_t *rqueue, payload_t *p){
+	size_t threshold = rqueue->settings.offload;
+	payload_t moved;
+	const char *buf;
+	uint32_t len32;
+	size_t len;
+
+	// Interned payloads are shared with other messages anyway
+	if(
+		threshold == 0 || p->len < threshold || p->enc == PAYLOAD_ENC_INTERN ||
+		p->enc == PAYLOAD_ENC_OFFLOAD || p->enc == PAYLOAD_ENC_OFFLOAD_LZF
+	){
+		return 0;
+	}
+
+	// Compressed ones are written as they are, after their uncompressed length
+	if(p->enc == PAYLOAD_ENC_LZF){
+		len32 = p->len;
+		moved.ref = offloadStore(rqueue, &len32, sizeof(len32), p->ref, p->off, &moved.off);
+		moved.len = p->off;
+		moved.enc = PAYLOAD_ENC_OFFLOAD_LZF;
+	} else {
+		buf = payloadPtr(p, &len);
+		moved.ref = offloadStore(rqueue, NULL, 0, buf, len, &moved.off);
+		moved.len = len;
+		moved.enc = PAYLOAD_ENC_OFFLOAD;
+	}
+	if(moved.ref == NULL){
+		return 0;
+	}
+
+	payloadRelease(rqueue, p);
+	*p = moved;
+
+	return 1;
+}
+
+int payloadRelocate(rqueue_t *rqueue, payload_t *p){
+	payload_t moved;
+	size_t len;
+	const char *buf;
+
+	if(p->enc != PAYLOAD_ENC_INLINE || !chunkIsSparse(rqueue, p->ref)){
+		return 0;
+	}
+
+	// The old chunk stays alive until the copy is released below
+	buf = payloadPtr(p, &len);
+	payloadStoreBuffer(rqueue, &moved, buf, len);
+	payloadRelease(rqueue, p);
+	*p = moved;
+
+	return 1;
+}
@@ -0,0 +1,109 @@
+#ifndef __PAYLOAD_H__
+#define __PAYLOAD_H__
+
+#include <stdint.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+
+#define PAYLOAD_CHUNK_SIZE 4096 /* Default capacity of an inline payloads chunk */
+#define PAYLOAD_INLINE_THRESHOLD 128 /* Default inline threshold (bytes) */
+#define PAYLOAD_INLINE_MAX 1024 /* Max allowed inline threshold */
+#define PAYLOAD_STRING_OVERHEAD 24 /* robj + sds header of a RedisModuleString */
+
+/* Payload encodings */
+#define PAYLOAD_ENC_NONE 0   /* Empty slot */
+#define PAYLOAD_ENC_STRING 1 /* "ref" is a held RedisModuleString */
+#define PAYLOAD_ENC_INLINE 2 /* Length-prefixed copy at "off" inside the payload_chunk_t at "ref" */
+#define PAYLOAD_ENC_LZF 3    /* "ref" is a buffer holding "off" bytes of LZF compressed data */
+#define PAYLOAD_ENC_INTERN 4 /* "ref" is a shared interned_t entry (see intern.h) */
+#define PAYLOAD_ENC_OFFLOAD 5 /* "len" bytes at "off" of the offload_region_t at "ref" (see offload.h) */
+#define PAYLOAD_ENC_OFFLOAD_LZF 6 /* As PAYLOAD_ENC_OFFLOAD, but "len" bytes of LZF compressed data, after their 32 bit uncompressed length */
+
+#define PAYLOAD_COMPRESS_MIN_SAVING 8 /* Keep compressed copies at least 1/8 smaller */
+
+struct rqueue_t;
+
+/**
+ * Contiguous storage shared by many small payloads. Every payload is stored
+ * as a 32 bit length prefix followed by its bytes. The chunk is freed when
+ * the last payload stored in it is released.
+ */
+typedef struct payload_chunk_t {
+    uint32_t refs; // Payloads still referencing the chunk (+1 while open for appends)
+    uint32_t used; // Bytes of "data" in use
+    uint32_t size; // Capacity of "data"
+    uint32_t live; // Bytes of "data" held by payloads not yet released
+    char data[];
+} payload_chunk_t;
+
+/* A message body, in any of the PAYLOAD_ENC_* encodings */
+typedef struct payload_t {
+    void *ref;
+    uint32_t off;
+    uint32_t len;
+    uint32_t enc;
+} payload_t;
+
+/* Stores the string as the payload "p" of a message of the given queue. Small
+ * payloads are copied inline, larger ones are retained, or compressed if the
+ * queue has compression enabled. Queues with interning enabled share a single
+ * copy of identical payloads instead. */
+void payloadStore(struct rqueue_t *rqueue, payload_t *p, RedisModuleString *str);
+
+/* Same as payloadStore, but copies the payload from a plain buffer */
+void payloadStoreBuffer(struct rqueue_t *rqueue, payload_t *p, const char *buf, size_t len);
+
+/* Validates a buffer of packed payloads: one after the other, each one as a
+ * 32 bit little-endian length followed by its bytes. Returns the number of
+ * payloads, or -1 if malformed. */
+long long payloadPackedCount(const char *buf, size_t len);
+
+/* Copies a buffer of packed payloads, validated by payloadPackedCount, into a
+ * single chunk to be shared by all of them */
+payload_chunk_t *payloadPackedOpen(struct rqueue_t *rqueue, const char *buf, size_t len);
+
+/* Stores the payload at "*off" of a packed chunk as "p", and moves "off" to the
+ * next one. "p" references the chunk, unless the queue interns or compresses
+ * its payloads: then it's stored as payloadStoreBuffer would. */
+void payloadPackedNext(struct rqueue_t *rqueue, payload_chunk_t *chunk, uint32_t *off, payload_t *p);
+
+/* Releases a packed chunk once all its payloads were taken: it's freed along
+ * with the last payload referencing it */
+void payloadPackedClose(struct rqueue_t *rqueue, payload_chunk_t *chunk);
+
+/* Returns a pointer to the payload bytes, and sets "len". Not valid for
+ * compressed payloads. */
+const char *payloadPtr(const payload_t *p, size_t *len);
+
+/* Same as payloadPtr, but decompressing compressed payloads into "*tofree",
+ * which the caller must free if not NULL. Returns NULL if corrupt. */
+const char *payloadBytes(struct rqueue_t *rqueue, const payload_t *p, size_t *len, char **tofree);
+
+/* Returns the length of the payload bytes, once decompressed */
+size_t payloadSize(const payload_t *p);
+
+int payloadReply(RedisModuleCtx *ctx, struct rqueue_t *rqueue, const payload_t *p);
+void payloadSave(RedisModuleIO *rdb, struct rqueue_t *rqueue, const payload_t *p);
+void payloadLoad(RedisModuleIO *rdb, struct rqueue_t *rqueue, payload_t *p);
+
+/* Releases the payload "p", leaving it as PAYLOAD_ENC_NONE */
+void payloadRelease(struct rqueue_t *rqueue, payload_t *p);
+
+/* Copies an inline payload stored in a sparse chunk into the chunk open for
+ * appends, so the sparse one can be freed. Returns 1 if the payload was moved. */
+int payloadRelocate(struct rqueue_t *rqueue, payload_t *p);
+
+/* Hands the payload "p" over from the queue "from" to the queue "to". Payloads
+ * held on their own are moved as they are, but the ones in a payload chunk or
+ * in the payload log of "from" are copied (and released there). */
+void payloadMove(struct rqueue_t *from, struct rqueue_t *to, payload_t *p);
+
+/* Moves the payload of a delivered message to the payload log, if the queue
+ * offloads payloads of its size. Compressed payloads are written as they are.
+ * Returns 1 if the payload was moved. */
+int payloadOffload(struct rqueue_t *rqueue, payload_t *p);
+
+/* Releases the chunk currently open for appends in the given queue */
+void payloadCloseChunk(struct rqueue_t *rqueue);
+
+#endif
@@ -1,8 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include "./rqueue.h"
 #include "../rmutil/util.h"
 #include "../rmutil/strings.h"
 
+rq_config_t rq_config = {
+	.inline_threshold = PAYLOAD_INLINE_THRESHOLD,
+	.spill_dir = ".",
+	.spill_memory_ratio = 0
+};
+
+RedisModuleType *RELIABLEQ_TYPE;
+
 /* Return the UNIX time in microseconds */
 long long ustime(void) {
     struct timeval tv;
@@ -30,6 +41,325 @@ void initQueue(queue_t *queue){
 	queue->len = 0;
 	queue->first = NULL;
 	queue->last = NULL;
+	queue->spill = NULL;
+}
+
+msg_segment_t *queueInsertSegment(rqueue_t *rqueue, queue_t *queue, msg_segment_t *before){
+	msg_segment_t *seg = RedisModule_Alloc(sizeof(*seg));
+
+	seg->head = seg->tail = seg->live = 0;
+	seg->freed = 0;
+	seg->next = before;
+	seg->prev = before ? before->prev : queue->last;
+	if(seg->prev){
+		seg->prev->next = seg;
+	} else {
+		queue->first = seg;
+	}
+	if(before){
+		before->prev = seg;
+	} else {
+		queue->last = seg;
+	}
+	rqueue->memory_used += sizeof(*seg);
+
+	return seg;
+}
+
+void queueUnlinkSegment(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg){
+	if(rqueue->compact_seg == seg){
+		rqueue->compact_seg = seg->next;
+	}
+
+	if(seg->prev){
+		seg->prev->next = seg->next;
+	} else {
+		queue->first = seg->next;
+	}
+	if(seg->next){
+		seg->next->prev = seg->prev;
+	} else {
+		queue->last = seg->prev;
+	}
+
+	RedisModule_Free(seg);
+	rqueue->memory_used -= sizeof(*seg);
+}
+
+/* Stores "msg" at "pos" of "seg" */
+static void segmentSet(msg_segment_t *seg, uint32_t pos, const msg_t *msg){
+	seg->ms[pos] = msg->id.ms;
+	seg->seq[pos] = msg->id.seq;
+	seg->lastDelivery[pos] = msg->lastDelivery;
+	seg->deliveries[pos] = msg->deliveries;
+	seg->batch[pos] = msg->batch;
+	seg->extend[pos] = msg->extend;
+	seg->lease[pos] = msg->lease;
+	seg->payload[pos] = msg->payload;
+}
+
+msg_segment_t *queueAppend(rqueue_t *rqueue, queue_t *queue, const msg_t *msg){
+	msg_segment_t *seg = queue->last;
+
+	if(seg == NULL || seg->tail >= SEGMENT_SIZE){
+		seg = queueInsertSegment(rqueue, queue, NULL);
+	}
+
+	segmentSet(seg, seg->tail++, msg);
+
+	seg->live += 1;
+	queue->len += 1;
+
+	return seg;
+}
+
+msg_segment_t *queuePrepend(rqueue_t *rqueue, queue_t *queue, const msg_t *msg){
+	msg_segment_t *seg = queue->first;
+	uint32_t pos;
+
+	if(seg == NULL){
+		return queueAppend(rqueue, queue, msg);
+	}
+
+	// The slots before "head" are free: fill the new segment from its end
+	if(seg->head == 0){
+		seg = queueInsertSegment(rqueue, queue, seg);
+		seg->head = seg->tail = SEGMENT_SIZE;
+		seg->freed = ~(uint64_t) 0;
+	}
+
+	pos = --seg->head;
+	seg->freed &= ~((uint64_t) 1 << pos);
+	segmentSet(seg, pos, msg);
+
+	seg->live += 1;
+	queue->len += 1;
+
+	return seg;
+}
+
+void segmentGet(const msg_segment_t *seg, uint32_t pos, msg_t *msg){
+	msg->id.ms = seg->ms[pos];
+	msg->id.seq = seg->seq[pos];
+	msg->lastDelivery = seg->lastDelivery[pos];
+	msg->deliveries = seg->deliveries[pos];
+	msg->batch = seg->batch[pos];
+	msg->extend = seg->extend[pos];
+	msg->lease = seg->lease[pos];
+	msg->payload = seg->payload[pos];
+}
+
+/* Unlinks and frees the emptied segments at the head of the queue. Once the
+ * segments before the spilled messages are gone, the oldest spilled ones are
+ * read back. */
+static void queueReclaim(rqueue_t *rqueue, queue_t *queue){
+	msg_segment_t *seg;
+
+	while((seg = queue->first) != NULL && seg->live == 0){
+		queueUnlinkSegment(rqueue, queue, seg);
+	}
+
+	if(queue->spill && queue->first == queue->spill->next){
+		spillRestore(rqueue, queue);
+	}
+}
+
+/* Encodes a batch number as a key of the batches of a queue */
+static void batchKey(uint32_t batch, unsigned char *key){
+	for(int i = 0; i < 4; i++){
+		key[i] = (unsigned char) (batch >> (24 - (i * 8)));
+	}
+}
+
+/* Returns the members of the batch, NULL if it wasn't popped with a lease token */
+static rq_batch_members_t *batchMembers(rqueue_t *rqueue, uint32_t batch){
+	unsigned char key[4];
+
+	if(RedisModule_DictSize(rqueue->batches) == 0){
+		return NULL;
+	}
+
+	batchKey(batch, key);
+	return RedisModule_DictGetC(rqueue->batches, key, sizeof(key), NULL);
+}
+
+/* Records the message as a member of the batch, which is created with room for
+ * "hint" members if it has none yet. It only counts as live once delivered. */
+static void batchRecord(rqueue_t *rqueue, uint32_t batch, const msgid_t *id, uint32_t hint){
+	rq_batch_members_t *members = batchMembers(rqueue, batch);
+	unsigned char key[4];
+	uint32_t size;
+
+	if(members == NULL){
+		size = hint ? hint : 1;
+		members = RedisModule_Alloc(sizeof(*members) + size * sizeof(msgid_t));
+		members->live = members->count = 0;
+		members->size = size;
+		rqueue->memory_used += sizeof(*members) + size * sizeof(msgid_t);
+		batchKey(batch, key);
+		RedisModule_DictSetC(rqueue->batches, key, sizeof(key), members);
+	} else if(members->count == members->size){
+		size = members->size ? members->size * 2 : SEGMENT_SIZE;
+		rqueue->memory_used += (size - members->size) * sizeof(msgid_t);
+		members = RedisModule_Realloc(members, sizeof(*members) + size * sizeof(msgid_t));
+		members->size = size;
+		batchKey(batch, key);
+		RedisModule_DictReplaceC(rqueue->batches, key, sizeof(key), members);
+	}
+
+	members->ids[members->count++] = *id;
+}
+
+/* Counts a delivered message in as a live member of its batch */
+static void batchJoin(rqueue_t *rqueue, uint32_t batch){
+	rq_batch_members_t *members;
+
+	if(batch && (members = batchMembers(rqueue, batch)) != NULL){
+		members->live += 1;
+	}
+}
+
+/* Counts a message out of its batch, freeing the batch once none is left */
+static void batchLeave(rqueue_t *rqueue, uint32_t batch){
+	rq_batch_members_t *members;
+	unsigned char key[4];
+
+	if((members = batchMembers(rqueue, batch)) == NULL || --members->live > 0){
+		return;
+	}
+
+	batchKey(batch, key);
+	RedisModule_DictDelC(rqueue->batches, key, sizeof(key), NULL);
+	rqueue->memory_used -= sizeof(*members) + members->size * sizeof(msgid_t);
+	RedisModule_Free(members);
+}
+
+void queueRemove(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg, uint32_t pos){
+	// Leaving the delivered queue leaves the batch it was popped in
+	if(queue == &rqueue->delivered && seg->batch[pos]){
+		batchLeave(rqueue, seg->batch[pos]);
+	}
+
+	seg->freed |= (uint64_t) 1 << pos;
+	seg->live -= 1;
+	queue->len -= 1;
+
+	if(seg->live == 0){
+		if(seg == queue->first){
+			queueReclaim(rqueue, queue);
+		} else {
+			// Left in place until the head gets here, or the compactor merges it
+			compactSchedule(rqueue);
+		}
+		return;
+	}
+
+	// Keep "head" pointing to the first live slot
+	seg->head = __builtin_ctzll(~seg->freed);
+
+	// Removing from the middle leaves a hole: let the compactor merge sparse segments
+	if(pos > seg->head && seg->live <= SEGMENT_SPARSE){
+		compactSchedule(rqueue);
+	}
+}
+
+/* Moves the iterator to the next segment, or spilled record */
+static void queueIterAdvance(queue_iter_t *it){
+	spill_t *spill = it->queue->spill;
+
+	if(it->spilled){
+		if(spillCursorRead(&it->cur, it->scratch, &it->body)){
+			it->seg = it->scratch;
+			it->pos = 0;
+			return;
+		}
+		it->spilled = 0;
+		it->seg = spill->next;
+	} else {
+		it->seg = it->seg ? it->seg->next : NULL;
+		if(spill && it->seg == spill->next){
+			if(it->scratch == NULL){
+				it->scratch = RedisModule_Alloc(sizeof(*it->scratch));
+			}
+			spillCursorStart(spill, &it->cur);
+			it->spilled = 1;
+			queueIterAdvance(it);
+			return;
+		}
+	}
+
+	it->pos = it->seg ? it->seg->head : 0;
+}
+
+void queueIterStart(queue_t *queue, queue_iter_t *it){
+	it->queue = queue;
+	it->spilled = 0;
+	it->scratch = NULL;
+	it->body = NULL;
+	it->seg = queue->first;
+	it->pos = it->seg ? it->seg->head : 0;
+}
+
+void queueIterStop(queue_iter_t *it){
+	if(it->scratch){
+		RedisModule_Free(it->scratch);
+		it->scratch = NULL;
+	}
+	if(it->body){
+		RedisModule_Free(it->body);
+		it->body = NULL;
+	}
+}
+
+long long queueIterSkip(queue_iter_t *it, long long n){
+	long long skipped = 0;
+	uint32_t left, pos, count;
+
+	// Whole segments (and spilled records) first
+	while(it->seg && n > 0){
+		left = it->pos < it->seg->tail ?
+			__builtin_popcountll(segmentLiveMask(it->seg) & (~(uint64_t) 0 << it->pos)) :
+			0;
+		if(left > n){
+			break;
+		}
+		n -= left;
+		skipped += left;
+
+		while(it->spilled && n > 0 && (count = spillCursorSkip(&it->cur, n)) > 0){
+			n -= count;
+			skipped += count;
+		}
+		queueIterAdvance(it);
+	}
+
+	// Then the messages within the current one
+	while(n > 0 && queueIterNext(it, &pos)){
+		n -= 1;
+		skipped += 1;
+	}
+
+	return skipped;
+}
+
+msg_segment_t *queueIterNext(queue_iter_t *it, uint32_t *pos){
+	uint64_t live;
+
+	while(it->seg){
+		if(it->pos < it->seg->tail){
+			// Live slots at or after "pos"
+			live = segmentLiveMask(it->seg) & (~(uint64_t) 0 << it->pos);
+			if(live){
+				*pos = __builtin_ctzll(live);
+				it->pos = *pos + 1;
+				return it->seg;
+			}
+		}
+
+		queueIterAdvance(it);
+	}
+
+	return NULL;
 }
 
 /* Generate the next item ID given the previous one. If the current
@@ -42,19 +372,23 @@ void setNextMsgID(msgid_t *last_id, msgid_t *new_id) {
         new_id->ms = ms;
         new_id->seq = 1;
     } else {
-        *new_id = *last_id;
-		if (new_id->seq == UINT64_MAX) {
-			if (new_id->ms == UINT64_MAX) {
-				/* Special case where 'new_id' is the last possible streamID... */
-				new_id->ms = new_id->seq = 0;
-			} else {
-				new_id->ms++;
-				new_id->seq = 0;
-			}
+        incrMsgID(last_id, new_id);
+    }
+}
+
+void incrMsgID(const msgid_t *last_id, msgid_t *new_id) {
+	*new_id = *last_id;
+	if (new_id->seq == UINT64_MAX) {
+		if (new_id->ms == UINT64_MAX) {
+			/* Special case where 'new_id' is the last possible streamID... */
+			new_id->ms = new_id->seq = 0;
 		} else {
-			new_id->seq++;
+			new_id->ms++;
+			new_id->seq = 0;
 		}
-    }
+	} else {
+		new_id->seq++;
+	}
 }
 
 int rq_parse_pop_args(
@@ -70,6 +404,10 @@ int rq_parse_pop_args(
 	//Init pop arguments
 	pop->count = 1;
 	pop->block = 0;
+	pop->batch = 0;
+	pop->format = POP_FORMAT_FLAT;
+	pop->noack = 0;
+	pop->lease = POP_LEASE_QUEUE;
 	pop->key_count = 0;
 
 	// Parse COUNT, if provided
@@ -97,6 +435,53 @@ int rq_parse_pop_args(
 		left -= 2;
 	}
 
+	if(left >= 3 && RMUtil_StringEqualsCaseC(argv[k], "LEASE")){
+		if(RMUtil_StringEqualsCaseC(argv[k + 1], "AUTO")){
+			pop->lease = POP_LEASE_AUTO;
+		} else if(
+			RMUtil_ParseArgs(argv, argc, k + 1, "l", &temp) != REDISMODULE_OK ||
+			temp < 0 || temp > UINT32_MAX
+		){
+			return 1;
+		} else {
+			pop->lease = temp;
+		}
+		k += 2;
+		left -= 2;
+	}
+
+	if(left >= 2 && RMUtil_StringEqualsCaseC(argv[k], "NOACK")){
+		// Nothing to redeliver later on
+		if(pop->lease != POP_LEASE_QUEUE){
+			return 1;
+		}
+		pop->noack = 1;
+		k += 1;
+		left -= 1;
+	}
+
+	if(left >= 2 && RMUtil_StringEqualsCaseC(argv[k], "BATCH")){
+		// Nothing to acknowledge later on
+		if(pop->noack){
+			return 1;
+		}
+		pop->batch = 1;
+		k += 1;
+		left -= 1;
+	}
+
+	if(left >= 3 && RMUtil_StringEqualsCaseC(argv[k], "FORMAT")){
+		if(RMUtil_StringEqualsCaseC(argv[k + 1], "GROUPED")){
+			pop->format = POP_FORMAT_GROUPED;
+		} else if(RMUtil_StringEqualsCaseC(argv[k + 1], "PACKED")){
+			pop->format = POP_FORMAT_PACKED;
+		} else {
+			return 1;
+		}
+		k += 2;
+		left -= 2;
+	}
+
 	pop->key_count = argc - k;
 	pop->keys = &argv[k];
 
@@ -107,69 +492,796 @@ int rq_parse_pop_args(
  * Creates and initializes a fresh new RQUEUE object
  * @return rqueue_t * Pointer to the created object
  */
-rqueue_t *rqueueCreate(const RedisModuleString *name){
+rqueue_t *rqueueCreate(const RedisModuleString *name, int db){
 	rqueue_t *rqueue = RedisModule_Alloc(sizeof(*rqueue));
 	rqueue->name = RedisModule_CreateStringFromString(NULL, name);
 	rqueue->last_id.ms = 0;
 	rqueue->last_id.seq = 0;
+	rqueue->last_batch = 0;
 	initQueue(&rqueue->undelivered);
 	initQueue(&rqueue->delivered);
+	rqueue->pending = RedisModule_CreateDict(NULL);
+	rqueue->batches = RedisModule_CreateDict(NULL);
+	rqueue->origins = NULL;
+	rqueue->chunk = NULL;
+	rqueue->offload = NULL;
+	rqueue->leases = NULL;
+	rqueue->delayed = NULL;
+	rqueue->db = db;
+	rqueue->latency = NULL;
+	rqueue->lease_auto = 0;
+	rqueue->lease_auto_at = 0;
 	rqueue->memory_used = sizeof(*rqueue);
+	settingsInit(&rqueue->settings);
+	memset(&rqueue->stats, 0, sizeof(rqueue->stats));
+	rqueue->compact_prev = rqueue->compact_next = NULL;
+	rqueue->compact_queue = NULL;
+	rqueue->compact_seg = NULL;
+	rqueue->compact_undelivered = 0;
 	
 	return rqueue;
 }
 
+void msgIdToKey(const msgid_t *id, unsigned char *key){
+	for(int i = 0; i < 8; i++){
+		key[i] = (unsigned char) (id->ms >> (56 - (i * 8)));
+		key[8 + i] = (unsigned char) (id->seq >> (56 - (i * 8)));
+	}
+}
+
+void replyWithMsgId(RedisModuleCtx *ctx, uint64_t ms, uint64_t seq){
+	char buf[48];
+	int len = snprintf(buf, sizeof(buf), MSG_ID_FORMAT, ms, seq);
+
+	// No need for a string object just to reply
+	RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+}
+
+void rq_index_add(rqueue_t *rqueue, const msgid_t *id, msg_segment_t *seg){
+	unsigned char key[MSG_ID_KEY_LEN];
+
+	msgIdToKey(id, key);
+	RedisModule_DictReplaceC(rqueue->pending, key, sizeof(key), seg);
+}
+
+msg_segment_t *rq_index_find(rqueue_t *rqueue, const msgid_t *id){
+	unsigned char key[MSG_ID_KEY_LEN];
+
+	msgIdToKey(id, key);
+	return RedisModule_DictGetC(rqueue->pending, key, sizeof(key), NULL);
+}
+
+void rq_index_del(rqueue_t *rqueue, const msgid_t *id){
+	unsigned char key[MSG_ID_KEY_LEN];
+
+	msgIdToKey(id, key);
+	RedisModule_DictDelC(rqueue->pending, key, sizeof(key), NULL);
+}
+
+/* Records "origin" as the origin of the message "id" */
+static void rq_origin_add(rqueue_t *rqueue, const msgid_t *id, rq_origin_t *origin){
+	unsigned char key[MSG_ID_KEY_LEN];
+
+	if(rqueue->origins == NULL){
+		rqueue->origins = RedisModule_CreateDict(NULL);
+	}
+	msgIdToKey(id, key);
+	RedisModule_DictReplaceC(rqueue->origins, key, sizeof(key), origin);
+	rqueue->memory_used += sizeof(*origin) + origin->len + 1;
+}
+
+static rq_origin_t *rq_origin_create(const msgid_t *id, const char *queue, size_t len){
+	rq_origin_t *origin = RedisModule_Alloc(sizeof(*origin) + len + 1);
+
+	origin->id = *id;
+	origin->len = len;
+	memcpy(origin->queue, queue, len);
+	origin->queue[len] = '\0';
+
+	return origin;
+}
+
+const rq_origin_t *rq_origin_find(rqueue_t *rqueue, const msgid_t *id){
+	unsigned char key[MSG_ID_KEY_LEN];
+
+	if(rqueue->origins == NULL){
+		return NULL;
+	}
+	msgIdToKey(id, key);
+	return RedisModule_DictGetC(rqueue->origins, key, sizeof(key), NULL);
+}
+
+/* Takes the origin of the message "id" out of the queue, if any: the message
+ * is leaving it */
+static rq_origin_t *rq_origin_take(rqueue_t *rqueue, const msgid_t *id){
+	unsigned char key[MSG_ID_KEY_LEN];
+	rq_origin_t *origin = NULL;
+
+	if(rqueue->origins == NULL){
+		return NULL;
+	}
+	msgIdToKey(id, key);
+	if(RedisModule_DictDelC(rqueue->origins, key, sizeof(key), &origin) == REDISMODULE_OK){
+		rqueue->memory_used -= sizeof(*origin) + origin->len + 1;
+	}
+
+	return origin;
+}
+
+/* Forgets the origin of the message "id", once it's gone for good */
+static void rq_origin_forget(rqueue_t *rqueue, const msgid_t *id){
+	rq_origin_t *origin = rq_origin_take(rqueue, id);
+
+	if(origin){
+		RedisModule_Free(origin);
+	}
+}
+
+int segmentFind(const msg_segment_t *seg, const msgid_t *id){
+	uint64_t found = scanMatchId(seg->ms, seg->seq, seg->tail, id->ms, id->seq) & ~seg->freed;
+
+	return found ? __builtin_ctzll(found) : -1;
+}
+
+/* Returns a bitmap of the live slots of the delivered "seg" holding messages
+ * recovered later than "from" */
+static uint64_t segmentDueAfter(const msg_segment_t *seg, mstime_t from){
+	uint64_t live = segmentLiveMask(seg), after = 0;
+
+	for(; live; live &= live - 1){
+		if(segmentRecoverFrom(seg, __builtin_ctzll(live)) > from){
+			after |= live & -live;
+		}
+	}
+
+	return after;
+}
+
+/* Inserts "msg" into the delivered queue, before the messages recovered later
+ * than it. Those are at the tail, touched with EXTEND: the segment they start
+ * in is split there, moving them to a segment of their own. */
+static msg_segment_t *deliveredInsert(rqueue_t *rqueue, const msg_t *msg){
+	queue_t *queue = &rqueue->delivered;
+	mstime_t from = msg->lastDelivery + msg->extend;
+	msg_segment_t *seg, *rest;
+	uint64_t live, after = 0;
+	uint32_t pos;
+	msg_t moved;
+
+	// Most of the time, it just goes after the last one
+	seg = queue->last;
+	if(seg == NULL || ((live = segmentLiveMask(seg)) && segmentRecoverFrom(seg, 63 - __builtin_clzll(live)) <= from)){
+		return queueAppend(rqueue, queue, msg);
+	}
+
+	// Look for the last segment holding a message recovered no later than it
+	for(; seg; seg = seg->prev){
+		live = segmentLiveMask(seg);
+		if(live && (after = segmentDueAfter(seg, from)) != live){
+			break;
+		}
+	}
+
+	if(seg == NULL){
+		return queuePrepend(rqueue, queue, msg);
+	}
+
+	// Right after its last message recovered no later: the later ones move out
+	pos = 64 - __builtin_clzll(live & ~after);
+	if(after){
+		rest = queueInsertSegment(rqueue, queue, seg->next);
+		seg->freed |= after;
+		for(; after; after &= after - 1){
+			segmentGet(seg, __builtin_ctzll(after), &moved);
+			segmentSet(rest, rest->tail++, &moved);
+			rq_index_add(rqueue, &moved.id, rest);
+			rest->live += 1;
+			seg->live -= 1;
+		}
+	}
+	if(pos == SEGMENT_SIZE){
+		seg = queueInsertSegment(rqueue, queue, seg->next);
+		pos = 0;
+	}
+
+	seg->tail = pos + 1;
+	seg->freed &= ((uint64_t) 1 << pos) - 1;
+	segmentSet(seg, pos, msg);
+	seg->head = __builtin_ctzll(~seg->freed);
+	seg->live += 1;
+	queue->len += 1;
+
+	return seg;
+}
+
+msg_segment_t *rq_deliver(rqueue_t *rqueue, const msg_t *msg){
+	msg_segment_t *seg = deliveredInsert(rqueue, msg);
+
+	rq_index_add(rqueue, &msg->id, seg);
+	batchJoin(rqueue, msg->batch);
+
+	return seg;
+}
+
+/* Adds the time the acknowledged message at "pos" was being processed for,
+ * since it was popped (or touched last, as its lease goes from there), to the
+ * latencies of the queue */
+static void rq_sample_latency(rqueue_t *rqueue, const msg_segment_t *seg, uint32_t pos, mstime_t now){
+	if(rqueue->latency == NULL){
+		rqueue->latency = RedisModule_Calloc(1, sizeof(*rqueue->latency));
+		rqueue->memory_used += sizeof(*rqueue->latency);
+	}
+
+	sketchAdd(rqueue->latency, now > seg->lastDelivery[pos] ? now - seg->lastDelivery[pos] : 0);
+}
+
+/* Exponential backoff of a message delivered "deliveries" times */
+static uint64_t rq_backoff(const rq_settings_t *settings, uint32_t deliveries){
+	uint64_t delay = settings->backoff;
+
+	for(uint32_t i = 1; i < deliveries && delay && delay < settings->backoff_max; i++){
+		delay *= 2;
+	}
+
+	return delay < settings->backoff_max ? delay : settings->backoff_max;
+}
+
+int rq_nack(RedisModuleCtx *ctx, rqueue_t *rqueue, const msgid_t *id, mstime_t now, int64_t delay, lease_t **delayed){
+	msg_segment_t *seg = rq_index_find(rqueue, id);
+	mstime_t due;
+	int pos;
+
+	if(seg == NULL || (pos = segmentFind(seg, id)) < 0){
+		return 0;
+	}
+
+	if(rq_deadletter(ctx, rqueue, seg, pos)){
+		return NACK_DEADLETTERED;
+	}
+
+	rqueue->stats.nacked += 1;
+
+	if(delay == NACK_BACKOFF){
+		delay = rq_backoff(&rqueue->settings, seg->deliveries[pos]);
+	}
+	if(delay == 0){
+		rq_requeue(rqueue, seg, pos);
+		return 1;
+	}
+
+	due = now + delay;
+	if(*delayed && (*delayed)->expires != due){
+		leaseSchedule(*delayed);
+		*delayed = NULL;
+	}
+	if(*delayed == NULL){
+		*delayed = delayCreate(rqueue, 1, due);
+	}
+	*delayed = delayPush(*delayed, id->ms, id->seq, &seg->payload[pos], seg->deliveries[pos]);
+
+	// Its payload moved along
+	rq_index_del(rqueue, id);
+	queueRemove(rqueue, &rqueue->delivered, seg, pos);
+
+	return 1;
+}
+
+int rq_nack_immediate(const rqueue_t *rqueue, int64_t delay){
+	// The backoff only grows with the deliveries, from the first one
+	return delay == 0 || (delay == NACK_BACKOFF && rq_backoff(&rqueue->settings, 1) == 0);
+}
+
+uint32_t rq_lease(rqueue_t *rqueue, int64_t lease){
+	const rq_settings_t *settings = &rqueue->settings;
+	const sketch_t *latency = rqueue->latency;
+	uint64_t estimate;
+
+	if(lease == POP_LEASE_QUEUE && !settings->lease_auto){
+		return settings->lease;
+	}
+	if(lease >= 0){
+		return lease;
+	}
+
+	// Not enough to learn from yet
+	if(latency == NULL || latency->samples < LEASE_AUTO_SAMPLES){
+		return LEASE_AUTO_INITIAL;
+	}
+
+	if(rqueue->lease_auto == 0 || latency->samples - rqueue->lease_auto_at >= LEASE_AUTO_REFRESH){
+		estimate = sketchQuantile(latency, settings->lease_percentile / 100) * settings->lease_factor;
+		rqueue->lease_auto = estimate > UINT32_MAX ? UINT32_MAX : (estimate ? estimate : 1);
+		rqueue->lease_auto_at = latency->samples;
+	}
+
+	return rqueue->lease_auto;
+}
+
+int rq_ack(rqueue_t *rqueue, const msgid_t *id){
+	msg_segment_t *seg = rq_index_find(rqueue, id);
+	int pos;
+
+	if(seg == NULL || (pos = segmentFind(seg, id)) < 0){
+		return 0;
+	}
+
+	rq_sample_latency(rqueue, seg, pos, mstime());
+	rq_index_del(rqueue, id);
+	rq_origin_forget(rqueue, id);
+	payloadRelease(rqueue, &seg->payload[pos]);
+
+	queueRemove(rqueue, &rqueue->delivered, seg, pos);
+
+	return 1;
+}
+
+int rq_touch(rqueue_t *rqueue, const msgid_t *id, mstime_t now, uint32_t extend){
+	msg_segment_t *seg = rq_index_find(rqueue, id);
+	mstime_t deadline;
+	lease_t *lease;
+	msg_t msg;
+	int pos;
+
+	if(seg == NULL || (pos = segmentFind(seg, id)) < 0){
+		return 0;
+	}
+
+	segmentGet(seg, pos, &msg);
+	deadline = segmentDeadline(seg, pos);
+	msg.lastDelivery = now;
+	msg.extend = extend;
+
+	// Its lease is scheduled to expire later on: it gets scheduled again from
+	// there. Only an earlier deadline needs a lease of its own.
+	if(msg.lease && now + msg.lease + extend < deadline){
+		lease = leaseCreate(rqueue, 1, now + msg.lease + extend);
+		leaseSchedule(leasePush(lease, msg.id.ms, msg.id.seq));
+	}
+
+	// Out of its slot first, as it may go back before it: its batch is held
+	// meanwhile, so leaving it doesn't free it
+	batchJoin(rqueue, msg.batch);
+	queueRemove(rqueue, &rqueue->delivered, seg, pos);
+	rq_deliver(rqueue, &msg);
+	batchLeave(rqueue, msg.batch);
+
+	return 1;
+}
+
+/* Whether "keyname" of the database selected in "ctx" holds "rqueue" */
+static int rq_holds(RedisModuleCtx *ctx, RedisModuleString *keyname, rqueue_t *rqueue){
+	RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+	int holds = RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE && RedisModule_ModuleTypeGetValue(key) == rqueue;
+
+	RedisModule_CloseKey(key);
+
+	return holds;
+}
+
+int rq_select(RedisModuleCtx *ctx, rqueue_t *rqueue){
+	if(RedisModule_SelectDb(ctx, rqueue->db) == REDISMODULE_OK && rq_holds(ctx, rqueue->name, rqueue)){
+		return 1;
+	}
+
+	// Until the first database that doesn't exist
+	for(int db = 0; RedisModule_SelectDb(ctx, db) == REDISMODULE_OK; db++){
+		if(db != rqueue->db && rq_holds(ctx, rqueue->name, rqueue)){
+			rqueue->db = db;
+			return 1;
+		}
+	}
+
+	RedisModule_SelectDb(ctx, rqueue->db);
+
+	return 0;
+}
+
+/* CRC16 (XMODEM) of "len" bytes at "buf", as hashed into slots by Redis Cluster */
+static uint16_t crc16(const char *buf, size_t len){
+	uint16_t crc = 0;
+
+	for(size_t i = 0; i < len; i++){
+		crc ^= (uint16_t) ((unsigned char) buf[i]) << 8;
+		for(int bit = 0; bit < 8; bit++){
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+/* Hash slot of a key in Redis Cluster, hash tags included */
+static uint16_t keySlot(const char *key, size_t len){
+	size_t start, end;
+
+	for(start = 0; start < len && key[start] != '{'; start++);
+	if(start < len){
+		for(end = start + 1; end < len && key[end] != '}'; end++);
+		if(end < len && end > start + 1){
+			return crc16(key + start + 1, end - start - 1) & 16383;
+		}
+	}
+
+	return crc16(key, len) & 16383;
+}
+
+int rq_same_slot(RedisModuleCtx *ctx, RedisModuleString *keyname, const char *name){
+	size_t len;
+	const char *key;
+
+	if(!(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER)){
+		return 1;
+	}
+
+	key = RedisModule_StringPtrLen(keyname, &len);
+
+	return keySlot(key, len) == keySlot(name, strlen(name));
+}
+
+rqueue_t *rq_deadletter_queue(RedisModuleCtx *ctx, rqueue_t *rqueue){
+	const char *name = rqueue->settings.deadletter;
+	RedisModuleString *keyname;
+	RedisModuleKey *key;
+	rqueue_t *dead = NULL;
+
+	if(name[0] == '\0' || !rq_same_slot(ctx, rqueue->name, name)){
+		return NULL;
+	}
+
+	keyname = RedisModule_CreateString(NULL, name, strlen(name));
+	key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ|REDISMODULE_WRITE);
+	if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+		dead = rqueueCreate(keyname, RedisModule_GetSelectedDb(ctx));
+		RedisModule_ModuleTypeSetValue(key, RELIABLEQ_TYPE, dead);
+	} else if(RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE){
+		dead = RedisModule_ModuleTypeGetValue(key);
+	}
+	RedisModule_CloseKey(key);
+	RedisModule_FreeString(NULL, keyname);
+
+	return dead == rqueue ? NULL : dead;
+}
+
+int rq_deadletter_ready(RedisModuleCtx *ctx, rqueue_t *rqueue){
+	const char *name = rqueue->settings.deadletter;
+	RedisModuleString *keyname;
+	RedisModuleKey *key;
+	int ready;
+
+	if(name[0] == '\0' || !rq_same_slot(ctx, rqueue->name, name)){
+		return 0;
+	}
+
+	keyname = RedisModule_CreateString(NULL, name, strlen(name));
+	key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+	ready = RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY || (
+		RedisModule_ModuleTypeGetType(key) == RELIABLEQ_TYPE &&
+		RedisModule_ModuleTypeGetValue(key) != rqueue
+	);
+	RedisModule_CloseKey(key);
+	RedisModule_FreeString(NULL, keyname);
+
+	return ready;
+}
+
+/* Whether the delivered message at "pos" of "seg" is past MAXDELIVERIES */
+static int rq_deadletter_due(const rqueue_t *rqueue, const msg_segment_t *seg, uint32_t pos){
+	uint32_t max = rqueue->settings.max_deliveries;
+
+	return max && seg->deliveries[pos] >= max;
+}
+
+int rq_deadletter(RedisModuleCtx *ctx, rqueue_t *rqueue, msg_segment_t *seg, uint32_t pos){
+	rq_origin_t *origin;
+	rqueue_t *dead;
+	msgid_t from;
+	size_t len;
+	msg_t msg;
+
+	if(!rq_deadletter_due(rqueue, seg, pos)){
+		return 0;
+	}
+	if((dead = rq_deadletter_queue(ctx, rqueue)) == NULL){
+		// Its DEADLETTER key holds something else
+		if(rqueue->settings.deadletter[0] != '\0'){
+			rqueue->stats.deadletter_errors += 1;
+		}
+		return 0;
+	}
+
+	segmentGet(seg, pos, &msg);
+	from = msg.id;
+	origin = rq_origin_take(rqueue, &from);
+	rq_index_del(rqueue, &msg.id);
+	queueRemove(rqueue, &rqueue->delivered, seg, pos);
+
+	// A new ID in the dead-letter queue, where the one it had may be taken
+	payloadMove(rqueue, dead, &msg.payload);
+	setNextMsgID(&dead->last_id, &msg.id);
+	dead->last_id = msg.id;
+	msg.lastDelivery = 0;
+	msg.batch = 0;
+	msg.extend = 0;
+	msg.lease = 0;
+	queueAppend(dead, &dead->undelivered, &msg);
+
+	// A dead letter of a dead letter keeps where it came from in the first place
+	if(origin == NULL){
+		const char *queue = RedisModule_StringPtrLen(rqueue->name, &len);
+		origin = rq_origin_create(&from, queue, len);
+	}
+	rq_origin_add(dead, &msg.id, origin);
+
+	rqueue->stats.deadlettered += 1;
+	RedisModule_SignalKeyAsReady(ctx, dead->name);
+
+	return 1;
+}
+
+void rq_requeue(rqueue_t *rqueue, msg_segment_t *seg, uint32_t pos){
+	msg_t msg;
+
+	segmentGet(seg, pos, &msg);
+	msg.batch = 0;
+	msg.extend = 0;
+	msg.lease = 0;
+
+	rq_index_del(rqueue, &msg.id);
+	queueRemove(rqueue, &rqueue->delivered, seg, pos);
+	queuePrepend(rqueue, &rqueue->undelivered, &msg);
+}
+
+long long rq_ack_range(rqueue_t *rqueue, const msgid_t *start, const msgid_t *end){
+	queue_t *queue = &rqueue->delivered;
+	msg_segment_t *seg, *next;
+	mstime_t now = mstime();
+	long long removed = 0;
+	uint64_t found;
+	uint32_t pos;
+	msgid_t id;
+	int reclaimed;
+
+	for(seg = queue->first; seg; seg = next){
+		found = scanIdRange(seg->ms, seg->seq, seg->tail, start->ms, start->seq, end->ms, end->seq);
+		found &= segmentLiveMask(seg);
+		if(found == 0){
+			next = seg->next;
+			continue;
+		}
+
+		// Emptying the first segment frees it, along with any emptied ones after it
+		reclaimed = (seg == queue->first && (uint32_t) __builtin_popcountll(found) == seg->live);
+
+		while(found){
+			pos = __builtin_ctzll(found);
+			found &= found - 1;
+			id.ms = seg->ms[pos];
+			id.seq = seg->seq[pos];
+			rq_sample_latency(rqueue, seg, pos, now);
+			rq_index_del(rqueue, &id);
+			rq_origin_forget(rqueue, &id);
+			payloadRelease(rqueue, &seg->payload[pos]);
+			queueRemove(rqueue, queue, seg, pos);
+			removed += 1;
+		}
+
+		next = reclaimed ? queue->first : seg->next;
+	}
+
+	return removed;
+}
+
+static int msgIdLess(const msgid_t *a, const msgid_t *b){
+	return a->ms < b->ms || (a->ms == b->ms && a->seq < b->seq);
+}
+
+void msgIdFromKey(const unsigned char *key, msgid_t *id){
+	id->ms = id->seq = 0;
+	for(int i = 0; i < 8; i++){
+		id->ms = (id->ms << 8) | key[i];
+		id->seq = (id->seq << 8) | key[8 + i];
+	}
+}
+
+static int msgIdCompare(const void *a, const void *b){
+	return msgIdLess(a, b) ? -1 : msgIdLess(b, a);
+}
+
+long long rq_ack_batch(rqueue_t *rqueue, const rq_batch_t *batch, const msgid_t *except, int except_count){
+	rq_batch_members_t *members = batchMembers(rqueue, batch->id);
+	msgid_t *excluded = NULL;
+	msg_segment_t *seg;
+	mstime_t now = mstime();
+	long long removed = 0;
+	int pos;
+
+	if(members == NULL){
+		return 0;
+	}
+
+	// The token must stand for the very batch recorded under its number
+	msgid_t first = members->ids[0], last = members->ids[0];
+	for(uint32_t i = 1; i < members->count; i++){
+		if(msgIdLess(&members->ids[i], &first)){
+			first = members->ids[i];
+		} else if(msgIdLess(&last, &members->ids[i])){
+			last = members->ids[i];
+		}
+	}
+	if(msgIdCompare(&first, &batch->first) || msgIdCompare(&last, &batch->last)){
+		return -1;
+	}
+
+	// Sorted, to be looked up by bisection
+	if(except_count){
+		excluded = RedisModule_Alloc(except_count * sizeof(*excluded));
+		memcpy(excluded, except, except_count * sizeof(*excluded));
+		qsort(excluded, except_count, sizeof(*excluded), msgIdCompare);
+	}
+
+	// Held, so removing its last members doesn't free it on the way
+	members->live += 1;
+	for(uint32_t i = 0; i < members->count; i++){
+		const msgid_t *id = &members->ids[i];
+		if(
+			(seg = rq_index_find(rqueue, id)) == NULL ||
+			(pos = segmentFind(seg, id)) < 0 ||
+			seg->batch[pos] != batch->id ||
+			(excluded && bsearch(id, excluded, except_count, sizeof(*excluded), msgIdCompare))
+		){
+			continue;
+		}
+
+		rq_sample_latency(rqueue, seg, pos, now);
+		rq_index_del(rqueue, id);
+		rq_origin_forget(rqueue, id);
+		payloadRelease(rqueue, &seg->payload[pos]);
+		queueRemove(rqueue, &rqueue->delivered, seg, pos);
+		removed += 1;
+	}
+	batchLeave(rqueue, batch->id);
+
+	if(excluded){
+		RedisModule_Free(excluded);
+	}
+
+	return removed;
+}
+
 /**
  * @return int The items actually poped
  */
 long long popAndReply(
 	RedisModuleCtx *ctx,
 	rqueue_t *rqueue,
-	long long *count
+	long long *count,
+	rq_batch_t *batch,
+	const rq_pop_t *pop
 )
 {
-	if(*count <= 0 || rqueue->undelivered.len == 0 || rqueue->undelivered.first == NULL){
+	if(*count <= 0 || rqueue->undelivered.len == 0){
 		return 0;
 	}
 
-	msg_t *topop = rqueue->undelivered.first,
-		*next;
-
+	msg_segment_t *seg, *into, *offload_from = NULL;
+	msg_t topop;
+	int format = pop->format;
+	mstime_t now = pop->noack ? 0 : mstime();
+	uint32_t lease = pop->noack ? 0 : rq_lease(rqueue, pop->lease);
+	lease_t *leased = NULL;
     long long actually_poped = 0;
+	long long max = *count < (long long) rqueue->undelivered.len ? *count : (long long) rqueue->undelivered.len;
+	unsigned char *ids = NULL;
+	payload_t *payloads = NULL;
 
-	while (*count > 0 && topop != NULL)
-	{
-		next = topop->next;
-		topop->lastDelivery = mstime();
-		topop->deliveries += 1;
+	if(format == POP_FORMAT_GROUPED){
+		// The queue name once, then ID and payload pairs
+		RedisModule_ReplyWithArray(ctx, 2);
+		RedisModule_ReplyWithString(ctx, rqueue->name);
+		RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+	} else if(format == POP_FORMAT_PACKED){
+		// The ID's go first in the reply: collect everything before replying
+		ids = RedisModule_Alloc(max * MSG_ID_KEY_LEN);
+		payloads = RedisModule_Alloc(max * sizeof(*payloads));
+	}
+
+	// Numbers are unique in the queue, 0 meaning no batch
+	if(pop->noack){
+		batch->id = 0;
+		lease = 0;
+	} else {
+		if(++rqueue->last_batch == 0){
+			rqueue->last_batch = 1;
+		}
+		batch->id = rqueue->last_batch;
+	}
+
+	// Messages popped at once expire at once: a single lease for all of them
+	if(lease){
+		leased = leaseCreate(rqueue, max, now + lease);
+	}
 
-		// Update "undelivered" queue
-		rqueue->undelivered.first = topop->next;
-		rqueue->undelivered.len -= 1;
+	while (actually_poped < max && (seg = rqueue->undelivered.first) != NULL)
+	{
+		segmentGet(seg, seg->head, &topop);
 
-		// Update "delivered" queue
-		if(rqueue->delivered.first == NULL || rqueue->delivered.last == NULL){
-			rqueue->delivered.first = rqueue->delivered.last = topop;
+		if(pop->noack){
+			// At-most-once: the message is gone as soon as it's replied
+			rq_origin_forget(rqueue, &topop.id);
+			queueRemove(rqueue, &rqueue->undelivered, seg, seg->head);
 		} else {
-			((msg_t *)rqueue->delivered.last)->next = topop;
-			rqueue->delivered.last = topop;
+			topop.lastDelivery = now;
+			topop.deliveries += 1;
+			topop.batch = batch->id;
+			topop.extend = 0;
+			topop.lease = lease;
+			if(leased){
+				leased = leasePush(leased, topop.id.ms, topop.id.seq);
+			}
+			if(pop->batch){
+				batchRecord(rqueue, batch->id, &topop.id, max);
+			}
+			if(actually_poped == 0 || msgIdLess(&topop.id, &batch->first)){
+				batch->first = topop.id;
+			}
+			if(actually_poped == 0 || msgIdLess(&batch->last, &topop.id)){
+				batch->last = topop.id;
+			}
+
+			// Move the message into the "delivered" queue
+			into = rq_deliver(rqueue, &topop);
+			if(offload_from == NULL){
+				offload_from = into;
+			}
+			queueRemove(rqueue, &rqueue->undelivered, seg, seg->head);
 		}
-		rqueue->delivered.len += 1;
-		topop->next = NULL;
 
-		// Finally: reply with a 2-element-array with: MsgID and the payload
-		RedisModule_ReplyWithArray(ctx, 3);
-		RedisModule_ReplyWithString(ctx, rqueue->name);
-		RedisModule_ReplyWithString(
-			ctx,
-			RedisModule_CreateStringPrintf(ctx, MSG_ID_FORMAT, topop->id.ms, topop->id.seq)
-		);
-		RedisModule_ReplyWithString(ctx, topop->value);
+		// Finally: reply with a 3-element-array with: queue, MsgID and the payload
+		if(format == POP_FORMAT_PACKED){
+			msgIdToKey(&topop.id, ids + actually_poped * MSG_ID_KEY_LEN);
+			payloads[actually_poped] = topop.payload;
+		} else {
+			if(format == POP_FORMAT_FLAT){
+				RedisModule_ReplyWithArray(ctx, 3);
+				RedisModule_ReplyWithString(ctx, rqueue->name);
+			}
+			replyWithMsgId(ctx, topop.id.ms, topop.id.seq);
+			payloadReply(ctx, rqueue, &topop.payload);
+			if(pop->noack){
+				payloadRelease(rqueue, &topop.payload);
+			}
+		}
 
 		// Move-on to the next element to pop
 		*count = *count - 1;
 		actually_poped += 1;
-		topop = next;
+	}
+
+	if(leased){
+		leaseSchedule(leased);
+	}
+
+	// Most payloads are never read again once delivered: they're offloaded
+	// by the compaction timer, off the reply path
+	if(offload_from && rqueue->settings.offload){
+		compactScheduleOffload(rqueue, offload_from);
+	}
+
+	if(format == POP_FORMAT_GROUPED){
+		RedisModule_ReplySetArrayLength(ctx, actually_poped * 2);
+	} else if(format == POP_FORMAT_PACKED){
+		RedisModule_ReplyWithArray(ctx, 3);
+		RedisModule_ReplyWithString(ctx, rqueue->name);
+		RedisModule_ReplyWithStringBuffer(ctx, (const char *) ids, actually_poped * MSG_ID_KEY_LEN);
+		RedisModule_ReplyWithArray(ctx, actually_poped);
+		for(long long i = 0; i < actually_poped; i++){
+			payloadReply(ctx, rqueue, &payloads[i]);
+			if(pop->noack){
+				payloadRelease(rqueue, &payloads[i]);
+			}
+		}
+		RedisModule_Free(ids);
+		RedisModule_Free(payloads);
 	}
 
 	return actually_poped;
@@ -179,141 +1291,263 @@ long long popAndReply(
 
 void RQueueRdbSave(RedisModuleIO *rdb, void *value) {
     rqueue_t *rqueue = value;
-    msg_t *node; // = r;
+    msg_segment_t *seg;
+    uint32_t pos;
+    queue_iter_t it;
+    RedisModuleDictIter *iter;
+    unsigned char *key;
+
+    char setting[SETTINGS_VALUE_MAX];
 
+	// Settings first, so loaded payloads get stored according to them
+	RedisModule_SaveUnsigned(rdb, settingsCount());
+	for(int i = 0; i < settingsCount(); i++){
+		settingsFormat(&rqueue->settings, i, setting, sizeof(setting));
+		RedisModule_SaveStringBuffer(rdb, settingsName(i), strlen(settingsName(i)));
+		RedisModule_SaveStringBuffer(rdb, setting, strlen(setting));
+	}
+
+    RedisModule_SaveUnsigned(rdb, rqueue->last_batch);
+
+	// Batches with a lease token: their members are the delivered messages tagged with them
+	RedisModule_SaveUnsigned(rdb, RedisModule_DictSize(rqueue->batches));
+	iter = RedisModule_DictIteratorStartC(rqueue->batches, "^", NULL, 0);
+	while((key = RedisModule_DictNextC(iter, NULL, NULL)) != NULL){
+		RedisModule_SaveUnsigned(rdb, ((uint32_t) key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3]);
+	}
+	RedisModule_DictIteratorStop(iter);
+
+	// The latencies AUTO leases are learned from
+	RedisModule_SaveUnsigned(rdb, rqueue->latency ? SKETCH_BUCKETS : 0);
+	for(uint32_t i = 0; rqueue->latency && i < SKETCH_BUCKETS; i++){
+		RedisModule_SaveUnsigned(rdb, rqueue->latency->counts[i]);
+	}
     RedisModule_SaveUnsigned(rdb, rqueue->undelivered.len);
 	RedisModule_SaveUnsigned(rdb, rqueue->delivered.len);
 	
 	// First: persist undelivered list
-	node = rqueue->undelivered.first;
-    while(node) {
-        RedisModule_SaveUnsigned(rdb,node->id.ms);
-        RedisModule_SaveUnsigned(rdb,node->id.seq);
-		RedisModule_SaveString(rdb, node->value);
-        node = node->next;
+	queueIterStart(&rqueue->undelivered, &it);
+    while((seg = queueIterNext(&it, &pos))) {
+        RedisModule_SaveUnsigned(rdb,seg->ms[pos]);
+        RedisModule_SaveUnsigned(rdb,seg->seq[pos]);
+		payloadSave(rdb, rqueue, &seg->payload[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->deliveries[pos]);
     }
+	queueIterStop(&it);
 
 	// Second: persist delivered elements
-	node = rqueue->delivered.first;
-    while(node) {
-        RedisModule_SaveUnsigned(rdb,node->id.ms);
-        RedisModule_SaveUnsigned(rdb,node->id.seq);
-		RedisModule_SaveString(rdb, node->value);
-		RedisModule_SaveUnsigned(rdb,node->deliveries);
-		RedisModule_SaveUnsigned(rdb,node->lastDelivery);
-        node = node->next;
+	queueIterStart(&rqueue->delivered, &it);
+    while((seg = queueIterNext(&it, &pos))) {
+        RedisModule_SaveUnsigned(rdb,seg->ms[pos]);
+        RedisModule_SaveUnsigned(rdb,seg->seq[pos]);
+		payloadSave(rdb, rqueue, &seg->payload[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->deliveries[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->lastDelivery[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->batch[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->extend[pos]);
+		RedisModule_SaveUnsigned(rdb,seg->lease[pos]);
     }
+	queueIterStop(&it);
+
+	// Last: delayed messages, along with the time they're due at
+	uint64_t delays = 0;
+	for(lease_t *delayed = rqueue->delayed; delayed; delayed = delayed->qnext){
+		delays += 1;
+	}
+	RedisModule_SaveUnsigned(rdb, delays);
+	for(lease_t *delayed = rqueue->delayed; delayed; delayed = delayed->qnext){
+		RedisModule_SaveUnsigned(rdb, delayed->expires);
+		RedisModule_SaveUnsigned(rdb, delayed->count);
+		for(uint32_t i = 0; i < delayed->count; i++){
+			RedisModule_SaveUnsigned(rdb, delayed->ids[2 * i]);
+			RedisModule_SaveUnsigned(rdb, delayed->ids[2 * i + 1]);
+			payloadSave(rdb, rqueue, &delayed->payloads[i]);
+			RedisModule_SaveUnsigned(rdb, delayed->deliveries[i]);
+		}
+	}
+
+	// Where its dead letters come from
+	RedisModule_SaveUnsigned(rdb, rqueue->origins ? RedisModule_DictSize(rqueue->origins) : 0);
+	if(rqueue->origins){
+		rq_origin_t *origin;
+		msgid_t id;
+		iter = RedisModule_DictIteratorStartC(rqueue->origins, "^", NULL, 0);
+		while((key = RedisModule_DictNextC(iter, NULL, (void **) &origin)) != NULL){
+			msgIdFromKey(key, &id);
+			RedisModule_SaveUnsigned(rdb, id.ms);
+			RedisModule_SaveUnsigned(rdb, id.seq);
+			RedisModule_SaveUnsigned(rdb, origin->id.ms);
+			RedisModule_SaveUnsigned(rdb, origin->id.seq);
+			RedisModule_SaveStringBuffer(rdb, origin->queue, origin->len);
+		}
+		RedisModule_DictIteratorStop(iter);
+	}
+}
+
+/* Loads a string into "buf" as a C string, truncating it if needed */
+static void rdbLoadCString(RedisModuleIO *rdb, char *buf, size_t size){
+	size_t len;
+	char *loaded = RedisModule_LoadStringBuffer(rdb, &len);
+
+	if(len > size - 1){
+		len = size - 1;
+	}
+	memcpy(buf, loaded, len);
+	buf[len] = '\0';
+	RedisModule_Free(loaded);
 }
 
 void *rq_rdb_load(RedisModuleIO *rdb, int encver) {
-    if (encver != RQUEUE_ENCODING_VERSION) {
+    if (encver > RQUEUE_ENCODING_VERSION) {
         RedisModule_Log(NULL, "warning", "Can't load data with version %d. Current supported version: %d",
 			encver, RQUEUE_ENCODING_VERSION);
         return NULL;
     }
 
-	rqueue_t *rqueue = rqueueCreate(RedisModule_GetKeyNameFromIO(rdb));
-    rqueue->undelivered.len = RedisModule_LoadUnsigned(rdb);
-    rqueue->delivered.len  = RedisModule_LoadUnsigned(rdb);
-	uint64_t total_messages = rqueue->undelivered.len + rqueue->delivered.len;
+	// The database isn't known from here: the "loaded" event tells it afterwards
+	rqueue_t *rqueue = rqueueCreate(RedisModule_GetKeyNameFromIO(rdb), 0);
 
-	if(total_messages == 0){
-		return rqueue;
+	// Version 0 had no settings
+	if(encver >= 1){
+		uint64_t settings = RedisModule_LoadUnsigned(rdb);
+		char name[64], value[SETTINGS_VALUE_MAX];
+		for(uint64_t i = 0; i < settings; i++){
+			rdbLoadCString(rdb, name, sizeof(name));
+			rdbLoadCString(rdb, value, sizeof(value));
+			if(settingsSet(&rqueue->settings, name, value) != REDISMODULE_OK){
+				RedisModule_LogIOError(rdb, "warning", "Ignoring unknown setting '%s' = '%s'", name, value);
+			}
+		}
+	}
+	// Version 1 had no batches: lease tokens don't survive the upgrade
+	if(encver >= 2){
+		rqueue->last_batch = RedisModule_LoadUnsigned(rdb);
+	}
+	// Nor do they before version 8, which recorded the batches that have one
+	uint64_t batches = encver >= 8 ? RedisModule_LoadUnsigned(rdb) : 0;
+	unsigned char batchkey[4];
+	for(uint64_t i = 0; i < batches; i++){
+		rq_batch_members_t *members = RedisModule_Alloc(sizeof(*members));
+		members->live = members->count = members->size = 0;
+		rqueue->memory_used += sizeof(*members);
+		batchKey(RedisModule_LoadUnsigned(rdb), batchkey);
+		RedisModule_DictReplaceC(rqueue->batches, batchkey, sizeof(batchkey), members);
+	}
+	if(encver >= 5){
+		uint64_t buckets = RedisModule_LoadUnsigned(rdb), count;
+		sketch_t *latency = NULL;
+		if(buckets){
+			latency = rqueue->latency = RedisModule_Calloc(1, sizeof(*latency));
+			rqueue->memory_used += sizeof(*latency);
+		}
+		for(uint64_t i = 0; i < buckets; i++){
+			count = RedisModule_LoadUnsigned(rdb);
+			if(i < SKETCH_BUCKETS){
+				latency->counts[i] = count;
+				latency->total += count;
+			}
+		}
+		if(latency){
+			latency->samples = latency->total;
+		}
 	}
+    uint64_t undelivered = RedisModule_LoadUnsigned(rdb);
+    uint64_t delivered = RedisModule_LoadUnsigned(rdb);
+	msg_segment_t *seg;
+	lease_t *lease = NULL;
+	msg_t msg;
 
-	msg_t *msg = NULL, *prev = NULL;
-	size_t strlen;
+	// Messages are loaded in queue order, so every one goes to the tail
+	for(uint64_t i = 0; i < undelivered + delivered; i++){
+		msg.id.ms = RedisModule_LoadUnsigned(rdb);
+		msg.id.seq = RedisModule_LoadUnsigned(rdb);
+		payloadLoad(rdb, rqueue, &msg.payload);
+		if(
+			msg.id.ms > rqueue->last_id.ms ||
+			(msg.id.ms == rqueue->last_id.ms && msg.id.seq > rqueue->last_id.seq)
+		){
+			rqueue->last_id = msg.id;
+		}
+		if(i < undelivered){
+			// Requeued messages keep their deliveries since version 4
+			msg.deliveries = encver >= 4 ? RedisModule_LoadUnsigned(rdb) : 0;
+			msg.lastDelivery = 0;
+			msg.batch = 0;
+			msg.extend = 0;
+			msg.lease = 0;
+			queueAppend(rqueue, &rqueue->undelivered, &msg);
+			// Long backlogs get spilled as they're loaded
+			if((i + 1) % SEGMENT_SIZE == 0){
+				spillCheck(rqueue);
+			}
+		} else {
+			msg.deliveries = RedisModule_LoadUnsigned(rdb);
+			msg.lastDelivery = RedisModule_LoadUnsigned(rdb);
+			msg.batch = encver >= 2 ? RedisModule_LoadUnsigned(rdb) : 0;
+			msg.extend = encver >= 3 ? RedisModule_LoadUnsigned(rdb) : 0;
+			msg.lease = encver >= 4 ? RedisModule_LoadUnsigned(rdb) : 0;
+			payloadOffload(rqueue, &msg.payload);
+			seg = queueAppend(rqueue, &rqueue->delivered, &msg);
+			rq_index_add(rqueue, &msg.id, seg);
+			if(msg.batch && batchMembers(rqueue, msg.batch)){
+				batchRecord(rqueue, msg.batch, &msg.id, 0);
+				batchJoin(rqueue, msg.batch);
+			}
 
-	for(
-		uint64_t i = 0, left = total_messages;
-		left > 0;
-		//do-nothing
-	){
-		msg_block_t *block = RedisModule_Alloc(sizeof(*block));
-		size_t numelem = ( left > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : left );
-		block->ptr = RedisModule_Calloc(numelem, sizeof(*msg));
-		block->count = numelem;
-		block->freed = 0;
-		rqueue->memory_used += sizeof(*block) + (sizeof(*msg) * numelem);
-		
-		//Init the messages
-		msg = block->ptr;
-		for(int j = 0; j < block->count; j++, i++, left--){
-			msg[j].block = block;
-			msg[j].id.ms = RedisModule_LoadUnsigned(rdb);
-			msg[j].id.seq = RedisModule_LoadUnsigned(rdb);
-			msg[j].value = RedisModule_LoadString(rdb);
-			RedisModule_StringPtrLen(msg[j].value, &strlen);
-			rqueue->memory_used += strlen;
-			if(i < rqueue->undelivered.len){
-				msg[j].deliveries = 0;
-				msg[j].lastDelivery = 0;
-				msg[j].next = NULL; //will be initialized in next cycle
-				if(prev){
-					prev->next = &msg[j];
+			// Messages popped together are loaded together: one lease for each run
+			if(msg.lease){
+				if(lease && lease->expires != segmentDeadline(seg, seg->tail - 1)){
+					leaseSchedule(lease);
+					lease = NULL;
 				}
-			} else {
-				msg[j].deliveries = RedisModule_LoadUnsigned(rdb);
-				msg[j].lastDelivery = RedisModule_LoadUnsigned(rdb);
-				msg[j].next = NULL; //will be initialized in next cycle
-				if(prev && prev->deliveries > 0){
-					prev->next = &msg[j];
+				if(lease == NULL){
+					lease = leaseCreate(rqueue, 1, segmentDeadline(seg, seg->tail - 1));
 				}
+				lease = leasePush(lease, msg.id.ms, msg.id.seq);
 			}
-			prev = &msg[j];
 		}
 	}
 
-	// load "undelivered" messages
-	/*if(rqueue->undelivered.len > 0)
-	{
-		rqueue->undelivered.first = &msg[0];
+	if(lease){
+		leaseSchedule(lease);
+	}
 
-		for(
-			uint64_t i = 0, j = 1;
-			i < rqueue->undelivered.len;
-			i++, j++
-		){
-			msg[i].id.ms = RedisModule_LoadUnsigned(rdb);
-			msg[i].id.seq = RedisModule_LoadUnsigned(rdb);
-			msg[i].value = RedisModule_LoadString(rdb);
-			msg[i].deliveries = 0;
-			msg[i].lastDelivery = 0;
-			msg[i].next = (
-				j < rqueue->undelivered.len ?
-				&msg[j] :
-				NULL
-			);
+	// Version 5 had no delayed messages
+	uint64_t delays = encver >= 6 ? RedisModule_LoadUnsigned(rdb) : 0;
+	for(uint64_t i = 0; i < delays; i++){
+		long long due = RedisModule_LoadUnsigned(rdb);
+		uint32_t count = RedisModule_LoadUnsigned(rdb);
+		lease_t *delayed = delayCreate(rqueue, count, due);
+		for(uint32_t j = 0; j < count; j++){
+			msg.id.ms = RedisModule_LoadUnsigned(rdb);
+			msg.id.seq = RedisModule_LoadUnsigned(rdb);
+			payloadLoad(rdb, rqueue, &msg.payload);
+			// Negatively acknowledged messages keep their deliveries since version 7
+			msg.deliveries = encver >= 7 ? RedisModule_LoadUnsigned(rdb) : 0;
+			if(
+				msg.id.ms > rqueue->last_id.ms ||
+				(msg.id.ms == rqueue->last_id.ms && msg.id.seq > rqueue->last_id.seq)
+			){
+				rqueue->last_id = msg.id;
+			}
+			delayed = delayPush(delayed, msg.id.ms, msg.id.seq, &msg.payload, msg.deliveries);
 		}
-
-		rqueue->undelivered.last = &msg[rqueue->undelivered.len - 1];
+		leaseSchedule(delayed);
 	}
-	
-
-	// load "delivered" messages
-	if(rqueue->delivered.len > 0)
-	{
-		rqueue->delivered.first = &msg[rqueue->delivered.len];
 
-		for(
-			uint64_t i = 0, j = 1, k = rqueue->delivered.len;
-			i < rqueue->delivered.len;
-			i++, j++, k++
-		){
-			msg[k].id.ms = RedisModule_LoadUnsigned(rdb);
-			msg[k].id.seq = RedisModule_LoadUnsigned(rdb);
-			msg[k].value = RedisModule_LoadString(rdb);
-			msg[k].deliveries = RedisModule_LoadUnsigned(rdb);
-			msg[k].lastDelivery = RedisModule_LoadUnsigned(rdb);
-			msg[k].next = (
-				j < rqueue->delivered.len ?
-				&msg[k + 1] :
-				NULL
-			);
-		}
-
-		rqueue->delivered.last = &msg[rqueue->delivered.len - 1];
-	}*/
+	// Nor origins of dead letters before version 9
+	uint64_t origins = encver >= 9 ? RedisModule_LoadUnsigned(rdb) : 0;
+	for(uint64_t i = 0; i < origins; i++){
+		msgid_t from;
+		size_t len;
+		msg.id.ms = RedisModule_LoadUnsigned(rdb);
+		msg.id.seq = RedisModule_LoadUnsigned(rdb);
+		from.ms = RedisModule_LoadUnsigned(rdb);
+		from.seq = RedisModule_LoadUnsigned(rdb);
+		char *queue = RedisModule_LoadStringBuffer(rdb, &len);
+		rq_origin_add(rqueue, &msg.id, rq_origin_create(&from, queue, len));
+		RedisModule_Free(queue);
+	}
 	
 	return rqueue;
 }
@@ -327,37 +1561,61 @@ size_t rq_memory_usage(const void *value) {
 }
 
 // Frees all the memory used by the messages in a queue
-void free_mq(msg_t *first){
-	msg_t *cur = NULL, *next = NULL;
-	msg_block_t *block = NULL;
-
-	cur = first;
-	while(cur) {
-		next = cur->next;
-		RedisModule_FreeString(NULL, cur->value);
-		cur->value = NULL;
-		if(cur->block){
-			block = cur->block;
-			block->freed += 1;
-			if(block->freed >= block->count){
-				RedisModule_Free(block->ptr);
-				block->ptr = cur = NULL;
-				RedisModule_Free(block);
-				block = NULL;
+void free_mq(rqueue_t *rqueue, queue_t *queue){
+	msg_segment_t *seg = queue->first, *next;
+
+	if(queue->spill){
+		spillFree(rqueue, queue);
+	}
+
+	while(seg) {
+		next = seg->next;
+		for(uint32_t i = seg->head; i < seg->tail; i++){
+			if(segmentIsLive(seg, i)){
+				payloadRelease(rqueue, &seg->payload[i]);
 			}
-		} else {
-        	RedisModule_Free(cur);
 		}
-        cur = next;
-    }
+		RedisModule_Free(seg);
+		seg = next;
+	}
+
+	initQueue(queue);
 }
 
 void rq_free(void *value) {
 	rqueue_t *rqueue = value;
 
 	 // Free all undelivered message
-	free_mq(rqueue->undelivered.first);
-	free_mq(rqueue->delivered.first);
+	free_mq(rqueue, &rqueue->undelivered);
+	free_mq(rqueue, &rqueue->delivered);
+	leaseFreeAll(rqueue);
+	payloadCloseChunk(rqueue);
+	offloadClose(rqueue);
+	if(rqueue->latency){
+		RedisModule_Free(rqueue->latency);
+	}
+
+	// Last: releasing payloads may have scheduled the queue again
+	compactUnschedule(rqueue);
+	RedisModule_FreeDict(NULL, rqueue->pending);
+
+	RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(rqueue->batches, "^", NULL, 0);
+	rq_batch_members_t *members;
+	while(RedisModule_DictNextC(iter, NULL, (void **) &members) != NULL){
+		RedisModule_Free(members);
+	}
+	RedisModule_DictIteratorStop(iter);
+	RedisModule_FreeDict(NULL, rqueue->batches);
+
+	if(rqueue->origins){
+		rq_origin_t *origin;
+		iter = RedisModule_DictIteratorStartC(rqueue->origins, "^", NULL, 0);
+		while(RedisModule_DictNextC(iter, NULL, (void **) &origin) != NULL){
+			RedisModule_Free(origin);
+		}
+		RedisModule_DictIteratorStop(iter);
+		RedisModule_FreeDict(NULL, rqueue->origins);
+	}
 
 	// Free name string
 	RedisModule_FreeString(NULL, rqueue->name);
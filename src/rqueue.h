@@ -2,23 +2,24 @@
 #include <sys/time.h>
 #define REDISMODULE_EXPERIMENTAL_API
 #include "../redismodule.h"
+#include "./payload.h"
+#include "./compact.h"
+#include "./scan.h"
+#include "./settings.h"
+#include "./spill.h"
+#include "./offload.h"
+#include "./lease.h"
+#include "./sketch.h"
 
-#define RQUEUE_ENCODING_VERSION 0
+#define RQUEUE_ENCODING_VERSION 9 /* 1: per-queue settings saved before the messages; 2: delivery batches; 3: lease extensions; 4: visibility timeouts; 5: ack latencies; 6: delayed messages; 7: their deliveries; 8: batches with a lease token; 9: origin of dead letters */
 #define MSG_ID_FORMAT "%lu-%lu"
-#define MAX_BLOCK_SIZE 100
+#define BATCH_TOKEN_FORMAT "%u:%lu-%lu:%lu-%lu" /* Batch number, first and last message ID */
+#define SEGMENT_SIZE 64 /* Message slots per queue segment (at most 64, one bit per slot; multiple of 4) */
+#define MSG_ID_KEY_LEN 16 /* Size of a msgid_t encoded as a pending index key */
+#define SEGMENT_SPARSE (SEGMENT_SIZE / 2) /* Live slots under which a segment with holes gets compacted */
 
 typedef long long mstime_t; /* millisecond time type. */
 
-/**
- * Block of contiguous msg_t structs
- */
-typedef struct msg_block_t {
-    void *ptr;        //Pointer to the first msg in the block
-    size_t count;     //Total count of messages inside the block
-    size_t freed;     //total messages in the block that has been acknowledged.
-    //size_t mem_usage; //Total memory usage of all nodes in this block
-} msg_block_t;
-
 /* Queue item ID: a 128 bit number composed of a milliseconds time and
  * a sequence counter. IDs generated in the same millisecond (or in a past
  * millisecond if the clock jumped backward) will use the millisecond time
@@ -28,38 +29,210 @@ typedef struct msgid_t {
     uint64_t seq;       /* Sequence number. */
 } msgid_t;
 
+/* A message, unpacked from the parallel arrays of its segment */
 typedef struct msg_t {
     msgid_t id;
-    RedisModuleString *value;
-    struct msg_t *next;
+    payload_t payload;
     uint deliveries; /* how many times the msg has being delivered*/
     mstime_t lastDelivery; /* Last time the msg was delivered */
-    msg_block_t *block; // msg block to which the msg belongs
+    uint32_t batch; /* Batch the msg was popped in (0 if none) */
+    uint32_t extend; /* Milliseconds its lease lasts past the RECOVER threshold */
+    uint32_t lease; /* Visibility timeout of its delivery, in milliseconds (0 if none) */
 } msg_t;
 
+/**
+ * The messages delivered by a single pop from a queue: its lease token
+ */
+typedef struct rq_batch_t {
+    uint32_t id;   // Batch number, unique in its queue
+    msgid_t first; // Lowest and highest message ID of the batch
+    msgid_t last;
+} rq_batch_t;
+
+/**
+ * The messages popped along with a lease token, recorded at pop time so the
+ * token acknowledges exactly those (see rq_ack_batch)
+ */
+typedef struct rq_batch_members_t {
+    uint32_t live;  // Members still delivered as part of the batch: freed at 0
+    uint32_t count;
+    uint32_t size;  // Capacity of "ids"
+    msgid_t ids[];
+} rq_batch_members_t;
+
+/**
+ * Where a message moved to a dead-letter queue comes from: the ID it had in
+ * the queue it was dead-lettered from, and the key of that queue
+ */
+typedef struct rq_origin_t {
+    msgid_t id;
+    size_t len;
+    char queue[]; // Key name, "len" bytes long, NUL-terminated
+} rq_origin_t;
+
+/**
+ * Fixed-capacity segment of contiguous message slots. Messages are appended at
+ * "tail" and served from "head"; slots in between may be empty once
+ * acknowledged. Removing a message just sets its bit in "freed": emptied
+ * segments are unlinked in bulk once they reach the head of the queue.
+ *
+ * Message fields are stored as parallel arrays, so scans by ID or by delivery
+ * time only touch the field they look at (see scan.h).
+ */
+typedef struct msg_segment_t {
+    struct msg_segment_t *prev;
+    struct msg_segment_t *next;
+    uint64_t freed; // Bitmap of used slots whose message was removed
+    uint32_t head;  // First live slot
+    uint32_t tail;  // One past the last used slot
+    uint32_t live;  // Slots between head and tail still holding a message
+    uint64_t ms[SEGMENT_SIZE];  // ID: milliseconds part
+    uint64_t seq[SEGMENT_SIZE]; // ID: sequence part
+    mstime_t lastDelivery[SEGMENT_SIZE];
+    uint32_t deliveries[SEGMENT_SIZE];
+    uint32_t batch[SEGMENT_SIZE];
+    uint32_t extend[SEGMENT_SIZE];
+    uint32_t lease[SEGMENT_SIZE];
+    payload_t payload[SEGMENT_SIZE];
+} msg_segment_t;
+
+/* Returns non-zero if the slot at "pos" holds a message */
+static inline int segmentIsLive(const msg_segment_t *seg, uint32_t pos){
+    return pos < seg->tail && !((seg->freed >> pos) & 1);
+}
+
+/* Returns the time at which the lease of the delivered message at "pos"
+ * expires, if it has a visibility timeout */
+static inline mstime_t segmentDeadline(const msg_segment_t *seg, uint32_t pos){
+    return seg->lastDelivery[pos] + seg->lease[pos] + seg->extend[pos];
+}
+
+/* Returns the time from which RQ.RECOVER counts how long the delivered message
+ * at "pos" has been pending: the delivered queue is kept in this order */
+static inline mstime_t segmentRecoverFrom(const msg_segment_t *seg, uint32_t pos){
+    return seg->lastDelivery[pos] + seg->extend[pos];
+}
+
+/* Returns a bitmap of the slots holding a message */
+static inline uint64_t segmentLiveMask(const msg_segment_t *seg){
+    uint64_t used = seg->tail < 64 ? ((uint64_t) 1 << seg->tail) - 1 : ~(uint64_t) 0;
+    return used & ~seg->freed;
+}
+
+/**
+ * A queue is a deque of msg_segment_t
+ */
 typedef struct queue_t {
-    void *first; /* First to be served */
-    void *last;
+    msg_segment_t *first; /* First to be served */
+    msg_segment_t *last;
     size_t len; /* Number of elements added. */
+    spill_t *spill; /* Messages in the middle of the queue, kept on disk (NULL if none) */
 } queue_t;
 
+/* Iterator over the live messages of a queue, in queue order. Spilled messages
+ * are read one record at a time into a scratch segment. */
+typedef struct queue_iter_t {
+    msg_segment_t *seg;
+    uint32_t pos;
+    queue_t *queue;
+    int spilled;              // Iterating over the spilled messages
+    spill_cursor_t cur;       // Next spilled record to read
+    msg_segment_t *scratch;   // Last spilled record read
+    payload_chunk_t *body;    // Payloads of that record
+} queue_iter_t;
+
+/**
+ * Per-queue counters, reported by RQ.INFO
+ */
+typedef struct rq_stats_t {
+    uint64_t compressed;     // Payloads stored compressed
+    uint64_t compressed_in;  // Original size of the compressed payloads
+    uint64_t compressed_out; // Compressed size of those payloads
+    uint64_t compress_us;    // Microseconds spent compressing (including attempts not worth it)
+    uint64_t decompress_us;  // Microseconds spent decompressing
+    uint64_t intern_hits;    // Payloads found already interned
+    uint64_t intern_misses;  // Payloads interned for the first time
+    uint64_t intern_saved;   // Bytes not stored thanks to interning hits
+    uint64_t spill_writes;   // Segments written to disk
+    uint64_t spill_bytes_written;
+    uint64_t spill_reads;    // Segments read back into RAM
+    uint64_t spill_read_us;  // Microseconds spent reading them
+    uint64_t spill_read_max_us;
+    uint64_t offloaded;      // Payloads moved to the payload log
+    uint64_t offload_live;   // Bytes of the payload log still held by messages
+    uint64_t offload_mapped; // Size of the payload log regions
+    uint64_t leases;         // Leases scheduled in the timing wheel
+    uint64_t lease_expired;  // Messages requeued once their visibility timeout expired
+    uint64_t delayed;        // Messages waiting to be pushed
+    uint64_t nacked;         // Messages negatively acknowledged
+    uint64_t deadlettered;   // Messages moved to the dead-letter queue
+    uint64_t deadletter_errors; // Messages delivered again since their DEADLETTER key holds something else
+} rq_stats_t;
+
 /**
  * Reliable Queue Object 
  */
 typedef struct rqueue_t {
-    RedisModuleString *name; // Redis key for this RQ
+    RedisModuleString *name; // Redis key for this RQ, kept up to date by the keyspace events of module.c
     msgid_t last_id;     // Zero if there are yet no items
+    uint32_t last_batch; // Number of the latest delivery batch
     queue_t undelivered; // never-delivered queue
     queue_t delivered;   // Queue of messages that has being delivered at-least-one 
+    RedisModuleDict *pending; // Index of the "delivered" messages, by ID
+    RedisModuleDict *batches; // rq_batch_members_t of the batches popped with a lease token, by batch number
+    RedisModuleDict *origins; // rq_origin_t of the messages dead-lettered into it, by ID (NULL until the first one)
+    payload_chunk_t *chunk; // Chunk open for appending inline payloads
+    offload_region_t *offload; // Region of the payload log open for appends
+    lease_t *leases; // Visibility timeouts of its delivered messages (see lease.c)
+    lease_t *delayed; // Messages pushed with a delay, waiting in the timing wheel
+    int db; // Database of its key (as "name"), to wake up blocked clients from timers
+    sketch_t *latency; // Pop (or touch) to ack latencies, NULL until the first ack
+    uint32_t lease_auto; // AUTO lease last computed from "latency" (0: to be computed)
+    uint64_t lease_auto_at; // latency->samples at the time
     size_t memory_used;
+    rq_settings_t settings;
+    rq_stats_t stats;
+
+    /* Incremental compaction state (see compact.c) */
+    struct rqueue_t *compact_prev; // Links in the list of queues scheduled for compaction
+    struct rqueue_t *compact_next;
+    queue_t *compact_queue;        // Queue being compacted, NULL if not scheduled
+    msg_segment_t *compact_seg;    // Next segment to compact, NULL once "compact_queue" is done
+    int compact_undelivered;       // Undelivered queue requested during a pass of the delivered one
 } rqueue_t;
 
+/**
+ * Module-wide settings, given as module arguments at load time
+ */
+typedef struct rq_config_t {
+    size_t inline_threshold; // Payloads shorter than this are stored inline
+    const char *spill_dir;     // Directory for spill files
+    double spill_memory_ratio; // Spill every queue once used/max memory reaches this (0: disabled)
+} rq_config_t;
+
+extern rq_config_t rq_config;
+
+extern RedisModuleType *RELIABLEQ_TYPE;
+
+/* Reply formats of RQ.POP */
+#define POP_FORMAT_FLAT 0    /* [queue, ID, payload] per message */
+#define POP_FORMAT_GROUPED 1 /* [queue, [ID, payload, ...]] per queue */
+#define POP_FORMAT_PACKED 2  /* [queue, ID's blob, [payload, ...]] per queue */
+
+/* Visibility timeouts of RQ.POP, other than a number of milliseconds */
+#define POP_LEASE_QUEUE -1 /* The LEASE setting of the queue */
+#define POP_LEASE_AUTO -2  /* Learned from the latencies of the queue */
+
 /**
  * POP Arguments
  */
 typedef struct rq_pop_t {
     uint64_t count;
     int64_t block;
+    int64_t lease; /* Visibility timeout of the messages popped, or one of POP_LEASE_* */
+    int noack; /* Drop the messages right away instead of delivering them */
+    int batch; /* Reply with the lease token of every batch */
+    int format; /* One of POP_FORMAT_* */
     uint key_count;
     RedisModuleString **keys;
 } rq_pop_t;
@@ -69,8 +242,48 @@ long long mstime(void);
 /* Return the UNIX time in milliseconds */
 mstime_t mstime(void);
 
+/* Return the UNIX time in microseconds */
+long long ustime(void);
+
 void initQueue(queue_t *queue);
 
+/* Copies "msg" to a new slot at the end of the queue. Returns the segment
+ * holding it, at position "tail - 1" */
+msg_segment_t *queueAppend(rqueue_t *rqueue, queue_t *queue, const msg_t *msg);
+
+/* Copies "msg" to a new slot at the head of the queue: the one before "head"
+ * in the first segment, or the last one of a new segment before it. Returns
+ * the segment holding it, at position "head". */
+msg_segment_t *queuePrepend(rqueue_t *rqueue, queue_t *queue, const msg_t *msg);
+
+/* Links a new empty segment before "before" (at the end of the queue, if NULL) */
+msg_segment_t *queueInsertSegment(rqueue_t *rqueue, queue_t *queue, msg_segment_t *before);
+
+/* Unlinks and frees the segment. Its messages must have been dealt with. */
+void queueUnlinkSegment(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg);
+
+/* Unpacks the message at "pos" of the given segment into "msg" */
+void segmentGet(const msg_segment_t *seg, uint32_t pos, msg_t *msg);
+
+/* Removes the message at "pos" of the given segment. The slot payload must have
+ * been released (or moved elsewhere) by the caller. Segments left sparse are
+ * scheduled for compaction, and emptied ones are freed once they reach the
+ * head of the queue. Spilled messages are read back when the head drains. */
+void queueRemove(rqueue_t *rqueue, queue_t *queue, msg_segment_t *seg, uint32_t pos);
+
+void queueIterStart(queue_t *queue, queue_iter_t *it);
+
+/* Returns the segment holding the next live message, and sets "pos" to its
+ * slot. Returns NULL at the end of the queue. */
+msg_segment_t *queueIterNext(queue_iter_t *it, uint32_t *pos);
+
+/* Skips the next "n" messages, whole segments or spilled records at a time.
+ * Returns the messages skipped. */
+long long queueIterSkip(queue_iter_t *it, long long n);
+
+/* Releases the buffers used to iterate over spilled messages */
+void queueIterStop(queue_iter_t *it);
+
 // parses a pop command args
 int rq_parse_pop_args(
     RedisModuleCtx *ctx,
@@ -79,8 +292,9 @@ int rq_parse_pop_args(
     rq_pop_t *pop
 );
 
-/** Creates and initializes a new RELIABLEQ object, and returns a pointer to it. */
-rqueue_t *rqueueCreate(const RedisModuleString *name);
+/** Creates and initializes a new RELIABLEQ object for the key "name" of
+ * database "db", and returns a pointer to it. */
+rqueue_t *rqueueCreate(const RedisModuleString *name, int db);
 
 /* Generate the next item ID given the previous one. If the current
  * milliseconds Unix time is greater than the previous one, just use this
@@ -88,16 +302,134 @@ rqueue_t *rqueueCreate(const RedisModuleString *name);
  * previous time (and never go backward) and increment the sequence. */
 void setNextMsgID(msgid_t *last_id, msgid_t *new_id);
 
+/* Generate the ID following the previous one, in the same millisecond */
+void incrMsgID(const msgid_t *last_id, msgid_t *new_id);
+
 /**
  * Pops up to "count" messages from the reliable queue at "rqueue", and replies
- * to the Redis client
+ * to the Redis client in the given POP_FORMAT_*: with an element per message,
+ * or a single one for all of them when grouped or packed (where ID's are given
+ * as 16-byte big-endian ms and seq pairs), according to "pop->format". The
+ * messages popped are tagged as a new delivery batch, described in "batch",
+ * whose members are recorded with "pop->batch". With "pop->noack" they're freed once replied instead, with no batch (0).
+ * Otherwise, with a visibility timeout ("pop->lease", or the queue's LEASE
+ * setting), they're scheduled in a single lease.
  */
 long long popAndReply(
 	RedisModuleCtx *ctx,
 	rqueue_t *rqueue,
-	long long *count
+	long long *count,
+	rq_batch_t *batch,
+	const rq_pop_t *pop
 );
 
+/* Encodes a message ID as a big-endian key, so the pending index iterates in
+ * ID order */
+void msgIdToKey(const msgid_t *id, unsigned char *key);
+
+/* Decodes a key encoded by msgIdToKey back into a message ID */
+void msgIdFromKey(const unsigned char *key, msgid_t *id);
+
+/* Replies with a message ID, formatted as MSG_ID_FORMAT */
+void replyWithMsgId(RedisModuleCtx *ctx, uint64_t ms, uint64_t seq);
+
+/* Pending (delivered) messages index: maps every delivered message ID to the
+ * segment holding it */
+void rq_index_add(rqueue_t *rqueue, const msgid_t *id, msg_segment_t *seg);
+msg_segment_t *rq_index_find(rqueue_t *rqueue, const msgid_t *id);
+void rq_index_del(rqueue_t *rqueue, const msgid_t *id);
+
+/* Returns the position of the message with the given ID inside "seg", or -1 */
+int segmentFind(const msg_segment_t *seg, const msgid_t *id);
+
+/* Moves "msg" into the "delivered" queue, indexing it: after the messages
+ * recovered no later than it (see segmentRecoverFrom), which is its end unless
+ * some were touched with EXTEND. "msg" is copied, so the caller is in charge of
+ * removing it from its former queue. Returns the segment it went to. */
+msg_segment_t *rq_deliver(rqueue_t *rqueue, const msg_t *msg);
+
+/**
+ * Acknowledges the delivered message with the given ID, unlinking it from the
+ * "delivered" queue and freeing it.
+ * @return int 1 if the message was found and removed, 0 otherwise
+ */
+int rq_ack(rqueue_t *rqueue, const msgid_t *id);
+
+/* Acknowledges every delivered message with an ID between "start" and "end"
+ * (both included), in a single pass over the "delivered" queue.
+ * Returns the number of messages removed. */
+long long rq_ack_range(rqueue_t *rqueue, const msgid_t *start, const msgid_t *end);
+
+/* Refreshes the lease of the delivered message with the given ID, as if it
+ * was delivered at "now", extended by "extend" milliseconds. The message is
+ * moved to where it's due in the delivered queue (see rq_deliver).
+ * Returns 0 if it's not pending. */
+int rq_touch(rqueue_t *rqueue, const msgid_t *id, mstime_t now, uint32_t extend);
+
+/* Moves the delivered message at "pos" of "seg" back to the head of the
+ * undelivered queue, keeping its number of deliveries */
+void rq_requeue(rqueue_t *rqueue, msg_segment_t *seg, uint32_t pos);
+
+/* Returns where the message "id" of a dead-letter queue comes from, or NULL
+ * if it wasn't dead-lettered into it */
+const rq_origin_t *rq_origin_find(rqueue_t *rqueue, const msgid_t *id);
+
+/* Selects the database of "rqueue" in "ctx", for timers. Checks that its key
+ * still holds it, looking for it in the other databases if not (after a
+ * SWAPDB, which has no event). Returns 0 if it couldn't be found. */
+int rq_select(RedisModuleCtx *ctx, rqueue_t *rqueue);
+
+/* Whether the key "name" is in the same hash slot as "keyname", or the server
+ * isn't part of a cluster */
+int rq_same_slot(RedisModuleCtx *ctx, RedisModuleString *keyname, const char *name);
+
+/* Returns the dead-letter queue of "rqueue", creating it if its key is empty,
+ * or NULL if it has none (or its key holds something else, or is in another
+ * slot of the cluster, as the queue may have been restored from elsewhere).
+ * RQ.NACK, RQ.RECOVER and RQ.EXEC write into it without declaring it: only
+ * RQ.CONFIG takes it as a key, see configCommand */
+rqueue_t *rq_deadletter_queue(RedisModuleCtx *ctx, rqueue_t *rqueue);
+
+/* Whether messages past MAXDELIVERIES can be moved to the dead-letter queue
+ * of "rqueue" (see rq_deadletter_queue), without creating it */
+int rq_deadletter_ready(RedisModuleCtx *ctx, rqueue_t *rqueue);
+
+/* Moves the delivered message at "pos" of "seg" to the dead-letter queue, if
+ * it was delivered MAXDELIVERIES times already: to the tail of its undelivered
+ * queue, with a new ID there, keeping its payload and number of deliveries,
+ * and recording its origin (see rq_origin_find). Returns 1 if it was moved,
+ * or 0 if it's to be delivered again. */
+int rq_deadletter(RedisModuleCtx *ctx, rqueue_t *rqueue, msg_segment_t *seg, uint32_t pos);
+
+#define NACK_BACKOFF -1 /* Delay of RQ.NACK BACKOFF, depending on the deliveries of every message */
+#define NACK_DEADLETTERED 2 /* Returned by rq_nack for messages moved to the dead-letter queue */
+
+/* Moves the delivered message with the given ID back to the undelivered queue,
+ * without copying its payload, and keeping its number of deliveries: to its
+ * head right away with a "delay" of 0, or to its tail once "delay" milliseconds
+ * (or NACK_BACKOFF) since "now" have elapsed. Messages due at the same time are
+ * added to "*delayed", which the caller has to schedule (see leaseSchedule)
+ * once done. Messages past MAXDELIVERIES go to the dead-letter queue instead.
+ * Returns 1 if the message was put back, NACK_DEADLETTERED if it was moved to
+ * the dead-letter queue, or 0 if it is not pending. */
+int rq_nack(RedisModuleCtx *ctx, rqueue_t *rqueue, const msgid_t *id, mstime_t now, int64_t delay, lease_t **delayed);
+
+/* Whether rq_nack puts messages back at the head of the queue right away with
+ * "delay": 0, or NACK_BACKOFF when the queue has no backoff */
+int rq_nack_immediate(const rqueue_t *rqueue, int64_t delay);
+
+/* Returns the visibility timeout, in milliseconds, of messages delivered from
+ * the queue with the given lease: a number of milliseconds or POP_LEASE_* */
+uint32_t rq_lease(rqueue_t *rqueue, int64_t lease);
+
+/* Acknowledges the delivered messages of the given batch, except the "except_count"
+ * ones with an ID in "except". Messages redelivered since then are left alone.
+ * Only the members recorded when the batch was popped are looked at.
+ * Returns the number of messages removed, or -1 if the lowest and highest ID of
+ * the batch recorded under that number aren't the ones of the token: a forged
+ * token, or a stale one whose number was given to a later batch. */
+long long rq_ack_batch(rqueue_t *rqueue, const rq_batch_t *batch, const msgid_t *except, int except_count);
+
 /* Blocking commands callbacks */
 //void rq_unblock_clients(RedisModuleCtx *ctx, rqueue_t *rqueue, int count);
 //int bpop_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
@@ -0,0 +1,206 @@
+#include "./scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Keeps only the bits of the first "count" elements */
+static inline uint64_t scanMask(uint64_t bits, uint32_t count){
+	return count >= 64 ? bits : bits & (((uint64_t) 1 << count) - 1);
+}
+
+/* ============= Scalar fallback ==================*/
+
+static uint64_t scalarMatchId(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t id_ms, uint64_t id_seq){
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i++){
+		bits |= (uint64_t) (ms[i] == id_ms && seq[i] == id_seq) << i;
+	}
+
+	return bits;
+}
+
+static uint64_t scalarExpired(const int64_t *ts, uint32_t count, int64_t cutoff){
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i++){
+		bits |= (uint64_t) (ts[i] <= cutoff) << i;
+	}
+
+	return bits;
+}
+
+static uint64_t scalarIdRange(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t lo_ms, uint64_t lo_seq, uint64_t hi_ms, uint64_t hi_seq){
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i++){
+		bits |= (uint64_t) (
+			(ms[i] > lo_ms || (ms[i] == lo_ms && seq[i] >= lo_seq)) &&
+			(ms[i] < hi_ms || (ms[i] == hi_ms && seq[i] <= hi_seq))
+		) << i;
+	}
+
+	return bits;
+}
+
+#ifdef SCAN_X86
+
+#define SCAN_SIGN ((uint64_t) 1 << 63) /* Flipped to compare unsigned as signed */
+
+/* ============= SSE2 (2 elements per vector) ==================*/
+
+/* SSE2 has no 64 bit compares: build them from the 32 bit ones */
+__attribute__((target("sse2")))
+static inline __m128i sse2CmpEq64(__m128i a, __m128i b){
+	__m128i eq = _mm_cmpeq_epi32(a, b);
+	return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2CmpGt64(__m128i a, __m128i b){
+	// Low halves compare unsigned: flip their sign bit and compare signed
+	__m128i flip = _mm_set_epi32(0, (int) 0x80000000, 0, (int) 0x80000000);
+	__m128i a2 = _mm_xor_si128(a, flip), b2 = _mm_xor_si128(b, flip);
+	__m128i gt = _mm_cmpgt_epi32(a2, b2);
+	__m128i eq = _mm_cmpeq_epi32(a2, b2);
+	__m128i gt_lo = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+	__m128i gt_hi = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+	__m128i eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+
+	return _mm_or_si128(gt_hi, _mm_and_si128(eq_hi, gt_lo));
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2MatchId(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t id_ms, uint64_t id_seq){
+	__m128i vms = _mm_set1_epi64x(id_ms), vseq = _mm_set1_epi64x(id_seq);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 2){
+		__m128i eq = _mm_and_si128(
+			sse2CmpEq64(_mm_loadu_si128((const __m128i *) (ms + i)), vms),
+			sse2CmpEq64(_mm_loadu_si128((const __m128i *) (seq + i)), vseq)
+		);
+		bits |= (uint64_t) _mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2Expired(const int64_t *ts, uint32_t count, int64_t cutoff){
+	__m128i vcut = _mm_set1_epi64x(cutoff);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 2){
+		__m128i gt = sse2CmpGt64(_mm_loadu_si128((const __m128i *) (ts + i)), vcut);
+		bits |= (uint64_t) (~_mm_movemask_pd(_mm_castsi128_pd(gt)) & 0x3) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2IdRange(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t lo_ms, uint64_t lo_seq, uint64_t hi_ms, uint64_t hi_seq){
+	__m128i sign = _mm_set1_epi64x(SCAN_SIGN);
+	__m128i lms = _mm_set1_epi64x(lo_ms ^ SCAN_SIGN), lseq = _mm_set1_epi64x(lo_seq ^ SCAN_SIGN);
+	__m128i hms = _mm_set1_epi64x(hi_ms ^ SCAN_SIGN), hseq = _mm_set1_epi64x(hi_seq ^ SCAN_SIGN);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 2){
+		__m128i m = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (ms + i)), sign);
+		__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (seq + i)), sign);
+		__m128i below = _mm_or_si128(sse2CmpGt64(lms, m), _mm_and_si128(sse2CmpEq64(m, lms), sse2CmpGt64(lseq, s)));
+		__m128i above = _mm_or_si128(sse2CmpGt64(m, hms), _mm_and_si128(sse2CmpEq64(m, hms), sse2CmpGt64(s, hseq)));
+		bits |= (uint64_t) (~_mm_movemask_pd(_mm_castsi128_pd(_mm_or_si128(below, above))) & 0x3) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+/* ============= AVX2 (4 elements per vector) ==================*/
+
+__attribute__((target("avx2")))
+static uint64_t avx2MatchId(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t id_ms, uint64_t id_seq){
+	__m256i vms = _mm256_set1_epi64x(id_ms), vseq = _mm256_set1_epi64x(id_seq);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 4){
+		__m256i eq = _mm256_and_si256(
+			_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) (ms + i)), vms),
+			_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) (seq + i)), vseq)
+		);
+		bits |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2Expired(const int64_t *ts, uint32_t count, int64_t cutoff){
+	__m256i vcut = _mm256_set1_epi64x(cutoff);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 4){
+		__m256i gt = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (ts + i)), vcut);
+		bits |= (uint64_t) (~_mm256_movemask_pd(_mm256_castsi256_pd(gt)) & 0xf) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2IdRange(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t lo_ms, uint64_t lo_seq, uint64_t hi_ms, uint64_t hi_seq){
+	__m256i sign = _mm256_set1_epi64x(SCAN_SIGN);
+	__m256i lms = _mm256_set1_epi64x(lo_ms ^ SCAN_SIGN), lseq = _mm256_set1_epi64x(lo_seq ^ SCAN_SIGN);
+	__m256i hms = _mm256_set1_epi64x(hi_ms ^ SCAN_SIGN), hseq = _mm256_set1_epi64x(hi_seq ^ SCAN_SIGN);
+	uint64_t bits = 0;
+
+	for(uint32_t i = 0; i < count; i += 4){
+		__m256i m = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (ms + i)), sign);
+		__m256i s = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (seq + i)), sign);
+		__m256i below = _mm256_or_si256(
+			_mm256_cmpgt_epi64(lms, m),
+			_mm256_and_si256(_mm256_cmpeq_epi64(m, lms), _mm256_cmpgt_epi64(lseq, s))
+		);
+		__m256i above = _mm256_or_si256(
+			_mm256_cmpgt_epi64(m, hms),
+			_mm256_and_si256(_mm256_cmpeq_epi64(m, hms), _mm256_cmpgt_epi64(s, hseq))
+		);
+		bits |= (uint64_t) (~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(below, above))) & 0xf) << i;
+	}
+
+	return scanMask(bits, count);
+}
+
+#endif
+
+scan_match_id_t scanMatchId = scalarMatchId;
+scan_expired_t scanExpired = scalarExpired;
+scan_id_range_t scanIdRange = scalarIdRange;
+
+const char *scanInit(void){
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2")){
+		scanMatchId = avx2MatchId;
+		scanExpired = avx2Expired;
+		scanIdRange = avx2IdRange;
+		return "avx2";
+	}
+
+	if(__builtin_cpu_supports("sse2")){
+		scanMatchId = sse2MatchId;
+		scanExpired = sse2Expired;
+		scanIdRange = sse2IdRange;
+		return "sse2";
+	}
+#endif
+
+	scanMatchId = scalarMatchId;
+	scanExpired = scalarExpired;
+	scanIdRange = scalarIdRange;
+	return "scalar";
+}
@@ -0,0 +1,29 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdint.h>
+
+/**
+ * Vectorized scans over the parallel arrays of a message segment. Every kernel
+ * returns a bitmask with bit "i" set if element "i" (of the first "count",
+ * at most 64) matches. Kernels read whole vectors, so the arrays must be
+ * readable up to "count" rounded up to a multiple of 4 elements.
+ */
+
+/* Slots whose ID equals id_ms-id_seq */
+typedef uint64_t (*scan_match_id_t)(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t id_ms, uint64_t id_seq);
+
+/* Slots whose timestamp is less than or equal to "cutoff" */
+typedef uint64_t (*scan_expired_t)(const int64_t *ts, uint32_t count, int64_t cutoff);
+
+/* Slots whose ID is between lo_ms-lo_seq and hi_ms-hi_seq, both included */
+typedef uint64_t (*scan_id_range_t)(const uint64_t *ms, const uint64_t *seq, uint32_t count, uint64_t lo_ms, uint64_t lo_seq, uint64_t hi_ms, uint64_t hi_seq);
+
+extern scan_match_id_t scanMatchId;
+extern scan_expired_t scanExpired;
+extern scan_id_range_t scanIdRange;
+
+/* Selects the fastest kernels supported by the CPU, and returns their name */
+const char *scanInit(void);
+
+#endif
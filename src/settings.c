@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+#include "./settings.h"
+
+typedef struct rq_setting_def_t {
+    const char *name;
+    int (*set)(rq_settings_t *settings, const char *value);
+    void (*format)(const rq_settings_t *settings, char *buf, size_t size);
+} rq_setting_def_t;
+
+/* Parses a non-negative integer, rejecting trailing garbage */
+static int parseSize(const char *value, size_t *out){
+	char *end;
+	long long v;
+
+	errno = 0;
+	v = strtoll(value, &end, 10);
+	if(errno || end == value || *end != '\0' || v < 0){
+		return REDISMODULE_ERR;
+	}
+
+	*out = v;
+	return REDISMODULE_OK;
+}
+
+static int setCompress(rq_settings_t *settings, const char *value){
+	return parseSize(value, &settings->compress_threshold);
+}
+
+static void formatCompress(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%zu", settings->compress_threshold);
+}
+
+/* Parses a 0 or 1 flag */
+static int parseFlag(const char *value, int *out){
+	size_t v;
+
+	if(parseSize(value, &v) != REDISMODULE_OK || v > 1){
+		return REDISMODULE_ERR;
+	}
+
+	*out = v;
+	return REDISMODULE_OK;
+}
+
+static int setIntern(rq_settings_t *settings, const char *value){
+	return parseFlag(value, &settings->intern);
+}
+
+static void formatIntern(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%d", settings->intern);
+}
+
+static int setSpill(rq_settings_t *settings, const char *value){
+	return parseSize(value, &settings->spill);
+}
+
+static void formatSpill(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%zu", settings->spill);
+}
+
+static int setOffload(rq_settings_t *settings, const char *value){
+	return parseSize(value, &settings->offload);
+}
+
+static void formatOffload(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%zu", settings->offload);
+}
+
+/* Parses a positive number, up to "max" */
+static int parseDouble(const char *value, double max, double *out){
+	char *end;
+	double v;
+
+	errno = 0;
+	v = strtod(value, &end);
+	if(errno || end == value || *end != '\0' || !(v > 0 && v <= max)){
+		return REDISMODULE_ERR;
+	}
+
+	*out = v;
+	return REDISMODULE_OK;
+}
+
+/* Parses a non-negative integer, up to UINT32_MAX */
+static int parseUint32(const char *value, uint32_t *out){
+	size_t v;
+
+	if(parseSize(value, &v) != REDISMODULE_OK || v > UINT32_MAX){
+		return REDISMODULE_ERR;
+	}
+
+	*out = v;
+	return REDISMODULE_OK;
+}
+
+static int setLease(rq_settings_t *settings, const char *value){
+	if(strcasecmp(value, "auto") == 0){
+		settings->lease = 0;
+		settings->lease_auto = 1;
+		return REDISMODULE_OK;
+	}
+
+	if(parseUint32(value, &settings->lease) != REDISMODULE_OK){
+		return REDISMODULE_ERR;
+	}
+
+	settings->lease_auto = 0;
+	return REDISMODULE_OK;
+}
+
+static void formatLease(const rq_settings_t *settings, char *buf, size_t size){
+	if(settings->lease_auto){
+		snprintf(buf, size, "auto");
+	} else {
+		snprintf(buf, size, "%u", settings->lease);
+	}
+}
+
+static int setLeasePercentile(rq_settings_t *settings, const char *value){
+	return parseDouble(value, 100, &settings->lease_percentile);
+}
+
+static void formatLeasePercentile(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%g", settings->lease_percentile);
+}
+
+static int setLeaseFactor(rq_settings_t *settings, const char *value){
+	return parseDouble(value, 1000, &settings->lease_factor);
+}
+
+static void formatLeaseFactor(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%g", settings->lease_factor);
+}
+
+static int setBackoff(rq_settings_t *settings, const char *value){
+	return parseUint32(value, &settings->backoff);
+}
+
+static void formatBackoff(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%u", settings->backoff);
+}
+
+static int setBackoffMax(rq_settings_t *settings, const char *value){
+	return parseUint32(value, &settings->backoff_max);
+}
+
+static void formatBackoffMax(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%u", settings->backoff_max);
+}
+
+static int setMaxDeliveries(rq_settings_t *settings, const char *value){
+	return parseUint32(value, &settings->max_deliveries);
+}
+
+static void formatMaxDeliveries(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%u", settings->max_deliveries);
+}
+
+static int setDeadletter(rq_settings_t *settings, const char *value){
+	if(strlen(value) >= sizeof(settings->deadletter)){
+		return REDISMODULE_ERR;
+	}
+
+	strcpy(settings->deadletter, value);
+	return REDISMODULE_OK;
+}
+
+static void formatDeadletter(const rq_settings_t *settings, char *buf, size_t size){
+	snprintf(buf, size, "%s", settings->deadletter);
+}
+
+static const rq_setting_def_t settings_defs[] = {
+	{ "compress", setCompress, formatCompress },
+	{ "intern", setIntern, formatIntern },
+	{ "spill", setSpill, formatSpill },
+	{ "offload", setOffload, formatOffload },
+	{ "lease", setLease, formatLease },
+	{ "lease_percentile", setLeasePercentile, formatLeasePercentile },
+	{ "lease_factor", setLeaseFactor, formatLeaseFactor },
+	{ "backoff", setBackoff, formatBackoff },
+	{ "backoff_max", setBackoffMax, formatBackoffMax },
+	{ "maxdeliveries", setMaxDeliveries, formatMaxDeliveries },
+	{ "deadletter", setDeadletter, formatDeadletter }
+};
+
+#define SETTINGS_COUNT ((int) (sizeof(settings_defs) / sizeof(settings_defs[0])))
+
+void settingsInit(rq_settings_t *settings){
+	settings->compress_threshold = 0;
+	settings->intern = 0;
+	settings->spill = 0;
+	settings->offload = 0;
+	settings->lease = 0;
+	settings->lease_auto = 0;
+	settings->lease_percentile = 99;
+	settings->lease_factor = 2;
+	settings->backoff = 1000;
+	settings->backoff_max = 600000;
+	settings->max_deliveries = 0;
+	settings->deadletter[0] = '\0';
+}
+
+int settingsSet(rq_settings_t *settings, const char *name, const char *value){
+	for(int i = 0; i < SETTINGS_COUNT; i++){
+		if(strcasecmp(settings_defs[i].name, name) == 0){
+			return settings_defs[i].set(settings, value);
+		}
+	}
+
+	return REDISMODULE_ERR;
+}
+
+int settingsCount(void){
+	return SETTINGS_COUNT;
+}
+
+const char *settingsName(int i){
+	return settings_defs[i].name;
+}
+
+void settingsFormat(const rq_settings_t *settings, int i, char *buf, size_t size){
+	settings_defs[i].format(settings, buf, size);
+}
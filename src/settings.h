@@ -0,0 +1,42 @@
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SETTINGS_VALUE_MAX 256 /* Longest textual value of a setting, plus 1 */
+
+/**
+ * Per-queue settings, changed with RQ.CONFIG and persisted along with the
+ * queue as name-value pairs.
+ */
+typedef struct rq_settings_t {
+    size_t compress_threshold; // Payloads of this size or more get compressed (0: disabled)
+    int intern;                // Share a single copy of identical payloads
+    size_t spill;              // Undelivered messages kept in RAM before spilling to disk (0: disabled)
+    size_t offload;            // Delivered payloads of this size or more go to the payload log (0: disabled)
+    uint32_t lease;            // Visibility timeout of delivered messages, in milliseconds (0: disabled)
+    int lease_auto;            // Learn the visibility timeout from the pop to ack latencies instead
+    double lease_percentile;   // Percentile of those latencies an AUTO lease is based on
+    double lease_factor;       // Times that percentile an AUTO lease lasts
+    uint32_t backoff;          // Delay of a RQ.NACK BACKOFF after the first delivery, doubled after every other one (ms)
+    uint32_t backoff_max;      // Longest delay of a RQ.NACK BACKOFF (ms)
+    uint32_t max_deliveries;   // Deliveries after which messages go to the dead-letter queue (0: no limit)
+    char deadletter[SETTINGS_VALUE_MAX]; // Key of the dead-letter queue ("": none)
+} rq_settings_t;
+
+/* Sets the default value of every setting */
+void settingsInit(rq_settings_t *settings);
+
+/* Sets the named setting (case insensitive) from its textual value.
+ * Returns REDISMODULE_ERR if the name is unknown or the value is not valid. */
+int settingsSet(rq_settings_t *settings, const char *name, const char *value);
+
+/* Settings are listed by position, from 0 to settingsCount() - 1 */
+int settingsCount(void);
+const char *settingsName(int i);
+
+/* Writes the textual value of the i-th setting into "buf" */
+void settingsFormat(const rq_settings_t *settings, int i, char *buf, size_t size);
+
+#endif
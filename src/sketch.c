@@ -0,0 +1,64 @@
+#include "./sketch.h"
+
+#define SKETCH_SUB (1 << SKETCH_SUB_BITS)
+
+static uint32_t sketchBucket(uint64_t value){
+	int exp;
+
+	if(value > UINT32_MAX){
+		value = UINT32_MAX;
+	}
+	if(value < SKETCH_SUB){
+		return value;
+	}
+
+	exp = 63 - __builtin_clzll(value);
+	return ((exp - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) + ((value >> (exp - SKETCH_SUB_BITS)) & (SKETCH_SUB - 1));
+}
+
+/* Largest value counted in the bucket */
+static uint64_t sketchBucketMax(uint32_t bucket){
+	int shift;
+
+	if(bucket < SKETCH_SUB){
+		return bucket;
+	}
+
+	shift = (bucket >> SKETCH_SUB_BITS) - 1;
+	return ((uint64_t) (SKETCH_SUB + (bucket & (SKETCH_SUB - 1)) + 1) << shift) - 1;
+}
+
+void sketchAdd(sketch_t *sketch, uint64_t value){
+	sketch->counts[sketchBucket(value)] += 1;
+	sketch->total += 1;
+	sketch->samples += 1;
+
+	if(sketch->total >= SKETCH_DECAY){
+		sketch->total = 0;
+		for(uint32_t i = 0; i < SKETCH_BUCKETS; i++){
+			sketch->counts[i] >>= 1;
+			sketch->total += sketch->counts[i];
+		}
+	}
+}
+
+uint64_t sketchQuantile(const sketch_t *sketch, double q){
+	uint64_t rank = q * sketch->total, seen = 0;
+
+	if(sketch->total == 0){
+		return 0;
+	}
+	// Rounded up, so the q-quantile of a single value is that value
+	if(rank < q * sketch->total || rank == 0){
+		rank += 1;
+	}
+
+	for(uint32_t i = 0; i < SKETCH_BUCKETS; i++){
+		seen += sketch->counts[i];
+		if(seen >= rank){
+			return sketchBucketMax(i);
+		}
+	}
+
+	return sketchBucketMax(SKETCH_BUCKETS - 1);
+}
@@ -0,0 +1,30 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stdint.h>
+
+#define SKETCH_SUB_BITS 3 /* Buckets per power of two: 1 << SKETCH_SUB_BITS, for a relative error under 1/8 */
+#define SKETCH_BUCKETS ((32 - SKETCH_SUB_BITS + 1) << SKETCH_SUB_BITS) /* Values up to UINT32_MAX */
+#define SKETCH_DECAY 8192 /* Counts are halved once they add up to this, so old samples fade away */
+
+/**
+ * Streaming quantile sketch of non-negative values: a log-linear histogram,
+ * with exact buckets for the smallest values, and then (1 << SKETCH_SUB_BITS)
+ * buckets for every power of two. It takes constant space whatever the number
+ * of values added, and halving its counts every SKETCH_DECAY values makes it
+ * follow the recent ones.
+ */
+typedef struct sketch_t {
+    uint64_t samples; // Values ever added
+    uint32_t total;   // Sum of "counts"
+    uint32_t counts[SKETCH_BUCKETS];
+} sketch_t;
+
+/* Adds a value (larger ones are counted as UINT32_MAX) */
+void sketchAdd(sketch_t *sketch, uint64_t value);
+
+/* Returns the upper bound of the bucket holding the q-quantile (0 < q <= 1)
+ * of the values, or 0 if there are none */
+uint64_t sketchQuantile(const sketch_t *sketch, double q);
+
+#endif
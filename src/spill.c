@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "./rqueue.h"
+
+/* Header of a spilled segment. It's followed by "count" messages, each one as
+ * its ID (ms and seq), its number of deliveries (requeued messages have been
+ * delivered before) and its payload, length-prefixed as in payload chunks. */
+typedef struct spill_record_t {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t size; // Bytes of messages following the header
+} spill_record_t;
+
+#define SPILL_MSG_HEADER (2 * sizeof(uint64_t) + sizeof(uint32_t)) /* ID and deliveries of a spilled message */
+
+static unsigned long long files_created = 0; // For unique file names
+static int spill_failing = 0; // Set after an error, so only the first one gets logged
+
+void spillError(const char *what){
+	if(!spill_failing){
+		RedisModule_Log(NULL, "warning", "Can't use the spill directory '%s' (%s): %s",
+			rq_config.spill_dir, what, strerror(errno));
+		spill_failing = 1;
+	}
+}
+
+int spillCreateFile(const char *kind, int flags){
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/rq-%s-%d-%llu",
+		rq_config.spill_dir, kind, (int) getpid(), ++files_created);
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|flags, 0600);
+	if(fd == -1){
+		spillError("open");
+		return -1;
+	}
+	unlink(path);
+
+	return fd;
+}
+
+static spill_file_t *spillOpenFile(rqueue_t *rqueue){
+	spill_file_t *file;
+	int fd;
+
+	if((fd = spillCreateFile("spill", O_APPEND)) == -1){
+		return NULL;
+	}
+
+	file = RedisModule_Alloc(sizeof(*file));
+	file->next = NULL;
+	file->fd = fd;
+	file->write_off = 0;
+	file->read_off = 0;
+	rqueue->memory_used += sizeof(*file);
+
+	return file;
+}
+
+static void spillCloseFile(rqueue_t *rqueue, spill_file_t *file){
+	close(file->fd);
+	RedisModule_Free(file);
+	rqueue->memory_used -= sizeof(*file);
+}
+
+/* Appends the live messages of "seg" as a new record of the spill. Returns 0
+ * if the segment couldn't be written: the spill is left as it was. */
+static int spillWriteSegment(rqueue_t *rqueue, spill_t *spill, msg_segment_t *seg){
+	spill_file_t *file = spill->last;
+	spill_record_t rec = { SPILL_RECORD_MAGIC, 0, 0 };
+	const char *data;
+	char *buf, *p, *plain;
+	size_t len;
+	uint32_t len32;
+	ssize_t written;
+
+	for(uint32_t i = seg->head; i < seg->tail; i++){
+		if(segmentIsLive(seg, i)){
+			rec.count += 1;
+			rec.size += SPILL_MSG_HEADER + sizeof(len32) + payloadSize(&seg->payload[i]);
+		}
+	}
+
+	// Records are read back into a payload chunk, with 32 bit offsets
+	if(rec.size > UINT32_MAX){
+		return 0;
+	}
+
+	if(file == NULL || file->write_off >= SPILL_FILE_SIZE){
+		if((file = spillOpenFile(rqueue)) == NULL){
+			return 0;
+		}
+		if(spill->last){
+			spill->last->next = file;
+		} else {
+			spill->first = file;
+		}
+		spill->last = file;
+	}
+
+	p = buf = RedisModule_Alloc(sizeof(rec) + rec.size);
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	for(uint32_t i = seg->head; i < seg->tail; i++){
+		if(!segmentIsLive(seg, i)){
+			continue;
+		}
+		if((data = payloadBytes(rqueue, &seg->payload[i], &len, &plain)) == NULL){
+			RedisModule_Free(buf);
+			return 0;
+		}
+		len32 = len;
+		memcpy(p, &seg->ms[i], sizeof(uint64_t));
+		memcpy(p + sizeof(uint64_t), &seg->seq[i], sizeof(uint64_t));
+		memcpy(p + 2 * sizeof(uint64_t), &seg->deliveries[i], sizeof(uint32_t));
+		memcpy(p + SPILL_MSG_HEADER, &len32, sizeof(len32));
+		memcpy(p + SPILL_MSG_HEADER + sizeof(len32), data, len);
+		p += SPILL_MSG_HEADER + sizeof(len32) + len;
+		if(plain){
+			RedisModule_Free(plain);
+		}
+	}
+
+	written = write(file->fd, buf, sizeof(rec) + rec.size);
+	RedisModule_Free(buf);
+	if(written != (ssize_t) (sizeof(rec) + rec.size)){
+		if(written >= 0){
+			errno = ENOSPC;
+		}
+		spillError("write");
+		// Drop any partial record
+		if(ftruncate(file->fd, file->write_off) == -1){
+			RedisModule_Log(NULL, "warning", "Can't truncate spill file: %s", strerror(errno));
+		}
+		return 0;
+	}
+
+	file->write_off += sizeof(rec) + rec.size;
+	spill->messages += rec.count;
+	spill->bytes += sizeof(rec) + rec.size;
+	rqueue->stats.spill_writes += 1;
+	rqueue->stats.spill_bytes_written += sizeof(rec) + rec.size;
+	spill_failing = 0;
+
+	return 1;
+}
+
+void spillCheck(rqueue_t *rqueue){
+	queue_t *queue = &rqueue->undelivered;
+	spill_t *spill = queue->spill;
+	uint64_t ram = queue->len - (spill ? spill->messages : 0);
+	size_t limit = rqueue->settings.spill;
+	int pressure = (
+		rq_config.spill_memory_ratio > 0 &&
+		RedisModule_GetUsedMemoryRatio() >= rq_config.spill_memory_ratio
+	);
+	msg_segment_t *seg, *next;
+
+	if(!pressure && (limit == 0 || ram <= limit)){
+		return;
+	}
+
+	// Cold segments start after the head ones (only the first one, if nothing
+	// was spilled yet), and end before the tail one
+	seg = spill ? spill->next : (queue->first ? queue->first->next : NULL);
+	if(seg == NULL || seg == queue->last){
+		return;
+	}
+
+	if(spill == NULL){
+		spill = queue->spill = RedisModule_Calloc(1, sizeof(*spill));
+		rqueue->memory_used += sizeof(*spill);
+	}
+
+	while(seg != queue->last && (pressure || ram > limit)){
+		if(!spillWriteSegment(rqueue, spill, seg)){
+			break;
+		}
+
+		for(uint32_t i = seg->head; i < seg->tail; i++){
+			if(segmentIsLive(seg, i)){
+				payloadRelease(rqueue, &seg->payload[i]);
+			}
+		}
+		ram -= seg->live;
+		next = seg->next;
+		queueUnlinkSegment(rqueue, queue, seg);
+		seg = next;
+	}
+
+	spill->next = seg;
+	if(spill->messages == 0){
+		spillFree(rqueue, queue);
+	}
+}
+
+/* Reads the record at "off" of the file, returning its messages as the data of
+ * a payload chunk (to be freed by the caller), or NULL on errors */
+static payload_chunk_t *spillReadRecord(const spill_file_t *file, uint64_t off, spill_record_t *rec){
+	payload_chunk_t *body;
+	uint64_t at = 0;
+	uint32_t len32;
+
+	if(
+		pread(file->fd, rec, sizeof(*rec), off) != sizeof(*rec) ||
+		rec->magic != SPILL_RECORD_MAGIC ||
+		rec->size > UINT32_MAX ||
+		off + sizeof(*rec) + rec->size > file->write_off
+	){
+		return NULL;
+	}
+
+	body = RedisModule_Alloc(sizeof(*body) + rec->size);
+	body->refs = 1;
+	body->used = body->size = body->live = rec->size;
+	if(pread(file->fd, body->data, rec->size, off + sizeof(*rec)) != (ssize_t) rec->size){
+		RedisModule_Free(body);
+		return NULL;
+	}
+
+	// Check every message lies within the record
+	for(uint32_t i = 0; i < rec->count; i++){
+		if(at + SPILL_MSG_HEADER + sizeof(len32) > rec->size){
+			RedisModule_Free(body);
+			return NULL;
+		}
+		memcpy(&len32, body->data + at + SPILL_MSG_HEADER, sizeof(len32));
+		at += SPILL_MSG_HEADER + sizeof(len32) + len32;
+		if(at > rec->size){
+			RedisModule_Free(body);
+			return NULL;
+		}
+	}
+
+	return body;
+}
+
+/* Decodes the message at "*at" of a record body into the slot "pos" of "seg",
+ * and moves "at" to the next message. The payload is left in the body: it's
+ * up to the caller to keep it there, or copy it. */
+static void spillDecode(payload_chunk_t *body, uint32_t *at, msg_segment_t *seg, uint32_t pos){
+	payload_t *p = &seg->payload[pos];
+	uint32_t len32;
+
+	memcpy(&seg->ms[pos], body->data + *at, sizeof(uint64_t));
+	memcpy(&seg->seq[pos], body->data + *at + sizeof(uint64_t), sizeof(uint64_t));
+	memcpy(&len32, body->data + *at + SPILL_MSG_HEADER, sizeof(len32));
+	memcpy(&seg->deliveries[pos], body->data + *at + 2 * sizeof(uint64_t), sizeof(uint32_t));
+	seg->lastDelivery[pos] = 0;
+	seg->batch[pos] = 0;
+	seg->extend[pos] = 0;
+	seg->lease[pos] = 0;
+
+	p->ref = body;
+	p->off = *at + SPILL_MSG_HEADER;
+	p->len = len32;
+	p->enc = PAYLOAD_ENC_INLINE;
+
+	*at += SPILL_MSG_HEADER + sizeof(len32) + len32;
+}
+
+void spillRestore(rqueue_t *rqueue, queue_t *queue){
+	spill_t *spill = queue->spill;
+	spill_file_t *file = spill->first;
+	long long start = ustime(), elapsed;
+	payload_chunk_t *body;
+	spill_record_t rec;
+	msg_segment_t *seg;
+	const char *buf;
+	size_t len;
+	uint32_t at = 0;
+
+	if(file == NULL || (body = spillReadRecord(file, file->read_off, &rec)) == NULL){
+		// Nothing else can be located on disk past a bad record
+		RedisModule_Log(NULL, "warning", "Can't read spilled messages back (%s): %llu messages lost",
+			file ? strerror(errno) : "no file", (unsigned long long) spill->messages);
+		queue->len -= spill->messages;
+		spillFree(rqueue, queue);
+		return;
+	}
+
+	seg = queueInsertSegment(rqueue, queue, spill->next);
+	for(uint32_t i = 0; i < rec.count; i++){
+		spillDecode(body, &at, seg, i);
+		buf = payloadPtr(&seg->payload[i], &len);
+		payloadStoreBuffer(rqueue, &seg->payload[i], buf, len);
+	}
+	seg->tail = seg->live = rec.count;
+	RedisModule_Free(body);
+
+	file->read_off += sizeof(rec) + rec.size;
+	spill->messages -= rec.count;
+	spill->bytes -= sizeof(rec) + rec.size;
+
+	// Fully read files are done with, but the one still open for appends
+	if(file->read_off == file->write_off && (file != spill->last || spill->messages == 0)){
+		spill->first = file->next;
+		if(spill->last == file){
+			spill->last = NULL;
+		}
+		spillCloseFile(rqueue, file);
+	}
+
+	elapsed = ustime() - start;
+	rqueue->stats.spill_reads += 1;
+	rqueue->stats.spill_read_us += elapsed;
+	if(elapsed > (long long) rqueue->stats.spill_read_max_us){
+		rqueue->stats.spill_read_max_us = elapsed;
+	}
+
+	if(spill->messages == 0){
+		spillFree(rqueue, queue);
+	}
+}
+
+void spillFree(rqueue_t *rqueue, queue_t *queue){
+	spill_t *spill = queue->spill;
+	spill_file_t *file, *next;
+
+	for(file = spill->first; file; file = next){
+		next = file->next;
+		spillCloseFile(rqueue, file);
+	}
+
+	RedisModule_Free(spill);
+	rqueue->memory_used -= sizeof(*spill);
+	queue->spill = NULL;
+}
+
+void spillCursorStart(const spill_t *spill, spill_cursor_t *cur){
+	cur->file = spill->first;
+	cur->off = cur->file ? cur->file->read_off : 0;
+}
+
+/* Moves the cursor past fully read files. Returns 0 at the end of the spill. */
+static int spillCursorSeek(spill_cursor_t *cur){
+	while(cur->file && cur->off >= cur->file->write_off){
+		cur->file = cur->file->next;
+		cur->off = cur->file ? cur->file->read_off : 0;
+	}
+
+	return cur->file != NULL;
+}
+
+int spillCursorRead(spill_cursor_t *cur, msg_segment_t *seg, payload_chunk_t **body){
+	spill_record_t rec;
+	payload_chunk_t *read;
+	uint32_t at = 0;
+
+	if(!spillCursorSeek(cur) || (read = spillReadRecord(cur->file, cur->off, &rec)) == NULL){
+		return 0;
+	}
+
+	if(*body){
+		RedisModule_Free(*body);
+	}
+	*body = read;
+
+	seg->prev = seg->next = NULL;
+	seg->freed = 0;
+	seg->head = 0;
+	seg->tail = seg->live = rec.count;
+	for(uint32_t i = 0; i < rec.count; i++){
+		spillDecode(read, &at, seg, i);
+	}
+
+	cur->off += sizeof(rec) + rec.size;
+	return 1;
+}
+
+uint32_t spillCursorSkip(spill_cursor_t *cur, uint64_t max){
+	spill_record_t rec;
+
+	if(
+		!spillCursorSeek(cur) ||
+		pread(cur->file->fd, &rec, sizeof(rec), cur->off) != sizeof(rec) ||
+		rec.magic != SPILL_RECORD_MAGIC ||
+		rec.count > max
+	){
+		return 0;
+	}
+
+	cur->off += sizeof(rec) + rec.size;
+	return rec.count;
+}
@@ -0,0 +1,79 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <stdint.h>
+#define REDISMODULE_EXPERIMENTAL_API
+#include "../redismodule.h"
+
+#define SPILL_FILE_SIZE (64 * 1024 * 1024) /* Start a new file once this size is reached */
+#define SPILL_RECORD_MAGIC 0x32535152      /* "RQS2" */
+
+struct rqueue_t;
+struct queue_t;
+struct msg_segment_t;
+struct payload_chunk_t;
+
+/**
+ * An append-only file holding spilled segments, one record each. Files are
+ * unlinked as soon as they're created: they go away with the last descriptor,
+ * even after a crash. Spilled messages are persisted by the RDB, not by them.
+ */
+typedef struct spill_file_t {
+    struct spill_file_t *next;
+    int fd;
+    uint64_t write_off; // Bytes written
+    uint64_t read_off;  // Bytes already restored into RAM
+} spill_file_t;
+
+/**
+ * The cold middle of an undelivered queue, kept on disk. The queue segments
+ * before "next" are older than the spilled ones, and "next" onwards newer.
+ */
+typedef struct spill_t {
+    spill_file_t *first; // Oldest file, the next record to restore is at its "read_off"
+    spill_file_t *last;  // File open for appends
+    struct msg_segment_t *next; // First segment in RAM after the spilled ones
+    uint64_t messages;   // Messages on disk
+    uint64_t bytes;      // Bytes on disk not restored yet
+} spill_t;
+
+/* Position of a record, to read spilled messages without restoring them */
+typedef struct spill_cursor_t {
+    spill_file_t *file;
+    uint64_t off;
+} spill_cursor_t;
+
+/* Creates a new file in SPILL_DIR, open for reading and writing with the
+ * given extra open() flags, and unlinks it right away. The name starts with
+ * "rq-<kind>". Returns its descriptor, or -1 on errors (logged). */
+int spillCreateFile(const char *kind, int flags);
+
+/* Logs an error with a file in SPILL_DIR, unless the previous attempt to use
+ * one failed too */
+void spillError(const char *what);
+
+/* Writes the cold segments of the undelivered queue to disk, if the queue
+ * has more messages in RAM than allowed by its SPILL setting, or the used
+ * memory is above SPILL_MEMORY_RATIO. The head and tail segments are kept. */
+void spillCheck(struct rqueue_t *rqueue);
+
+/* Reads the oldest spilled segment back into RAM, before "spill->next". Frees
+ * the spill once nothing is left on disk. */
+void spillRestore(struct rqueue_t *rqueue, struct queue_t *queue);
+
+/* Drops the spilled messages, closing their files */
+void spillFree(struct rqueue_t *rqueue, struct queue_t *queue);
+
+/* Points the cursor at the oldest spilled record */
+void spillCursorStart(const spill_t *spill, spill_cursor_t *cur);
+
+/* Decodes the record at the cursor into "seg", with inline payloads held by
+ * "*body" (replaced, and to be freed by the caller), and moves to the next
+ * record. Returns 0 at the end of the spill, or on read errors. */
+int spillCursorRead(spill_cursor_t *cur, struct msg_segment_t *seg, struct payload_chunk_t **body);
+
+/* Moves the cursor past the next record without reading it, if it holds "max"
+ * messages or less. Returns the messages skipped, or 0 if it was not skipped. */
+uint32_t spillCursorSkip(spill_cursor_t *cur, uint64_t max);
+
+#endif
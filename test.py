@@ -1,16 +1,35 @@
+"""
+Integration tests of the module, run against a Redis server that has it loaded:
+
+    redis-server --loadmodule ./bin/redisrq.so
+    python test.py [ -v ] [ <TestCase>[.<test>] ... ]
+
+REDIS_HOST and REDIS_PORT select the server (127.0.0.1:6379 by default). Every
+test starts by flushing it, and some of them run DEBUG RELOAD.
+
+"python test.py load" runs the producer/consumer load demo instead, and
+"python test.py bench [ <ops> ]" the RQ.EXEC benchmark.
+"""
+import os
 import sys
 import time
 import string
+import struct
 import random
 import asyncio
+import threading
+import unittest
 import redis
 
+HOST = os.environ.get('REDIS_HOST', '127.0.0.1')
+PORT = int(os.environ.get('REDIS_PORT', 6379))
+
 def randstr(chars=string.ascii_uppercase + string.digits, minsize=100, maxsize=200):
     return ''.join(random.choice(chars) for _ in range(random.randint(minsize, maxsize)))
 
 r = redis.Redis(
-    host='127.0.0.1',
-    port=6379
+    host=HOST,
+    port=PORT
 )
 
 def produce(keys, total):
@@ -84,4 +103,1087 @@ async def main():
     print(f"finished at {time.strftime('%X')}")
     #print(f"Produce {sys.argv[1]} jobs per second during {sys.argv[2]} seconds")
 
-asyncio.run(main())
+
+def exec_op(code, k, arg):
+    """Packs an operation of RQ.EXEC against its k-th key"""
+    return struct.pack("<BH", code, k) + arg
+
+def exec_id(id):
+    """Packs a message ID as the argument of RQ.EXEC operations"""
+    ms, seq = id.split(b'-')
+    return struct.pack(">QQ", int(ms), int(seq))
+
+def bench(ops):
+    """Pushes and acknowledges "ops" messages (a worker acking what it popped
+    and pushing follow-up jobs), one command at a time, pipelined, and with a
+    single RQ.EXEC, and prints the operations per second of each"""
+    key = "rq-bench"
+    payload = b'x' * 64
+
+    def popped():
+        r.delete(key)
+        r.execute_command("RQ.PUSHEX", key, "RANGE", "PAYLOADS", *[ payload ] * ops)
+        return [ m[1] for m in r.execute_command("RQ.POP", "COUNT", ops, key) ]
+
+    def run(name, fn):
+        ids = popped()
+        start = time.perf_counter()
+        fn(ids)
+        elapsed = time.perf_counter() - start
+        print(f"{name:>10}: {2 * ops / elapsed:12.0f} ops/s")
+
+    def single(ids):
+        for id in ids:
+            r.execute_command("RQ.ACK", key, id)
+            r.execute_command("RQ.PUSH", key, payload)
+
+    def pipelined(ids):
+        pipe = r.pipeline(transaction=False)
+        for id in ids:
+            pipe.execute_command("RQ.ACK", key, id)
+            pipe.execute_command("RQ.PUSH", key, payload)
+        pipe.execute()
+
+    def exec_(ids):
+        ops = b''.join(exec_op(2, 0, exec_id(id)) + exec_op(1, 0, struct.pack("<I", len(payload)) + payload) for id in ids)
+        r.execute_command("RQ.EXEC", 1, key, ops)
+
+    run("single", single)
+    run("pipelined", pipelined)
+    run("exec", exec_)
+    r.delete(key)
+
+
+class RQTestCase(unittest.TestCase):
+    def setUp(self):
+        self.r = redis.Redis(host=HOST, port=PORT)
+        self.r.flushall()
+
+    def tearDown(self):
+        self.r.close()
+
+    def rq(self, *args):
+        return self.r.execute_command(*args)
+
+    def info(self, key):
+        reply = self.rq("RQ.INFO", key)
+        return { reply[i].decode(): reply[i + 1] for i in range(0, len(reply), 2) }
+
+    def pending(self, key):
+        return [ m[0] for m in self.rq("RQ.INSPECT", key, "PENDING", 0, 1000000) ]
+
+    def undelivered(self, key):
+        return self.rq("RQ.INSPECT", key, 0, 1000000)
+
+    @staticmethod
+    def msgid(id):
+        ms, seq = id.split(b'-')
+        return (int(ms), int(seq))
+
+    def reload(self):
+        self.assertEqual(self.rq("DEBUG", "RELOAD"), b'OK')
+
+    def command(self, *args):
+        """Runs a COMMAND subcommand, bypassing the parsing of its reply by redis-py"""
+        conn = redis.Connection(host=HOST, port=PORT)
+        try:
+            conn.send_command("COMMAND", *args)
+            return conn.read_response()
+        finally:
+            conn.disconnect()
+
+    def later(self, delay, *args):
+        """Runs a command from another connection after "delay" seconds"""
+        def run():
+            time.sleep(delay)
+            other = redis.Redis(host=HOST, port=PORT)
+            other.execute_command(*args)
+            other.close()
+        thread = threading.Thread(target=run)
+        thread.start()
+        self.addCleanup(thread.join)
+
+
+class AckPopTest(RQTestCase):
+    def test_ack_then_pop(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b", "c")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        acked, popped = self.rq("RQ.ACKPOP", "q", ids[0], b'0-0', "POP", "COUNT", 2, "q")
+        self.assertEqual(acked, [ ids[0] ])
+        self.assertEqual(popped, [ [ b'q', ids[1], b'b' ], [ b'q', ids[2], b'c' ] ])
+        self.assertEqual(self.pending("q"), ids[1:])
+
+    def test_pops_from_other_queues(self):
+        self.rq("RQ.PUSH", "q1", "a")
+        self.rq("RQ.PUSH", "q2", "b")
+        ids = self.rq("RQ.POP", "COUNT", 1, "q1")
+        acked, popped = self.rq("RQ.ACKPOP", "q1", ids[0][1], "POP", "COUNT", 5, "q1", "q2")
+        self.assertEqual(acked, [ ids[0][1] ])
+        self.assertEqual([ m[0] for m in popped ], [ b'q2' ])
+
+    def test_wrong_type_acks_nothing(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.r.set("str", "x")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.ACKPOP", "q", ids[0], "POP", "COUNT", 1, "str")
+        self.assertEqual(self.pending("q"), ids)
+
+    def test_blocking_wakeup(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.later(0.2, "RQ.PUSH", "q", "b")
+        start = time.time()
+        acked, popped = self.rq("RQ.ACKPOP", "q", ids[0], "POP", "COUNT", 1, "BLOCK", 5000, "q")
+        self.assertLess(time.time() - start, 4)
+        self.assertEqual(acked, ids)
+        self.assertEqual([ m[2] for m in popped ], [ b'b' ])
+
+    def test_blocking_timeout(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        acked, popped = self.rq("RQ.ACKPOP", "q", ids[0], "POP", "COUNT", 1, "BLOCK", 100, "q")
+        # Acknowledged right away, even if nothing gets popped
+        self.assertEqual(acked, ids)
+        self.assertIsNone(popped)
+        self.assertEqual(self.pending("q"), [])
+
+
+class AckTest(RQTestCase):
+    def test_ack_any_order(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b", "c", "d")
+        self.rq("RQ.POP", "COUNT", 4, "q")
+        self.assertEqual(self.rq("RQ.ACK", "q", ids[2], ids[0]), [ ids[2], ids[0] ])
+        self.assertEqual(self.pending("q"), [ ids[1], ids[3] ])
+
+    def test_ack_unknown_ids(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        # Undelivered, malformed and already acknowledged IDs are ignored
+        self.assertEqual(self.rq("RQ.ACK", "q", ids[1], "nope", ids[0], ids[0]), [ ids[0] ])
+        self.assertIsNone(self.rq("RQ.ACK", "missing", ids[0]))
+
+    def test_index_after_reload(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b", "c")
+        self.rq("RQ.POP", "COUNT", 3, "q")
+        self.reload()
+        self.assertEqual(self.rq("RQ.ACK", "q", ids[1]), [ ids[1] ])
+        self.assertEqual(self.pending("q"), [ ids[0], ids[2] ])
+        # New IDs keep growing past the loaded ones
+        self.assertGreater(self.msgid(self.rq("RQ.PUSH", "q", "d")[0]), self.msgid(ids[2]))
+
+
+class SegmentTest(RQTestCase):
+    def test_fifo_across_segments(self):
+        payloads = [ str(i) for i in range(300) ]
+        ids = self.rq("RQ.PUSH", "q", *payloads)
+        popped = self.rq("RQ.POP", "COUNT", 1000, "q")
+        self.assertEqual([ m[1] for m in popped ], ids)
+        self.assertEqual([ m[2].decode() for m in popped ], payloads)
+
+    def test_inspect_across_segments(self):
+        ids = self.rq("RQ.PUSH", "q", *range(200))
+        self.assertEqual([ m[0] for m in self.rq("RQ.INSPECT", "q", 63, 3) ], ids[63:66])
+        self.assertEqual([ m[0] for m in self.rq("RQ.INSPECT", "q", -2, 5) ], ids[-2:])
+        self.assertEqual(self.rq("RQ.INSPECT", "q", 200, 1), [])
+
+    def test_memory_released(self):
+        ids = self.rq("RQ.PUSH", "q", *range(500))
+        self.rq("RQ.POP", "COUNT", 1000, "q")
+        full = self.r.memory_usage("q")
+        # Emptied segments are freed as the head of the queue gets to them
+        self.rq("RQ.ACK", "q", *ids)
+        self.assertLess(self.r.memory_usage("q"), full / 4)
+
+
+class InlinePayloadTest(RQTestCase):
+    SIZES = [ 0, 1, 127, 128, 129, 1000, 5000 ]
+
+    def payloads(self):
+        return [ bytes(random.getrandbits(8) for _ in range(n)) for n in self.SIZES ]
+
+    def test_round_trip(self):
+        payloads = self.payloads()
+        self.rq("RQ.PUSH", "q", *payloads)
+        self.assertEqual([ m[2] for m in self.rq("RQ.POP", "COUNT", 100, "q") ], payloads)
+
+    def test_rdb_round_trip(self):
+        payloads = self.payloads()
+        self.rq("RQ.PUSH", "q", *payloads)
+        self.rq("RQ.POP", "COUNT", 3, "q")
+        self.reload()
+        self.assertEqual([ m[1] for m in self.rq("RQ.INSPECT", "q", "PENDING", 0, 100) ], payloads[:3])
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], payloads[3:])
+
+
+class CompactTest(RQTestCase):
+    def sparse(self, keep, *then):
+        """Pops 64 segments worth of messages, and acknowledges all of them
+        but the ones at the positions "keep" picks. The "then" commands run
+        right after, before the background compaction gets a chance to."""
+        ids = self.rq("RQ.PUSH", "q", *range(64 * 64))
+        self.rq("RQ.POP", "COUNT", len(ids), "q")
+        kept = [ id for i, id in enumerate(ids) if keep(i) ]
+        pipe = self.r.pipeline(transaction=True)
+        pipe.execute_command("RQ.ACK", "q", *[ id for i, id in enumerate(ids) if not keep(i) ])
+        for args in then:
+            pipe.execute_command(*args)
+        return kept, pipe.execute()[1:]
+
+    def test_compact_command(self):
+        kept, (before, stats) = self.sparse(lambda i: i % 16 == 0, ("MEMORY", "USAGE", "q"), ("RQ.COMPACT", "q"))
+        self.assertEqual(stats[0::2], [ b'segments_freed', b'messages_moved', b'payloads_moved' ])
+        self.assertGreater(stats[1], 0)
+        self.assertLess(self.r.memory_usage("q"), before)
+        # Moved messages are still indexed
+        self.assertEqual(self.pending("q"), kept)
+        self.assertEqual(len(self.rq("RQ.ACK", "q", *kept)), len(kept))
+
+    def test_background_compaction(self):
+        kept, (before, ) = self.sparse(lambda i: i == 0 or i == 64 * 64 - 1, ("MEMORY", "USAGE", "q"))
+        time.sleep(0.5)
+        self.assertLess(self.r.memory_usage("q"), before / 4)
+        self.assertEqual(self.rq("RQ.COMPACT", "q")[1], 0)
+        self.assertEqual(self.pending("q"), kept)
+
+    def test_background_compaction_after_offload(self):
+        ids = self.rq("RQ.PUSH", "q", *range(64 * 64))
+        self.rq("RQ.POP", "COUNT", len(ids), "q")
+        self.rq("RQ.CONFIG", "q", "offload", 100)
+        self.rq("RQ.PUSH", "q", b'x' * 200)
+        # The pop schedules an offload pass of its own segment only
+        pipe = self.r.pipeline(transaction=True)
+        pipe.execute_command("RQ.POP", "COUNT", 1, "q")
+        pipe.execute_command("RQ.ACK", "q", *ids[1:-1])
+        pipe.execute_command("MEMORY", "USAGE", "q")
+        before = pipe.execute()[2]
+        time.sleep(0.5)
+        self.assertLess(self.r.memory_usage("q"), before / 4)
+        self.assertEqual(self.info("q")["offloaded_payloads"], 1)
+
+    def test_compact_missing_key(self):
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.COMPACT", "missing")
+
+
+class RemovedBitmapTest(RQTestCase):
+    def test_holes_are_skipped(self):
+        ids = self.rq("RQ.PUSH", "q", *range(100))
+        self.rq("RQ.POP", "COUNT", 100, "q")
+        self.rq("RQ.ACK", "q", *ids[1::2])
+        self.assertEqual(self.pending("q"), ids[0::2])
+        self.assertEqual([ m[0] for m in self.rq("RQ.INSPECT", "q", "PENDING", 10, 3) ], ids[20:26:2])
+
+    def test_head_moves_past_holes(self):
+        ids = self.rq("RQ.PUSH", "q", *range(10))
+        self.rq("RQ.POP", "COUNT", 10, "q")
+        self.rq("RQ.ACK", "q", *ids[1:5])
+        self.rq("RQ.ACK", "q", ids[0])
+        self.assertEqual(self.pending("q"), ids[5:])
+        self.assertEqual(self.info("q")["delivered"], 5)
+
+
+class ScanTest(RQTestCase):
+    def test_ack_scans_segments(self):
+        ids = self.rq("RQ.PUSH", "q", *range(1000))
+        self.rq("RQ.POP", "COUNT", 1000, "q")
+        picked = random.sample(ids, 100)
+        self.assertEqual(sorted(self.rq("RQ.ACK", "q", *picked)), sorted(picked))
+        self.assertEqual(self.info("q")["delivered"], 900)
+
+    def test_recover_expired_run(self):
+        ids = self.rq("RQ.PUSH", "q", *range(150))
+        self.rq("RQ.POP", "COUNT", 100, "q")
+        time.sleep(0.05)
+        self.rq("RQ.POP", "COUNT", 50, "q")
+        # Only the ones popped first have been pending for long enough
+        recovered = self.rq("RQ.RECOVER", "q", 1000, 40)
+        self.assertEqual([ m[0] for m in recovered ], ids[:100])
+        self.assertEqual(self.pending("q"), ids[100:] + ids[:100])
+
+
+class CompressTest(RQTestCase):
+    LARGE = b'compressible ' * 100
+
+    def test_compressed_round_trip(self):
+        self.assertEqual(self.rq("RQ.CONFIG", "q", "compress", 512), b'OK')
+        self.rq("RQ.PUSH", "q", self.LARGE, b'short', os.urandom(1000))
+        info = self.info("q")
+        # Random bytes don't shrink enough to be kept compressed
+        self.assertEqual(info["compressed_payloads"], 1)
+        self.assertLess(info["compressed_bytes_out"], info["compressed_bytes_in"])
+        popped = self.rq("RQ.POP", "COUNT", 3, "q")
+        self.assertEqual(popped[0][2], self.LARGE)
+        self.assertEqual(popped[1][2], b'short')
+
+    def test_settings_rdb_round_trip(self):
+        self.rq("RQ.CONFIG", "q", "compress", 512)
+        self.rq("RQ.PUSH", "q", self.LARGE)
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.rq("RQ.PUSH", "q", self.LARGE)
+        self.reload()
+        config = self.rq("RQ.CONFIG", "q")
+        self.assertEqual(config[config.index(b'compress') + 1], b'512')
+        # Loaded payloads get compressed again
+        self.assertEqual(self.info("q")["compressed_payloads"], 2)
+        self.assertEqual(self.rq("RQ.INSPECT", "q", "PENDING", 0, 1)[0][1], self.LARGE)
+        self.assertEqual(self.undelivered("q")[0][1], self.LARGE)
+
+    def test_config_errors(self):
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.CONFIG", "q", "compress", -1)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.CONFIG", "q", "nope", 1)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.CONFIG", "missing")
+        self.assertEqual(self.r.exists("q"), 0)
+
+
+class InternTest(RQTestCase):
+    PAYLOAD = b'same payload ' * 20
+
+    def test_duplicates_shared(self):
+        self.rq("RQ.CONFIG", "q1", "intern", 1)
+        self.rq("RQ.CONFIG", "q2", "intern", 1)
+        self.rq("RQ.PUSH", "q1", self.PAYLOAD, self.PAYLOAD)
+        self.rq("RQ.PUSH", "q2", self.PAYLOAD, b'other')
+        info = self.info("q2")
+        self.assertEqual(self.info("q1")["intern_misses"], 1)
+        self.assertEqual(info["intern_hits"], 1)
+        self.assertEqual(info["intern_bytes_saved"], len(self.PAYLOAD))
+        self.assertEqual(info["interned_payloads"], 2)
+        self.assertEqual([ m[2] for m in self.rq("RQ.POP", "COUNT", 2, "q2") ], [ self.PAYLOAD, b'other' ])
+
+    def test_released_with_last_reference(self):
+        self.rq("RQ.CONFIG", "q", "intern", 1)
+        ids = self.rq("RQ.PUSH", "q", self.PAYLOAD, self.PAYLOAD)
+        self.rq("RQ.POP", "COUNT", 2, "q")
+        self.rq("RQ.ACK", "q", ids[0])
+        self.assertEqual(self.info("q")["interned_payloads"], 1)
+        self.rq("RQ.ACK", "q", ids[1])
+        self.assertEqual(self.info("q")["interned_payloads"], 0)
+
+    def test_rdb_round_trip(self):
+        self.rq("RQ.CONFIG", "q", "intern", 1)
+        self.rq("RQ.PUSH", "q", self.PAYLOAD, self.PAYLOAD)
+        self.reload()
+        self.assertEqual(self.info("q")["interned_payloads"], 1)
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ self.PAYLOAD ] * 2)
+
+
+class SpillTest(RQTestCase):
+    def test_spill_and_restore_in_order(self):
+        self.rq("RQ.CONFIG", "q", "spill", 128)
+        payloads = [ b'%d' % i + b'x' * (i % 300) for i in range(2000) ]
+        ids = self.rq("RQ.PUSH", "q", *payloads)
+        info = self.info("q")
+        self.assertGreater(info["spilled_messages"], 0)
+        self.assertGreater(info["spill_writes"], 0)
+        # Read through the spill without restoring it
+        self.assertEqual([ m[0] for m in self.rq("RQ.INSPECT", "q", 1000, 2) ], ids[1000:1002])
+        popped = []
+        while len(popped) < len(ids):
+            popped += self.rq("RQ.POP", "COUNT", 100, "q")
+        self.assertEqual([ m[1] for m in popped ], ids)
+        self.assertEqual([ m[2] for m in popped ], payloads)
+        self.assertGreater(self.info("q")["spill_reads"], 0)
+        self.assertEqual(self.info("q")["spilled_messages"], 0)
+
+    def test_rdb_round_trip(self):
+        self.rq("RQ.CONFIG", "q", "spill", 128)
+        ids = self.rq("RQ.PUSH", "q", *range(1000))
+        self.reload()
+        # Spilled again as they're loaded
+        self.assertGreater(self.info("q")["spilled_messages"], 0)
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], ids)
+
+
+class OffloadTest(RQTestCase):
+    LARGE = b'compressible ' * 100
+
+    def test_offloaded_in_background(self):
+        self.rq("RQ.CONFIG", "q", "offload", 100)
+        ids = self.rq("RQ.PUSH", "q", self.LARGE, b'short')
+        popped = self.rq("RQ.POP", "COUNT", 2, "q")
+        self.assertEqual([ m[2] for m in popped ], [ self.LARGE, b'short' ])
+        time.sleep(0.5)
+        info = self.info("q")
+        self.assertEqual(info["offloaded_payloads"], 1)
+        self.assertEqual(info["offloaded_bytes"], len(self.LARGE))
+        self.assertEqual(self.rq("RQ.INSPECT", "q", "PENDING", 0, 1)[0][1], self.LARGE)
+        # Paged back in when redelivered
+        self.assertEqual(self.rq("RQ.RECOVER", "q", 1, 0)[0][1], self.LARGE)
+        self.rq("RQ.ACK", "q", *ids)
+        self.assertEqual(self.info("q")["offloaded_bytes"], 0)
+
+    def test_compressed_stays_compressed(self):
+        self.rq("RQ.CONFIG", "q", "compress", 512, "offload", 100)
+        self.rq("RQ.PUSH", "q", self.LARGE)
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        compact = self.rq("RQ.COMPACT", "q")
+        self.assertEqual(compact[compact.index(b'payloads_moved') + 1], 1)
+        info = self.info("q")
+        self.assertEqual(info["offloaded_payloads"], 1)
+        self.assertLess(info["offloaded_bytes"], len(self.LARGE))
+        self.assertEqual(self.rq("RQ.INSPECT", "q", "PENDING", 0, 1)[0][1], self.LARGE)
+        self.reload()
+        self.assertEqual(self.rq("RQ.INSPECT", "q", "PENDING", 0, 1)[0][1], self.LARGE)
+        self.assertEqual(self.rq("RQ.RECOVER", "q", 1, 0)[0][1], self.LARGE)
+
+
+class AckRangeTest(RQTestCase):
+    def delivered(self, n):
+        ids = self.rq("RQ.PUSH", "q", *range(n))
+        self.rq("RQ.POP", "COUNT", n, "q")
+        return ids
+
+    def test_ackrange(self):
+        ids = self.delivered(10)
+        self.assertEqual(self.rq("RQ.ACKRANGE", "q", ids[2], ids[6]), 5)
+        self.assertEqual(self.pending("q"), ids[:2] + ids[7:])
+        # Already acknowledged ones are not counted again
+        self.assertEqual(self.rq("RQ.ACKRANGE", "q", ids[0], ids[6]), 2)
+        self.assertEqual(self.rq("RQ.ACKRANGE", "q", ids[9], ids[7]), 0)
+
+    def test_ack_upto(self):
+        ids = self.delivered(10)
+        self.assertEqual(self.rq("RQ.ACK", "q", "UPTO", ids[4]), 5)
+        self.assertEqual(self.pending("q"), ids[5:])
+        self.assertEqual(self.rq("RQ.ACK", "q", "UPTO", ids[4]), 0)
+
+    def test_skips_redelivered_order(self):
+        ids = self.delivered(4)
+        # Redelivered messages move to the end of the delivered queue
+        self.rq("RQ.RECOVER", "q", 1, 0)
+        self.assertEqual(self.rq("RQ.ACK", "q", "UPTO", ids[1]), 2)
+        self.assertEqual(self.pending("q"), ids[2:])
+
+    def test_errors(self):
+        ids = self.delivered(1)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.ACKRANGE", "q", ids[0], "nope")
+        self.assertEqual(self.rq("RQ.ACKRANGE", "missing", ids[0], ids[0]), 0)
+
+class BatchTest(RQTestCase):
+    def pop_batch(self, count, key="q"):
+        popped, tokens = self.rq("RQ.POP", "COUNT", count, "BATCH", key)
+        return [ m[1] for m in popped ], tokens[1]
+
+    def test_ack_batch(self):
+        self.rq("RQ.PUSH", "q", *range(10))
+        ids, token = self.pop_batch(10)
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token, "EXCEPT", ids[3], ids[7]), 8)
+        self.assertEqual(self.pending("q"), [ ids[3], ids[7] ])
+        # The ones left out are still part of the batch
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token), 2)
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token), 0)
+
+    def test_redelivered_left_alone(self):
+        self.rq("RQ.PUSH", "q", *range(4))
+        ids, token = self.pop_batch(4)
+        self.rq("RQ.NACK", "q", ids[1])
+        again, _ = self.pop_batch(1)
+        self.assertEqual(again, [ ids[1] ])
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token), 3)
+        self.assertEqual(self.pending("q"), [ ids[1] ])
+
+    def test_only_members_acked(self):
+        self.rq("RQ.PUSH", "q", *range(4))
+        first, token = self.pop_batch(2)
+        self.rq("RQ.POP", "COUNT", 2, "q")
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token), 2)
+        self.assertEqual(len(self.pending("q")), 2)
+
+    def test_rdb_round_trip(self):
+        self.rq("RQ.PUSH", "q", *range(6))
+        ids, token = self.pop_batch(3)
+        others = [ m[1] for m in self.rq("RQ.POP", "COUNT", 3, "q") ]
+        self.reload()
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token, "EXCEPT", ids[0]), 2)
+        self.assertEqual(self.pending("q"), [ ids[0] ] + others)
+        # Batch numbers go on from where they were
+        self.rq("RQ.PUSH", "q", "x")
+        _, later = self.pop_batch(1)
+        self.assertGreater(int(later.split(b':')[0]), int(token.split(b':')[0]) + 1)
+
+    def test_invalid_token(self):
+        self.rq("RQ.PUSH", "q", "a")
+        self.pop_batch(1)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.ACK", "q", "BATCH", "nope")
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", "99:1-1:1-1"), 0)
+
+    def test_token_must_match_batch(self):
+        self.rq("RQ.PUSH", "q", *range(4))
+        ids, token = self.pop_batch(4)
+        number = token.split(b':')[0].decode()
+        for forged in [ number + ":0-0:0-0", number + ":" + ids[0].decode() + ":" + ids[2].decode() ]:
+            with self.assertRaises(redis.ResponseError):
+                self.rq("RQ.ACK", "q", "BATCH", forged)
+        self.assertEqual(self.pending("q"), ids)
+        self.assertEqual(self.rq("RQ.ACK", "q", "BATCH", token), 4)
+
+class MultiKeyTest(RQTestCase):
+    def test_mpush(self):
+        reply = self.rq("RQ.MPUSH", "q1", 2, "a", "b", "q2", 1, "c")
+        self.assertEqual([ len(ids) for ids in reply ], [ 2, 1 ])
+        self.assertEqual([ m[1] for m in self.undelivered("q1") ], [ b'a', b'b' ])
+        self.assertEqual([ m[0] for m in self.undelivered("q2") ], reply[1])
+
+    def test_mpush_wrong_type_pushes_nothing(self):
+        self.r.set("str", "x")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.MPUSH", "q", 1, "a", "str", 1, "b")
+        self.assertEqual(self.r.exists("q"), 0)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.MPUSH", "q", 2, "a")
+
+    def test_mack(self):
+        self.rq("RQ.MPUSH", "q1", 2, "a", "b", "q2", 1, "c")
+        popped = self.rq("RQ.POP", "COUNT", 3, "q1", "q2")
+        ids = [ m[1] for m in popped ]
+        reply = self.rq("RQ.MACK", "q1", 1, ids[0], "q2", 1, ids[2], "missing", 1, ids[1])
+        self.assertEqual(reply, [ [ ids[0] ], [ ids[2] ], None ])
+        self.assertEqual(self.pending("q1"), [ ids[1] ])
+        self.assertEqual(self.pending("q2"), [])
+
+    def test_pop_keys(self):
+        self.assertEqual(self.command("GETKEYS", "RQ.POP", "q"), [ b'q' ])
+        keys = self.command("GETKEYS", "RQ.POP", "COUNT", 2, "BLOCK", 10, "FORMAT", "GROUPED", "q1", "q2")
+        self.assertEqual(keys, [ b'q1', b'q2' ])
+        keys = self.command("GETKEYS", "RQ.ACKPOP", "q", "1-1", "POP", "NOACK", "q1", "q2")
+        self.assertEqual(keys, [ b'q', b'q1', b'q2' ])
+
+class CompactReplyTest(RQTestCase):
+    def test_pushex_range(self):
+        first, last, count = self.rq("RQ.PUSHEX", "q", "RANGE", "PAYLOADS", "a", "b", "c")
+        self.assertEqual(count, 3)
+        ids = [ m[0] for m in self.undelivered("q") ]
+        self.assertEqual((ids[0], ids[-1], len(ids)), (first, last, 3))
+
+    def test_pushex_payloads_as_is(self):
+        ids = self.rq("RQ.PUSHEX", "q", "PAYLOADS", "RANGE", "PAYLOADS")
+        self.assertEqual(len(ids), 2)
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'RANGE', b'PAYLOADS' ])
+
+    def test_push_never_takes_options(self):
+        self.assertEqual(len(self.rq("RQ.PUSH", "q", "RANGE", "a", "b")), 3)
+        self.assertEqual(self.undelivered("q")[0][1], b'RANGE')
+
+    def test_pushex_errors(self):
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.PUSHEX", "q", "RANGE", "a", "b")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.PUSHEX", "q", "RANGE", "PAYLOADS")
+        self.assertEqual(self.r.exists("q"), 0)
+
+    def test_ack_count(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b")
+        self.rq("RQ.POP", "COUNT", 2, "q")
+        self.assertEqual(self.rq("RQ.ACK", "q", "COUNT", ids[0], ids[1], b'1-1'), [ 2, [ b'1-1' ] ])
+
+class PopFormatTest(RQTestCase):
+    def test_grouped(self):
+        a = self.rq("RQ.PUSH", "q1", "a", "b")
+        c = self.rq("RQ.PUSH", "q2", "c")
+        reply = self.rq("RQ.POP", "COUNT", 3, "FORMAT", "GROUPED", "q1", "q2")
+        self.assertEqual(reply, [ [ b'q1', [ a[0], b'a', a[1], b'b' ] ], [ b'q2', [ c[0], b'c' ] ] ])
+
+    def test_packed(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "bc")
+        [ (key, packed, payloads) ] = self.rq("RQ.POP", "COUNT", 2, "FORMAT", "PACKED", "q")
+        self.assertEqual(key, b'q')
+        self.assertEqual(payloads, [ b'a', b'bc' ])
+        unpacked = [ struct.unpack(">QQ", packed[i:i + 16]) for i in range(0, len(packed), 16) ]
+        self.assertEqual(unpacked, [ self.msgid(id) for id in ids ])
+        self.assertEqual(self.pending("q"), ids)
+
+    def test_invalid_format(self):
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.POP", "COUNT", 1, "FORMAT", "NOPE", "q")
+
+class PushPackedTest(RQTestCase):
+    @staticmethod
+    def pack(*payloads):
+        return b''.join(struct.pack("<I", len(p)) + p for p in payloads)
+
+    def test_pushpacked(self):
+        payloads = [ b'a', b'', b'x' * 300 ]
+        ids = self.rq("RQ.PUSHPACKED", "q", self.pack(*payloads))
+        self.assertEqual(len(ids), 3)
+        self.assertEqual(self.undelivered("q"), [ [ id, p ] for id, p in zip(ids, payloads) ])
+        first, last, count = self.rq("RQ.PUSHPACKED", "q", "RANGE", self.pack(b'y', b'z'))
+        self.assertEqual(count, 2)
+        self.assertEqual([ m[0] for m in self.undelivered("q")[3:] ], [ first, last ])
+
+    def test_chunk_released(self):
+        ids = self.rq("RQ.PUSHPACKED", "q", self.pack(*[ b'%d' % i for i in range(100) ]))
+        self.rq("RQ.POP", "COUNT", 100, "q")
+        self.rq("RQ.ACK", "q", *ids)
+        self.assertEqual(self.undelivered("q"), [])
+        self.assertEqual(self.pending("q"), [])
+
+    def test_rdb_round_trip(self):
+        payloads = [ b'%d' % i for i in range(10) ]
+        self.rq("RQ.PUSHPACKED", "q", self.pack(*payloads))
+        self.reload()
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], payloads)
+
+    def test_malformed(self):
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.PUSHPACKED", "q", b'\x05\x00\x00\x00ab')
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.PUSHPACKED", "q", b'')
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.PUSHPACKED", "q", "NOPE", self.pack(b'a'))
+        self.assertEqual(self.r.exists("q"), 0)
+
+class ExecTest(RQTestCase):
+    PUSH, ACK, TOUCH, NACK = 1, 2, 3, 4
+
+    def push(self, k, payload):
+        return exec_op(self.PUSH, k, struct.pack("<I", len(payload)) + payload)
+
+    def test_push_and_ack(self):
+        ids = self.rq("RQ.PUSH", "q1", "a", "b")
+        self.rq("RQ.POP", "COUNT", 2, "q1")
+        ops = self.push(0, b'c') + exec_op(self.ACK, 0, exec_id(ids[0])) + self.push(1, b'd') + self.push(1, b'e')
+        packed, acked, touched, nacked, deadlettered = self.rq("RQ.EXEC", 2, "q1", "q2", ops)
+        self.assertEqual((acked, touched, nacked, deadlettered), (1, 0, 0, 0))
+        pushed = [ struct.unpack(">QQ", packed[i:i + 16]) for i in range(0, len(packed), 16) ]
+        self.assertEqual(len(pushed), 3)
+        self.assertEqual([ self.msgid(m[0]) for m in self.undelivered("q2") ], pushed[1:])
+        self.assertEqual([ m[1] for m in self.undelivered("q1") ], [ b'c' ])
+        self.assertEqual(self.pending("q1"), ids[1:])
+
+    def test_touch_and_nack(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b", "c")
+        self.rq("RQ.POP", "COUNT", 3, "q")
+        ops = exec_op(self.TOUCH, 0, exec_id(ids[0]) + struct.pack("<I", 60000))
+        ops += exec_op(self.NACK, 0, exec_id(ids[1]) + struct.pack("<I", 0))
+        ops += exec_op(self.NACK, 0, exec_id(ids[2]) + struct.pack("<I", 100))
+        self.assertEqual(self.rq("RQ.EXEC", 1, "q", ops)[1:], [ 0, 1, 2, 0 ])
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], [ ids[1] ])
+        # Touched with EXTEND: not recovered yet
+        self.assertEqual(self.rq("RQ.RECOVER", "q", 10, 0), [])
+        time.sleep(0.3)
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], [ ids[1], ids[2] ])
+
+    def test_malformed_does_nothing(self):
+        ops = self.push(0, b'a') + exec_op(self.ACK, 0, b'short')
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.EXEC", 1, "q", ops)
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.EXEC", 1, "q", self.push(1, b'a'))
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.EXEC", 1, "q", exec_op(9, 0, b''))
+        self.assertEqual(self.r.exists("q"), 0)
+
+    def test_keys(self):
+        self.assertEqual(self.command("GETKEYS", "RQ.EXEC", 2, "q1", "q2", self.push(0, b'a')), [ b'q1', b'q2' ])
+        # Keys are given by the command itself, argv[1] being numkeys
+        info = self.command("INFO", "RQ.EXEC")[0]
+        self.assertIn(b'movablekeys', info[2])
+        self.assertEqual(info[3:6], [ 0, 0, 0 ])
+
+class NoAckTest(RQTestCase):
+    def test_noack_drops_popped(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b", "c")
+        popped = self.rq("RQ.POP", "COUNT", 2, "NOACK", "q")
+        self.assertEqual([ m[1] for m in popped ], ids[:2])
+        self.assertEqual(self.pending("q"), [])
+        self.assertEqual(self.rq("RQ.RECOVER", "q", 10, 0), [])
+        self.assertEqual(self.rq("RQ.ACK", "q", *ids[:2]), [])
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], ids[2:])
+
+    def test_noack_formats(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b")
+        [ (key, packed, payloads) ] = self.rq("RQ.POP", "COUNT", 2, "NOACK", "FORMAT", "PACKED", "q")
+        self.assertEqual(payloads, [ b'a', b'b' ])
+        self.assertEqual(len(packed), 32)
+        self.assertEqual(self.pending("q"), [])
+
+    def test_noack_blocking(self):
+        self.later(0.2, "RQ.PUSH", "q", "a")
+        popped = self.rq("RQ.POP", "COUNT", 1, "BLOCK", 5000, "NOACK", "q")
+        self.assertEqual([ m[2] for m in popped ], [ b'a' ])
+        self.assertEqual(self.pending("q"), [])
+
+    def test_noack_conflicts(self):
+        self.rq("RQ.PUSH", "q", "a")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.POP", "COUNT", 1, "NOACK", "BATCH", "q")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.POP", "COUNT", 1, "LEASE", 100, "NOACK", "q")
+        self.assertEqual(len(self.undelivered("q")), 1)
+
+class TouchTest(RQTestCase):
+    def delivered(self, *payloads):
+        ids = self.rq("RQ.PUSH", "q", *payloads)
+        self.rq("RQ.POP", "COUNT", len(ids), "q")
+        return ids
+
+    def recovered(self, elapsed):
+        return [ m[0] for m in self.rq("RQ.RECOVER", "q", 100, elapsed) ]
+
+    def test_touch_restarts_lease(self):
+        ids = self.delivered("a")
+        time.sleep(0.2)
+        self.assertEqual(self.rq("RQ.TOUCH", "q", ids[0], b'1-1'), 1)
+        self.assertEqual(self.recovered(150), [])
+        time.sleep(0.2)
+        self.assertEqual(self.recovered(150), ids)
+
+    def test_extend_keeps_deadline(self):
+        ids = self.delivered("a")
+        self.rq("RQ.TOUCH", "q", ids[0], "EXTEND", 100)
+        # Its extension ends within the elapsed time: still 100ms to go
+        time.sleep(0.15)
+        self.assertEqual(self.recovered(100), [])
+        time.sleep(0.1)
+        self.assertEqual(self.recovered(100), ids)
+
+    def test_extended_moved_to_deadline(self):
+        ids = self.delivered("a", "b", "c")
+        self.rq("RQ.TOUCH", "q", ids[1], "EXTEND", 10000)
+        self.assertEqual(self.pending("q"), [ ids[0], ids[2], ids[1] ])
+        # Recovered ones go back before it, as later pops do
+        self.assertEqual(self.recovered(0), [ ids[0], ids[2] ])
+        more = self.delivered("d")
+        self.assertEqual(self.pending("q"), [ ids[0], ids[2] ] + more + [ ids[1] ])
+        # A shorter extension moves it back
+        self.rq("RQ.TOUCH", "q", ids[1], "EXTEND", 5000)
+        self.rq("RQ.TOUCH", "q", ids[0], "EXTEND", 8000)
+        self.assertEqual(self.pending("q"), [ ids[2] ] + more + [ ids[1], ids[0] ])
+
+    def test_extended_split_segments(self):
+        ids = self.delivered(*range(200))
+        self.rq("RQ.TOUCH", "q", *ids[10:150], "EXTEND", 10000)
+        more = self.delivered(*range(100))
+        self.assertEqual(self.pending("q"), ids[:10] + ids[150:] + more + ids[10:150])
+        recovered = [ m[0] for m in self.rq("RQ.RECOVER", "q", 1000, 0) ]
+        self.assertEqual(recovered, ids[:10] + ids[150:] + more)
+        self.assertEqual(self.rq("RQ.ACK", "q", "COUNT", *ids)[0], 200)
+        self.assertEqual(self.pending("q"), more)
+
+    def test_rdb_round_trip(self):
+        ids = self.delivered("a")
+        self.rq("RQ.TOUCH", "q", ids[0], "EXTEND", 10000)
+        self.reload()
+        self.assertEqual(self.recovered(0), [])
+        self.assertEqual(self.pending("q"), ids)
+
+class LeaseTest(RQTestCase):
+    def db(self, n):
+        other = redis.Redis(host=HOST, port=PORT, db=n)
+        self.addCleanup(other.close)
+        return other
+
+    def blocked(self, conn, key):
+        """Pops from "key" waiting for the lease of its message to expire"""
+        return conn.execute_command("RQ.POP", "COUNT", 1, "BLOCK", 5000, key)
+
+    def test_expires_after_reload(self):
+        db1 = self.db(1)
+        ids = db1.execute_command("RQ.PUSH", "q", "a")
+        db1.execute_command("RQ.POP", "COUNT", 1, "LEASE", 300, "q")
+        self.reload()
+        # A queue of the same name in database 0 doesn't get it
+        self.rq("RQ.PUSH", "q", "b")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.assertEqual(self.blocked(db1, "q"), [ [ b'q', ids[0], b'a' ] ])
+        self.assertEqual(self.undelivered("q"), [])
+
+    def test_expires_after_rename(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "LEASE", 300, "q")
+        self.rq("RENAME", "q", "q2")
+        self.assertEqual(self.blocked(self.r, "q2"), [ [ b'q2', ids[0], b'a' ] ])
+
+    def test_expires_after_move(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "LEASE", 300, "q")
+        self.rq("MOVE", "q", 2)
+        self.assertEqual(self.blocked(self.db(2), "q"), [ [ b'q', ids[0], b'a' ] ])
+
+    def test_expires_after_swapdb(self):
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "LEASE", 300, "q")
+        self.rq("SWAPDB", 0, 3)
+        self.assertEqual(self.blocked(self.db(3), "q"), [ [ b'q', ids[0], b'a' ] ])
+
+    def test_rdb_round_trip(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b")
+        self.rq("RQ.POP", "COUNT", 1, "LEASE", 300, "q")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.reload()
+        self.assertEqual(self.info("q")["leases"], 1)
+        self.assertEqual(self.pending("q"), ids)
+        # Only the leased one comes back by itself
+        self.assertEqual(self.blocked(self.r, "q"), [ [ b'q', ids[0], b'a' ] ])
+        self.assertEqual(self.pending("q"), [ ids[1], ids[0] ])
+
+class AutoLeaseTest(RQTestCase):
+    def learn(self, n, latency):
+        """Acknowledges "n" messages "latency" seconds after popping them"""
+        self.rq("RQ.PUSH", "q", *[ "x" ] * n)
+        popped = self.rq("RQ.POP", "COUNT", n, "q")
+        time.sleep(latency)
+        self.rq("RQ.ACK", "q", *[ m[1] for m in popped ])
+
+    def test_initial_until_enough_samples(self):
+        self.learn(31, 0.05)
+        info = self.info("q")
+        self.assertEqual(info["ack_latency_samples"], 31)
+        self.assertEqual(info["lease_auto_ms"], 30000)
+
+    def test_learned_from_acks(self):
+        self.learn(40, 0.05)
+        info = self.info("q")
+        self.assertEqual(info["ack_latency_samples"], 40)
+        # Buckets are 1/8th of a power of two wide
+        self.assertTrue(45 <= info["ack_latency_p50_ms"] <= 70, info)
+        self.assertTrue(90 <= info["lease_auto_ms"] <= 140, info)
+
+    def test_percentile_and_factor(self):
+        self.learn(40, 0.05)
+        self.rq("RQ.CONFIG", "q", "LEASE_PERCENTILE", 50, "LEASE_FACTOR", 4)
+        self.assertTrue(180 <= self.info("q")["lease_auto_ms"] <= 280)
+
+    def test_auto_lease_expires(self):
+        self.learn(40, 0.05)
+        ids = self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "LEASE", "AUTO", "q")
+        self.assertEqual(self.info("q")["leases"], 1)
+        start = time.time()
+        popped = self.rq("RQ.POP", "COUNT", 1, "BLOCK", 5000, "q")
+        self.assertEqual([ m[1] for m in popped ], ids)
+        self.assertLess(time.time() - start, 1)
+
+    def test_queue_setting(self):
+        self.learn(40, 0.05)
+        self.rq("RQ.CONFIG", "q", "LEASE", "AUTO")
+        self.rq("RQ.PUSH", "q", "a")
+        self.rq("RQ.POP", "COUNT", 1, "q")
+        self.assertEqual(self.info("q")["leases"], 1)
+
+    def test_rdb_round_trip(self):
+        self.learn(40, 0.05)
+        before = self.info("q")
+        self.reload()
+        after = self.info("q")
+        for field in ("ack_latency_samples", "ack_latency_p50_ms", "ack_latency_p99_ms", "lease_auto_ms"):
+            self.assertEqual(after[field], before[field], field)
+
+class DelayTest(RQTestCase):
+    def test_push_takes_no_options(self):
+        ids = self.rq("RQ.PUSH", "q", "DELAY", 100, "a")
+        self.assertEqual(len(ids), 3)
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'DELAY', b'100', b'a' ])
+
+    def test_delay(self):
+        ids = self.rq("RQ.PUSHEX", "q", "DELAY", 200, "PAYLOADS", "a", "b")
+        self.assertEqual(self.undelivered("q"), [])
+        self.assertEqual(self.info("q")["delayed"], 2)
+        later = self.rq("RQ.PUSH", "q", "c")
+        start = time.time()
+        popped = self.rq("RQ.POP", "COUNT", 3, "q")
+        self.assertEqual([ m[1] for m in popped ], later)
+        popped = self.rq("RQ.POP", "COUNT", 3, "BLOCK", 5000, "q")
+        self.assertGreaterEqual(time.time() - start, 0.15)
+        self.assertEqual([ m[1] for m in popped ], ids)
+        self.assertEqual(self.info("q")["delayed"], 0)
+
+    def test_at(self):
+        now = int(time.time() * 1000)
+        ids = self.rq("RQ.PUSHEX", "q", "AT", now - 1000, "PAYLOADS", "a")
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], ids)
+        ids = self.rq("RQ.PUSHEX", "q", "RANGE", "AT", now + 200, "PAYLOADS", "b")
+        self.assertEqual(ids[2], 1)
+        self.assertEqual(self.info("q")["delayed"], 1)
+
+    def test_usage(self):
+        for args in (("DELAY", 1, "AT", 1), ("DELAY", -1), ("DELAY", "x"), ("DELAY",), ("SOON",)):
+            with self.assertRaises(redis.ResponseError):
+                self.rq("RQ.PUSHEX", "q", *args, "PAYLOADS", "a")
+        self.assertEqual(self.rq("EXISTS", "q"), 0)
+
+    def test_fires_after_reload(self):
+        db1 = redis.Redis(host=HOST, port=PORT, db=1)
+        self.addCleanup(db1.close)
+        ids = db1.execute_command("RQ.PUSHEX", "q", "DELAY", 300, "PAYLOADS", "a", "b")
+        self.reload()
+        self.assertEqual(db1.execute_command("RQ.INSPECT", "q", 0, 10), [])
+        self.assertEqual(self.rq("EXISTS", "q"), 0)
+        popped = db1.execute_command("RQ.POP", "COUNT", 2, "BLOCK", 5000, "q")
+        self.assertEqual([ (m[1], m[2]) for m in popped ], list(zip(ids, [ b'a', b'b' ])))
+
+    def test_rdb_round_trip(self):
+        ids = self.rq("RQ.PUSHEX", "q", "DELAY", 10000, "PAYLOADS", "a")
+        self.reload()
+        self.assertEqual(self.info("q")["delayed"], 1)
+        self.assertEqual(self.undelivered("q"), [])
+        # Pushed later with the ID it was given
+        self.assertLess(self.msgid(ids[0]), self.msgid(self.rq("RQ.PUSH", "q", "b")[0]))
+
+class NackTest(RQTestCase):
+    def delivered(self, *payloads):
+        ids = self.rq("RQ.PUSH", "q", *payloads)
+        self.rq("RQ.POP", "COUNT", len(ids), "q")
+        return ids
+
+    def test_put_back_in_order(self):
+        ids = self.delivered("a", "b", "c")
+        self.rq("RQ.PUSH", "q", "d")
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids), [ 3, 0 ])
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'a', b'b', b'c', b'd' ])
+        self.assertEqual(self.info("q")["nacked"], 3)
+
+    def test_backoff_without_delay_in_order(self):
+        self.rq("RQ.CONFIG", "q", "BACKOFF", 0)
+        ids = self.delivered("a", "b", "c")
+        self.rq("RQ.PUSH", "q", "d")
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids, "BACKOFF"), [ 3, 0 ])
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'a', b'b', b'c', b'd' ])
+
+    def test_delay_in_order(self):
+        ids = self.delivered("a", "b", "c")
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids, "DELAY", 100), [ 3, 0 ])
+        self.rq("RQ.PUSH", "q", "d")
+        time.sleep(0.3)
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'd', b'a', b'b', b'c' ])
+
+    def test_deadlettered_counted_apart(self):
+        self.rq("RQ.CONFIG", "q", "MAXDELIVERIES", 1, "DEADLETTER", "dlq")
+        ids = self.delivered("a", "b")
+        self.rq("RQ.CONFIG", "q", "MAXDELIVERIES", 2)
+        self.rq("RQ.RECOVER", "q", 1, 0)
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids), [ 1, 1 ])
+        info = self.info("q")
+        self.assertEqual((info["nacked"], info["deadlettered"]), (1, 1))
+        self.assertEqual([ m[1] for m in self.undelivered("dlq") ], [ b'a' ])
+        self.assertEqual([ m[1] for m in self.undelivered("q") ], [ b'b' ])
+
+    def test_exec_deadlettered_counted_apart(self):
+        self.rq("RQ.CONFIG", "q", "MAXDELIVERIES", 1, "DEADLETTER", "dlq")
+        ids = self.delivered("a")
+        ops = exec_op(ExecTest.NACK, 0, exec_id(ids[0]) + struct.pack("<I", 0))
+        self.assertEqual(self.rq("RQ.EXEC", 1, "q", ops)[1:], [ 0, 0, 0, 1 ])
+        self.assertEqual([ m[1] for m in self.undelivered("dlq") ], [ b'a' ])
+
+    def test_rdb_round_trip(self):
+        ids = self.delivered("a")
+        self.rq("RQ.NACK", "q", *ids, "DELAY", 300)
+        self.reload()
+        self.assertEqual(self.info("q")["delayed"], 1)
+        popped = self.rq("RQ.POP", "COUNT", 1, "BLOCK", 5000, "q")
+        self.assertEqual([ m[1] for m in popped ], ids)
+        # Its deliveries were kept: this is the second one
+        self.assertEqual(self.rq("RQ.INSPECT", "q", "PENDING", 0, 1)[0][4], 2)
+
+class DeadLetterTest(RQTestCase):
+    def setUp(self):
+        super().setUp()
+        self.rq("RQ.CONFIG", "q", "MAXDELIVERIES", 1, "DEADLETTER", "dlq")
+
+    def poison(self, *payloads):
+        """Pushes messages that go to the dead-letter queue once negatively acknowledged"""
+        ids = self.rq("RQ.PUSH", "q", *payloads)
+        self.rq("RQ.POP", "COUNT", len(ids), "q")
+        return ids
+
+    def test_config_rejects_other_types(self):
+        self.r.set("str", "x")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.CONFIG", "q", "DEADLETTER", "str")
+        with self.assertRaises(redis.ResponseError):
+            self.rq("RQ.CONFIG", "q", "DEADLETTER", "q")
+        self.assertEqual(self.rq("RQ.CONFIG", "q", "DEADLETTER", ""), b'OK')
+        self.rq("RQ.PUSH", "other", "a")
+        self.assertEqual(self.rq("RQ.CONFIG", "q", "DEADLETTER", "other"), b'OK')
+
+    def test_config_keys(self):
+        self.assertEqual(self.command("GETKEYS", "RQ.CONFIG", "q", "MAXDELIVERIES", 1, "DEADLETTER", "dlq"), [ b'q', b'dlq' ])
+        self.assertEqual(self.command("GETKEYS", "RQ.CONFIG", "q", "DEADLETTER", ""), [ b'q' ])
+
+    def test_config_acl(self):
+        self.rq("ACL", "SETUSER", "rq-test", "on", "nopass", "~q", "+@all")
+        self.addCleanup(self.rq, "ACL", "DELUSER", "rq-test")
+        other = redis.Redis(host=HOST, port=PORT, username="rq-test", password="x")
+        self.addCleanup(other.close)
+        with self.assertRaises(redis.exceptions.NoPermissionError):
+            other.execute_command("RQ.CONFIG", "q", "DEADLETTER", "dlq2")
+        self.assertEqual(other.execute_command("RQ.CONFIG", "q", "LEASE", 100), b'OK')
+
+    def test_only_config_declares_key(self):
+        self.assertEqual(self.command("GETKEYS", "RQ.NACK", "q", "1-1"), [ b'q' ])
+        self.assertEqual(self.command("GETKEYS", "RQ.RECOVER", "q", 10, 0), [ b'q' ])
+        # Clients of the queue fill the dead-letter queue set up by RQ.CONFIG
+        self.rq("ACL", "SETUSER", "rq-test", "on", "nopass", "~q", "+@all")
+        self.addCleanup(self.rq, "ACL", "DELUSER", "rq-test")
+        other = redis.Redis(host=HOST, port=PORT, username="rq-test", password="x")
+        self.addCleanup(other.close)
+        ids = self.poison("a")
+        self.assertEqual(other.execute_command("RQ.NACK", "q", *ids), [ 0, 1 ])
+        self.assertEqual(len(self.undelivered("dlq")), 1)
+
+    def test_errors_counted(self):
+        self.r.set("dlq", "x")
+        ids = self.poison("a", "b")
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids), [ 2, 0 ])
+        info = self.info("q")
+        self.assertEqual((info["deadlettered"], info["deadletter_errors"]), (0, 2))
+        self.assertEqual([ m[0] for m in self.undelivered("q") ], ids)
+
+    def test_expired_leases_in_order(self):
+        ids = self.rq("RQ.PUSH", "q", "a", "b")
+        self.rq("RQ.POP", "COUNT", 2, "LEASE", 50, "q")
+        popped = self.rq("RQ.POP", "COUNT", 2, "BLOCK", 5000, "dlq")
+        self.assertEqual([ m[2] for m in popped ], [ b'a', b'b' ])
+        self.assertEqual([ m[5:] for m in self.rq("RQ.INSPECT", "dlq", "PENDING", 0, 10) ], [ [ b'q', ids[0] ], [ b'q', ids[1] ] ])
+
+    def test_origin_inspected(self):
+        ids = self.poison("a", "b")
+        self.assertEqual(self.rq("RQ.NACK", "q", *ids), [ 0, 2 ])
+        dead = self.undelivered("dlq")
+        self.assertEqual([ m[1:] for m in dead ], [ [ b'a', b'q', ids[0] ], [ b'b', b'q', ids[1] ] ])
+        self.rq("RQ.POP", "COUNT", 1, "dlq")
+        [ pending ] = self.rq("RQ.INSPECT", "dlq", "PENDING", 0, 10)
+        self.assertEqual(pending[0], dead[0][0])
+        self.assertEqual(pending[5:], [ b'q', ids[0] ])
+        # Plain messages have none
+        self.rq("RQ.PUSH", "dlq", "c")
+        self.assertEqual(len(self.undelivered("dlq")[-1]), 2)
+
+    def test_origin_kept_when_dead_lettered_again(self):
+        self.rq("RQ.CONFIG", "dlq", "MAXDELIVERIES", 1, "DEADLETTER", "dlq2")
+        ids = self.poison("a")
+        self.rq("RQ.NACK", "q", *ids)
+        popped = self.rq("RQ.POP", "COUNT", 1, "dlq")
+        self.rq("RQ.NACK", "dlq", popped[0][1])
+        self.assertEqual([ m[1:] for m in self.undelivered("dlq2") ], [ [ b'a', b'q', ids[0] ] ])
+
+    def test_origin_forgotten(self):
+        ids = self.poison("a", "b")
+        self.rq("RQ.NACK", "q", *ids)
+        self.rq("RQ.PUSH", "plain", "a", "b")
+        # Gone for good: acknowledged, or popped without acknowledgement
+        for key in ("dlq", "plain"):
+            self.rq("RQ.POP", "COUNT", 1, "NOACK", key)
+            [ (_, id, _) ] = self.rq("RQ.POP", "COUNT", 1, key)
+            self.rq("RQ.ACK", key, id)
+        self.assertEqual(self.rq("MEMORY", "USAGE", "dlq"), self.rq("MEMORY", "USAGE", "plain"))
+
+    def test_rdb_round_trip(self):
+        ids = self.poison("a")
+        self.rq("RQ.NACK", "q", *ids)
+        self.reload()
+        self.assertEqual([ m[1:] for m in self.undelivered("dlq") ], [ [ b'a', b'q', ids[0] ] ])
+
+if __name__ == "__main__":
+    if sys.argv[1:2] == [ "load" ]:
+        asyncio.run(main())
+    elif sys.argv[1:2] == [ "bench" ]:
+        bench(int(sys.argv[2]) if len(sys.argv) > 2 else 10000)
+    else:
+        unittest.main()